@@ -6,6 +6,12 @@ set LIBS=-Lc:/Localdata/gtk2.24-32/lib -lgtk-win32-2.0 -lgdk-win32-2.0 -lcairo -
 
 PATH=c:/localdata/mingw/lib;c:/localdata/mingw/bin;c:/localdata/gtk2.24-32/bin;c:/localdata/gtk2.24-32/lib;%PATH%
 
-C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% *.c -o robot_sim.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim.c render.c worker.c sim.c trace.c -o robot_sim.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim_cli.c timing.c validate.c sim.c trace.c -o robot_sim_cli.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim_stream.c sim.c trace.c -o robot_sim_stream.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim_gen.c sim.c trace.c -o robot_sim_gen.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim_compile.c sim.c trace.c -o robot_sim_compile.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim_bench.c render.c timing.c validate.c sim.c trace.c -o robot_sim_bench.exe %LIBS%
+C:/localdata/mingw/bin/gcc.exe -std=c99 %CFLAGS% robot_sim_test.c render.c worker.c timing.c validate.c sim.c trace.c -o robot_sim_test.exe %LIBS%
 rem C:/localdata/mingw/bin/ld.exe -o robot_sim.exe robot_sim.o %LIBS%
 
@@ -0,0 +1,200 @@
+#include <math.h>
+
+#include <glib.h>
+#include <cairo.h>
+
+#include "sim.h"
+#include "trace.h"
+#include "render.h"
+
+static inline gsize lod_pose(const struct lod_level *level, gsize k)
+{
+    return level ? level->poses[k] : k;
+}
+
+// Whether the level left poses out just before its kth as drawn already
+static inline gboolean lod_break(const struct lod_level *level, gsize k)
+{
+    return level && k < level->n && level->breaks[k];
+}
+
+/**
+ * Draws poses [from, to) as one path per stroke, joined on to pose from - 1
+ * if it's in the same stroke. Only the poses in the coarsest level of detail
+ * that looks right at this scale are visited, and of those, points that land
+ * within half a pixel of the last one drawn are skipped, so the cost tracks
+ * what's visible rather than the number of steps.
+ */
+void draw_strokes(cairo_t *cr, const struct draw_data *data, gsize from, gsize to, float scale)
+{
+    const float *xs = data->pos_data, *ys = data->pos_data + data->nposes;
+    const struct lod_level *level = lod_for_scale(data, scale);
+    if(from >= to) return;
+    gint64 t = trace_begin();
+
+    // Same look as a 2 pixel radius dot on every pose
+    cairo_set_line_width(cr, 4);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+
+    gsize kfrom = level ? lod_find(level, from) : from;
+    gsize kto = level ? lod_find(level, to) : to;
+    guint s = stroke_at(data, from);
+    gsize end = stroke_end(data, s);
+    // Every level keeps the first pose of every stroke, so the one before
+    // kfrom is in the same stroke unless from starts it
+    if(from > g_array_index(data->strokes, gsize, s)) kfrom--;
+
+    gsize prev = lod_pose(level, kfrom);
+    float lastx = xs[prev] * scale, lasty = ys[prev] * scale;
+    cairo_move_to(cr, lastx, lasty);
+    for(gsize k = kfrom + 1; k < kto; k++) {
+        gsize j = lod_pose(level, k);
+        // A new stroke, or the same one not joined over what the level left out
+        if(j >= end || lod_break(level, k)) {
+            // Always finish where the line does, single poses come out as dots
+            cairo_line_to(cr, xs[prev] * scale, ys[prev] * scale);
+            if(j >= end) {
+                cairo_stroke(cr);
+                end = stroke_end(data, ++s);
+            }
+            lastx = xs[j] * scale;
+            lasty = ys[j] * scale;
+            cairo_move_to(cr, lastx, lasty);
+            prev = j;
+            continue;
+        }
+        prev = j;
+        float px = xs[j] * scale, py = ys[j] * scale;
+        if(fabsf(px - lastx) < 0.5 && fabsf(py - lasty) < 0.5) continue;
+        cairo_line_to(cr, px, py);
+        lastx = px;
+        lasty = py;
+    }
+    // The last stroke can stop part way, on a pose the level didn't keep,
+    // which only joins on if nothing was left out before the next kept one
+    if(lod_break(level, kto)) {
+        cairo_line_to(cr, xs[prev] * scale, ys[prev] * scale);
+        cairo_move_to(cr, xs[to - 1] * scale, ys[to - 1] * scale);
+    }
+    cairo_line_to(cr, xs[to - 1] * scale, ys[to - 1] * scale);
+    cairo_stroke(cr);
+    trace_end(span_render, t);
+}
+
+/**
+ * The timings and counters so far, in a box in the top left corner, in
+ * device units whatever the transform.
+ */
+void draw_trace_overlay(cairo_t *cr)
+{
+    const double line = 14, pad = 6;
+    char text[128];
+
+    cairo_save(cr);
+    cairo_identity_matrix(cr);
+    cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 12);
+    cairo_set_source_rgba(cr, 1, 1, 1, 0.8);
+    cairo_rectangle(cr, 0, 0, 420, 2 * pad + line * (TRACE_SPANS + TRACE_COUNTERS));
+    cairo_fill(cr);
+
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    double y = pad + line - 3;
+    for(enum trace_span span = 0; span < TRACE_SPANS; span++, y += line) {
+        struct trace_stats st;
+        trace_stats(span, &st);
+        g_snprintf(text, sizeof(text), "%-16s %7lu  last %8.2f  avg %8.2f  max %8.2f ms",
+                   trace_span_name(span), (unsigned long)st.n, st.last / 1000.0,
+                   st.n ? st.total / 1000.0 / st.n : 0.0, st.max / 1000.0);
+        cairo_move_to(cr, pad, y);
+        cairo_show_text(cr, text);
+    }
+    for(enum trace_counter counter = 0; counter < TRACE_COUNTERS; counter++, y += line) {
+        g_snprintf(text, sizeof(text), "%-16s %10.2f MB", trace_counter_name(counter),
+                   trace_counter(counter) / (1024.0 * 1024.0));
+        cairo_move_to(cr, pad, y);
+        cairo_show_text(cr, text);
+    }
+    cairo_restore(cr);
+}
+
+/**
+ * Starts the cached drawing again from a blank sheet with the spools on it.
+ */
+void render_cache_reset(struct render_cache *cache, int width, int height,
+                        float scale, float spool_x)
+{
+    const float pi2 = 6.28318530718;
+
+    if(cache->surface &&
+       (width != cache->width || height != cache->height)) {
+        cairo_surface_destroy(cache->surface);
+        cache->surface = NULL;
+    }
+    if(!cache->surface)
+        cache->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    cache->width = width;
+    cache->height = height;
+    cache->scale = scale;
+    cache->nposes = 0;
+
+    cairo_t *cr = cairo_create(cache->surface);
+    cairo_set_source_rgb(cr,1,1,1);
+    cairo_paint(cr);
+
+    cairo_set_source_rgb(cr,0.5,0.5,0.5);
+    cairo_arc(cr, 0, 0, 20, 0, pi2);
+    cairo_fill(cr);
+    cairo_arc(cr, spool_x, 0, 20, 0, pi2);
+    cairo_fill(cr);
+    cairo_destroy(cr);
+}
+
+void render_cache_free(struct render_cache *cache)
+{
+    if(cache->surface) cairo_surface_destroy(cache->surface);
+    cache->surface = NULL;
+}
+
+/**
+ * Redraw of a big program, a dot per pose as it used to be vs. strokes.
+ * Only runs with -m perf.
+ */
+void render_perf_test()
+{
+    if(!g_test_perf()) return;
+    const float pi2 = 6.28318530718;
+    struct draw_data data;
+    draw_data_defaults(&data);
+    make_test_steps(&data, 2 * 1000 * 1000);
+    recalc_draw_data(&data);
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1400, 850);
+    cairo_t *cr = cairo_create(surface);
+    const float scale = 1400 / data.spool_dist;
+    const float *xs = data.pos_data, *ys = data.pos_data + data.nposes;
+
+    g_test_timer_start();
+    for(gsize i = 0; i < data.nposes; i++) {
+      cairo_arc(cr, xs[i] * scale, ys[i] * scale, 2, 0, pi2);
+      cairo_fill(cr);
+    }
+    double dots = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    draw_strokes(cr, &data, 0, data.nposes, scale);
+    double strokes = g_test_timer_elapsed();
+
+    // A quarter of the size, as if the window were shrunk
+    g_test_timer_start();
+    draw_strokes(cr, &data, 0, data.nposes, scale / 4);
+    double small = g_test_timer_elapsed();
+
+    g_test_minimized_result(dots, "dots: %.3fs for %lu poses", dots, (unsigned long)data.nposes);
+    g_test_minimized_result(strokes, "strokes: %.3fs for %u strokes", strokes, data.strokes->len);
+    g_test_minimized_result(small, "strokes at 1/4 size: %.3fs", small);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    free_draw_data(&data);
+}
@@ -0,0 +1,31 @@
+#ifndef RENDER_H
+#define RENDER_H
+/**
+ * Drawing the simulated poses with cairo. Doesn't need GTK, so the
+ * benchmark can render off-screen the same way the GUI does.
+ */
+#include <cairo.h>
+
+#include "sim.h"
+
+/**
+ * The drawing so far, kept off-screen so an expose is just a blit and
+ * stepping forward only draws the new poses.
+ */
+struct render_cache {
+    cairo_surface_t *surface;
+    int width, height;
+    float scale;
+    gsize nposes; // poses already drawn onto surface
+    gboolean partial; // from the worker's unfinished results
+    guint results; // which of the worker's results
+};
+
+void draw_strokes(cairo_t *cr, const struct draw_data *data, gsize from, gsize to, float scale);
+void draw_trace_overlay(cairo_t *cr);
+void render_cache_reset(struct render_cache *cache, int width, int height,
+                        float scale, float spool_x);
+void render_cache_free(struct render_cache *cache);
+void render_perf_test();
+
+#endif
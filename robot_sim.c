@@ -8,235 +8,91 @@
 #include <gdk/gdk.h>
 #include <gdk/gdkkeysyms.h>
 
-#define LEFT 0
-#define RIGHT 1
-#define PEN 2
+#include "sim.h"
+#include "trace.h"
+#include "render.h"
+#include "worker.h"
 
-#define LEF_MASK 0b110000
-#define RIG_MASK 0b001100
-#define PEN_MASK 0b000011
-
-#define LEF_SHIFT 4
-#define RIG_SHIFT 2
-#define PEN_SHIFT 0
-
-#define POS_CHAR '+'
-#define NEG_CHAR '-'
-#define NOP_CHAR '.'
-
-#define POS_NUM 0b01
-#define NEG_NUM 0b10
-#define NOP_NUM 0b00
+/******************* WORKER *************************/
 /**
- * File format is 3 characters per line.
- * Each character is either '+', '-' or any other usually '.'.
- * + means step clockwise or put pen down
- * - means step anti-clockwise or pick pen up
- * . means no action for this time-step
- *
- * The first character is the left motor command.
- * The second character is the right motor command.
- * The third character is the pen command.
+ * What the window's callbacks need: the worker, and the widgets it shows
+ * its progress and what it loaded in.
  */
+struct ui {
+    struct worker worker;
+    gboolean progress_queued; // guarded by the worker's lock
+    GtkWidget *drawing_area, *progress, *slider;
+    GtkWidget *robot_type, *paper_offset_x, *paper_offset_y, *spool_dist;
+    GtkWidget *step_dist, *left_length, *right_length;
+    guint settings_idle; // apply_settings is queued
+};
 
-/*********** PACKING AND UNPACKING TRIPLETS **************/
-
-char to_num(char ch)
-{
-    switch(ch) {
-        case POS_CHAR: return POS_NUM;
-        case NEG_CHAR: return NEG_NUM;
-        default: return NOP_NUM;
-    }
-}
-
-char to_char(char ch)
-{
-    switch(ch) {
-        case POS_NUM: return POS_CHAR;
-        case NEG_NUM: return NEG_CHAR;
-        default: return NOP_CHAR;
-    }
-}
-
-unsigned int pack(char ins[3])
-{
-    unsigned int res = 0;
-    res += to_num(ins[LEFT]) << LEF_SHIFT;
-    res += to_num(ins[RIGHT]) << RIG_SHIFT;
-    res += to_num(ins[PEN]) << PEN_SHIFT;
-    return res;
-}
-
-void unpack(char ins[3], unsigned int val)
+static gboolean worker_progress_idle(gpointer uip)
 {
-    ins[LEFT] = to_char((char)((val & LEF_MASK) >> LEF_SHIFT));
-    ins[RIGHT] = to_char((char)((val & RIG_MASK) >> RIG_SHIFT));
-    ins[PEN] = to_char((char)((val & PEN_MASK) >> PEN_SHIFT));
+    struct ui *ui = uip;
+    struct worker *w = &ui->worker;
+
+    g_mutex_lock(&w->lock);
+    const char *stage = w->stage;
+    double fraction = w->fraction;
+    gboolean partial = w->partial;
+    ui->progress_queued = FALSE;
+    g_mutex_unlock(&w->lock);
+
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(ui->progress), stage);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(ui->progress), fraction);
+    if(partial) gtk_widget_queue_draw(ui->drawing_area);
+    return FALSE;
 }
 
-void pack_unpack_test()
+// On the worker thread, with its lock held
+static void worker_progress(struct worker *w)
 {
-    char test[3][3] = {"+-.", ".+-", "-.+"};
-    g_assert(pack(test[0]) == 0b011000);
-
-
-    char out[3];
-    for(int i = 0; i < 3; i++) {
-        memset(out, 0, 3);
-        unpack(out, pack(test[i]));
-        /* printf("%c%c%c\n", test[i][0], test[i][1], test[i][2]); */
-        /* printf("%c%c%c\n", out[0], out[1], out[2]); */
-        g_assert(0 == strncmp(test[i], out, 3));
-    }
+    struct ui *ui = w->user;
+    if(ui->progress_queued) return;
+    ui->progress_queued = TRUE;
+    g_idle_add(worker_progress_idle, ui);
 }
 
-/********** INPUT FILE READING *******************/
-enum robot_type { wires, planar, elbow };
-struct draw_data {
-    GList *steps;
-    GList *poses;
-    float *pos_data;
-    enum robot_type type;
-    float start_llen, start_rlen;
-    float paper_offset_y, paper_offset_x;
-    float spool_dist;
-    float step_dist;
-};
 /**
- * Reads a file of triples, one on each line.
- * If it encounters a bad line it will continue and return the
- * negative 1-indexed line number, otherwise returns the number of lines read
- * without incedent.
- * */
-int read_file(FILE *f, GList **list)
-{
-    char line[3];
-    unsigned int i = 0;
-    int err = 0;
-    while(!feof(f)) {
-        i++;
-        if(3 != fscanf(f, "%c%c%c\n", &line[0], &line[1], &line[2])) 
-            err = -i;
-        else 
-            *list = g_list_prepend(*list, GINT_TO_POINTER(pack(line)));
-        /* printf("%c%c%c\n", line[0], line[1], line[2]); */
-
-        /* GList *first = g_list_first(*list); */
-        /* if(first) { */
-        /*     // printf("%p\n", first->data); */
-        /*     char out[3]; */
-        /*     unpack(out, GPOINTER_TO_INT(first->data)); */
-        /*     printf("%c%c%c\n", out[0], out[1], out[2]); */
-        /* } */
-    }
-    return err ? err : i;
-}
-// that was easier than I expected!
-
-long int fscan_float_maybe(FILE *f, char *str, float *var, long int pos)
-{
-    if(1 == fscanf(f, str, var)) 
-      pos = ftell(f);
-    else
-      fseek(f, pos, SEEK_SET);
-    return pos;
-}
-int read_data(char *fname, struct draw_data *data)
+ * Back on the main thread, shows what the worker came up with.
+ */
+static gboolean worker_done_idle(gpointer uip)
 {
-    FILE *f = fopen(fname, "r");
-    if(!f) {
-        printf("Failed to open file %s\n", fname);
-        return -1;
+    struct ui *ui = uip;
+    struct draw_data *front = ui->worker.front;
+
+    if(worker_take_results(&ui->worker)) {
+        // Show the file's settings, which match so don't start another job
+        gtk_combo_box_set_active(GTK_COMBO_BOX(ui->robot_type), front->type);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(ui->paper_offset_x), front->paper_offset_x);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(ui->paper_offset_y), front->paper_offset_y);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(ui->spool_dist), front->spool_dist);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(ui->step_dist), front->step_dist);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(ui->left_length), front->start_llen);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(ui->right_length), front->start_rlen);
+        // Rescale the playback slider to the new program, showing all of it
+        gtk_range_set_range(GTK_RANGE(ui->slider), 0, MAX(front->steps.nsteps, 1));
+        gtk_range_set_value(GTK_RANGE(ui->slider), front->steps.nsteps);
     }
-    long int pos = ftell(f);
-    pos = fscan_float_maybe(f, "Paper Offset Y: %f\n", &data->paper_offset_y, pos);
-    pos = fscan_float_maybe(f, "Paper Offset X: %f\n", &data->paper_offset_x, pos);
-    pos = fscan_float_maybe(f, "Step Distance: %f\n", &data->step_dist, pos);
-    pos = fscan_float_maybe(f, "Spool Distance: %f\n", &data->spool_dist, pos);
-    pos = fscan_float_maybe(f, "Start Length Left: %f\n", &data->start_llen, pos);
-    pos = fscan_float_maybe(f, "Start Length Right: %f\n", &data->start_rlen, pos);
-
-    printf("(%f, %f), %f, %f, (%f, %f)\n",
-        data->paper_offset_y,
-        data->paper_offset_x,
-        data->step_dist,
-        data->spool_dist,
-        data->start_llen,
-        data->start_rlen);
-
-    if(data->steps != NULL) {
-      g_list_free(data->steps);
-      data->steps = NULL;
+    if(front->snaps->len) {
+        struct pose_range *first = &g_array_index(front->snaps, struct pose_range, 0);
+        printf("You snapped a string! %u times, first at pose %lu\n",
+               front->snaps->len, (unsigned long)first->start);
     }
-    int read_res = read_file(f, &data->steps);
-    if(read_res < 0) 
-        printf("Non-fatal error reading file, last error found on line %i\n", -read_res);
-    
-    fclose(f);
-    data->steps = g_list_reverse(data->steps);
-    printf("Read %i steps\n", g_list_length(data->steps));
-    return 0;
+    gtk_widget_queue_draw(ui->drawing_area);
+    return FALSE;
 }
 
-/***************** GEOMETRY *********************/
-
-void to_coords(float *x, float *y, float spool_dist, float llen, float rlen, enum robot_type type)
+// On the worker thread, with its lock held
+static void worker_finished(struct worker *w)
 {
-    if(llen + rlen < spool_dist) {
-        printf("You snapped a string!\n"); fflush(NULL); 
-        return;
-    }
-    float xf = (spool_dist*spool_dist + llen*llen - rlen*rlen) / (2.0 * spool_dist);
-    *x = xf;
-    *y = sqrt(llen*llen - xf*xf);
+    g_idle_add(worker_done_idle, w->user);
 }
 
-void recalc_draw_data(struct draw_data *data)
+static struct ui *ui_of(GtkWidget *widget)
 {
-    gboolean pen_down = FALSE;
-    float x, y;
-    float rlen = data->start_rlen;
-    float llen = data->start_llen;
-    char lrp[3]; // left, right, pen
-    int nposes = 0;
-
-    g_list_free(data->poses);
-    data->poses = NULL;
-    if(data->pos_data != NULL) free(data->pos_data);
-
-    // allocate enough memory for one set of coords for every step.
-    data->pos_data = malloc(2 * g_list_length(data->steps) * sizeof(float));
-    memset(data->pos_data, 0, 2 * g_list_length(data->steps) * sizeof(float));
-
-    for(GList *step = data->steps; step != NULL; step = step->next) {
-        // Process the movement
-        unpack(lrp, GPOINTER_TO_INT(step->data));
-        //printf("%c%c%c\n", lrp[0], lrp[1], lrp[2]);
-        switch(lrp[LEFT]) {
-            case POS_CHAR: llen += data->step_dist; break;
-            case NEG_CHAR: llen -= data->step_dist; break;
-        }
-        switch(lrp[RIGHT]) {
-            case POS_CHAR: rlen += data->step_dist; break;
-            case NEG_CHAR: rlen -= data->step_dist; break;
-        }
-        switch(lrp[PEN]) {
-            case POS_CHAR: pen_down = TRUE; break;
-            case NEG_CHAR: pen_down = FALSE; break;
-        }
-        
-        // Was there actually a movement worth recording?
-        // not if the pen wasn't down there wasn't!
-        if(!pen_down) continue;
-        to_coords(&x, &y, data->spool_dist, llen, rlen, data->type);
-        //printf("(%f,%f)\n", x,y);
-        data->poses = g_list_prepend(data->poses, &data->pos_data[nposes * 2]);
-        data->pos_data[nposes * 2 + 0] = x;
-        data->pos_data[nposes * 2 + 1] = y;
-        nposes++;
-    }
-    data->poses = g_list_reverse(data->poses);
+    return g_object_get_data(G_OBJECT(gtk_widget_get_toplevel(widget)), "ui");
 }
 
 /******************* UI *************************/
@@ -244,11 +100,11 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *event,
         gpointer gdata)
 {
     struct draw_data *data = gdata;
-    const float pi2 = 6.28318530718;
-    const float paper_size_x = 355.6;
-    const float paper_size_y = 215.9;
-
-    recalc_draw_data(data);
+    struct render_cache *cache = g_object_get_data(G_OBJECT(widget), "cache");
+    struct worker *w = &ui_of(widget)->worker;
+    gint64 t = trace_begin();
+    const float paper_size_x = PAPER_WIDTH;
+    const float paper_size_y = PAPER_HEIGHT;
 
     int x;
 
@@ -273,10 +129,52 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *event,
     // and paper onto our reduced drawing area
     float scale = x / maxx;
     
+    // While the worker is busy draw what it's finished so far, with no LOD
+    // as that comes last. Otherwise the last results it handed over.
+    g_mutex_lock(&w->lock);
+    gboolean partial = w->partial;
+    struct draw_data shown = partial ? w->back : *data;
+    gsize nposes = 0;
+    if(partial) {
+        shown.nlod = 0;
+        nposes = w->poses_ready;
+        if(!w->loading)
+            nposes = MIN(nposes, state_at(&shown, MIN(data->playback_step,
+                                                      shown.steps.nsteps)).npose);
+    }
+    else {
+        g_mutex_unlock(&w->lock);
+        if(data->poses_valid) nposes = state_at(data, data->playback_step).npose;
+    }
+
+    // Anything that moves what's already drawn means starting again,
+    // otherwise only the poses we've stepped on to since last time are new
+    if(!cache->surface ||
+       cache->partial != partial ||
+       cache->results != w->results ||
+       cache->width != widget->allocation.width ||
+       cache->height != widget->allocation.height ||
+       cache->scale != scale ||
+       cache->nposes > nposes) {
+        render_cache_reset(cache, widget->allocation.width, widget->allocation.height,
+                           scale, x);
+        cache->partial = partial;
+        cache->results = w->results;
+    }
+    if(nposes > cache->nposes) {
+        cairo_t *cr = cairo_create(cache->surface);
+        cairo_set_source_rgb(cr,0,0,0);
+        draw_strokes(cr, &shown, cache->nposes, nposes, scale);
+        cairo_destroy(cr);
+        cache->nposes = nposes;
+    }
+    if(partial) g_mutex_unlock(&w->lock);
+
     cairo_t *cr = gdk_cairo_create(widget->window);
-    cairo_set_source_rgb(cr,1,1,1);
-    cairo_fill(cr);
+    cairo_set_source_surface(cr, cache->surface, 0, 0);
+    cairo_paint(cr);
 
+    // The paper goes on top so moving it doesn't disturb the drawing
     cairo_set_source_rgb(cr,1,0,0);
     cairo_rectangle(cr,
                     data->paper_offset_x * scale, 
@@ -285,23 +183,10 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *event,
                     paper_size_y * scale);
     cairo_stroke(cr);
 
-    cairo_set_source_rgb(cr,0.5,0.5,0.5);
-    cairo_arc(cr, 0, 0, 20, 0, pi2);
-    cairo_fill(cr);
-    cairo_arc(cr, x, 0, 20, 0, pi2);
-    cairo_fill(cr);
-
-    cairo_set_source_rgb(cr,0,0,0);
-    for(GList *points = data->poses; points != NULL; points = points->next) {
-      cairo_arc(cr, 
-                ((float*)points->data)[0] * scale,
-                ((float*)points->data)[1] * scale,
-                2,
-                0, pi2);
-      cairo_fill(cr);
-    }
+    if(g_object_get_data(G_OBJECT(widget), "overlay")) draw_trace_overlay(cr);
 
     cairo_destroy(cr);
+    trace_end(span_expose, t);
     return TRUE;
 }
 
@@ -312,6 +197,16 @@ static gboolean keypress(GtkWidget *widget,
   switch(event->keyval) {
     case GDK_q:
       g_signal_emit_by_name(widget, "delete-event");
+      break;
+    case GDK_p: {
+      // Timings overlay, which only has something to show once tracing is on
+      GtkWidget *area = ui_of(widget)->drawing_area;
+      gboolean on = !g_object_get_data(G_OBJECT(area), "overlay");
+      if(on) trace_enable(TRUE);
+      g_object_set_data(G_OBJECT(area), "overlay", GINT_TO_POINTER(on));
+      gtk_widget_queue_draw(area);
+      break;
+    }
   }
   return FALSE;
 }
@@ -333,8 +228,8 @@ static void destroy(GtkWidget *widget, gpointer data)
 
 static void trigger_redraw(GtkWidget *widget)
 {
-  GdkWindow *window = gtk_widget_get_window(gtk_widget_get_toplevel(GTK_WIDGET(widget)));
-  gdk_window_invalidate_rect(window, NULL, TRUE);
+  // Only the drawing, the controls redraw themselves
+  gtk_widget_queue_draw(ui_of(widget)->drawing_area);
 }
 
 static void open_file_pressed(GtkWidget *widget, gpointer data)
@@ -349,7 +244,8 @@ static void open_file_pressed(GtkWidget *widget, gpointer data)
   if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
     char *filename;
     filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-    read_data(filename, (struct draw_data*)data);
+    // The slider is rescaled once it's loaded
+    worker_submit(&ui_of(widget)->worker, filename);
     g_free(filename);
   }
   gtk_widget_destroy(dialog);
@@ -379,48 +275,52 @@ static void end_pressed(GtkWidget *widget, gpointer sliderp)
       gtk_adjustment_get_upper(gtk_range_get_adjustment(sliderp)));
   trigger_redraw(GTK_WIDGET(widget));
 }
-static void paper_offset_x_changed(GtkSpinButton *widget, gpointer gdata, gpointer unused)
-{
-  ((struct draw_data*)gdata)->paper_offset_x = gtk_spin_button_get_value(widget);
-  trigger_redraw(GTK_WIDGET(widget));
-}
-static void paper_offset_y_changed(GtkSpinButton *widget, gpointer gdata, gpointer unused)
-{
-  ((struct draw_data*)gdata)->paper_offset_y = gtk_spin_button_get_value(widget);
-  trigger_redraw(GTK_WIDGET(widget));
-}
-static void spool_dist_changed(GtkSpinButton *widget, gpointer gdata, gpointer unused)
-{
-  ((struct draw_data*)gdata)->spool_dist = gtk_spin_button_get_value(widget);
-  trigger_redraw(GTK_WIDGET(widget));
-}
-static void step_dist_changed(GtkSpinButton *widget, gpointer gdata, gpointer unused)
-{
-  ((struct draw_data*)gdata)->step_dist = gtk_spin_button_get_value(widget);
-  trigger_redraw(GTK_WIDGET(widget));
-}
-static gboolean slider_moved(GtkRange *range, 
-                             GtkScrollType scroll,
-                             gdouble value,
-                             gpointer data)
+/**
+ * Takes the latest values of all the settings, once per frame however many
+ * times they changed. Only the kinematic ones need the worker, the paper
+ * offsets just move the rectangle.
+ */
+static gboolean apply_settings(gpointer uip)
 {
-  gtk_range_set_value(range, 
-      gtk_adjustment_get_upper(gtk_range_get_adjustment(range)));
-  return TRUE;
+  struct ui *ui = uip;
+  struct draw_data *data = ui->worker.front;
+  ui->settings_idle = 0;
+
+  data->paper_offset_x = gtk_spin_button_get_value(GTK_SPIN_BUTTON(ui->paper_offset_x));
+  data->paper_offset_y = gtk_spin_button_get_value(GTK_SPIN_BUTTON(ui->paper_offset_y));
+  float spool_dist = gtk_spin_button_get_value(GTK_SPIN_BUTTON(ui->spool_dist));
+  float step_dist = gtk_spin_button_get_value(GTK_SPIN_BUTTON(ui->step_dist));
+  float start_llen = gtk_spin_button_get_value(GTK_SPIN_BUTTON(ui->left_length));
+  float start_rlen = gtk_spin_button_get_value(GTK_SPIN_BUTTON(ui->right_length));
+  enum robot_type type = gtk_combo_box_get_active(GTK_COMBO_BOX(ui->robot_type));
+  if(spool_dist != data->spool_dist || step_dist != data->step_dist ||
+     start_llen != data->start_llen || start_rlen != data->start_rlen ||
+     type != data->type) {
+    data->type = type;
+    data->spool_dist = spool_dist;
+    data->step_dist = step_dist;
+    data->start_llen = start_llen;
+    data->start_rlen = start_rlen;
+    worker_submit(&ui->worker, NULL);
+  }
+  gtk_widget_queue_draw(ui->drawing_area);
+  return FALSE;
 }
 
-static void left_length_changed(GtkSpinButton *widget, gpointer gdata, gpointer unused)
+static void setting_changed(GtkWidget *widget, gpointer unused)
 {
-  ((struct draw_data*)gdata)->start_llen = gtk_spin_button_get_value(widget);
-  trigger_redraw(GTK_WIDGET(widget));
+  struct ui *ui = ui_of(widget);
+  // Just ahead of the redraw so it sees the new values
+  if(!ui->settings_idle)
+    ui->settings_idle = g_idle_add_full(GDK_PRIORITY_REDRAW - 1, apply_settings, ui, NULL);
 }
-static void right_length_changed(GtkSpinButton *widget, gpointer gdata, gpointer unused)
+static void slider_moved(GtkRange *range, gpointer gdata)
 {
-  ((struct draw_data*)gdata)->start_rlen = gtk_spin_button_get_value(widget);
-  trigger_redraw(GTK_WIDGET(widget));
+  ((struct draw_data*)gdata)->playback_step = gtk_range_get_value(range);
+  trigger_redraw(GTK_WIDGET(range));
 }
 
-GtkWidget *control_bar(struct draw_data *data)
+GtkWidget *control_bar(struct draw_data *data, struct ui *ui)
 {
   // GtkWidget *
   // gtk_hbox_new (gboolean homogeneous,
@@ -435,23 +335,33 @@ GtkWidget *control_bar(struct draw_data *data)
   GtkWidget *step = gtk_button_new_with_label(">");
   GtkWidget *end = gtk_button_new_with_label(">|");
   GtkWidget *slider = gtk_hscale_new_with_range(0,100,1);
+  GtkWidget *progress = gtk_progress_bar_new();
   // Adding widgets to playback bar
   gtk_box_pack_start(GTK_BOX(playback_bar), open, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(playback_bar), start, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(playback_bar), unstep, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(playback_bar), step, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(playback_bar), end, TRUE, TRUE, 0);
+  gtk_box_pack_start(GTK_BOX(playback_bar), progress, TRUE, TRUE, 0);
   // Playback bar events
   g_signal_connect(open, "clicked", G_CALLBACK(open_file_pressed), data);
   g_signal_connect(start, "clicked", G_CALLBACK(start_pressed), slider);
   g_signal_connect(unstep, "clicked", G_CALLBACK(unstep_pressed), slider);
   g_signal_connect(step, "clicked", G_CALLBACK(step_pressed), slider);
   g_signal_connect(end, "clicked", G_CALLBACK(end_pressed), slider);
-  g_signal_connect(slider, "change-value", G_CALLBACK(slider_moved), data);
+  g_signal_connect(slider, "value-changed", G_CALLBACK(slider_moved), data);
+  // Start off showing the whole program
+  gtk_range_set_range(GTK_RANGE(slider), 0, MAX(data->steps.nsteps, 1));
+  gtk_range_set_value(GTK_RANGE(slider), data->steps.nsteps);
+  data->playback_step = data->steps.nsteps;
 
 
   // Offset bar widgets
   GtkWidget *offset_bar = gtk_hbox_new(FALSE, 1);
+  GtkWidget *robot_type_label = gtk_label_new("Robot:");
+  GtkWidget *robot_type = gtk_combo_box_new_text();
+  for(enum robot_type type = wires; type <= elbow; type++)
+    gtk_combo_box_append_text(GTK_COMBO_BOX(robot_type), robot_type_name(type));
   GtkWidget *paper_x_label = gtk_label_new("Paper offset X:");
   GtkWidget *paper_offset_x = gtk_spin_button_new_with_range(0,1000,1);
   GtkWidget *paper_y_label = gtk_label_new("mm       Y:");
@@ -460,10 +370,13 @@ GtkWidget *control_bar(struct draw_data *data)
   GtkWidget *spool_dist = gtk_spin_button_new_with_range(0,1000,1);
   GtkWidget *spool_dist_unit_label = gtk_label_new("mm");
   // Setting spinbox values from input data 
+  gtk_combo_box_set_active(GTK_COMBO_BOX(robot_type), data->type);
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(paper_offset_x), data->paper_offset_x);
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(paper_offset_y), data->paper_offset_y);
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(spool_dist), data->spool_dist);
   // Adding widgets to the offset bar
+  gtk_box_pack_start(GTK_BOX(offset_bar), robot_type_label, TRUE, TRUE, 0);
+  gtk_box_pack_start(GTK_BOX(offset_bar), robot_type, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(offset_bar), paper_x_label, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(offset_bar), paper_offset_x, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(offset_bar), paper_y_label, TRUE, TRUE, 0);
@@ -472,9 +385,10 @@ GtkWidget *control_bar(struct draw_data *data)
   gtk_box_pack_start(GTK_BOX(offset_bar), spool_dist, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(offset_bar), spool_dist_unit_label, TRUE, TRUE, 0);
   // offset bar events
-  g_signal_connect(paper_offset_x, "value-changed", G_CALLBACK(paper_offset_x_changed), data);
-  g_signal_connect(paper_offset_y, "value-changed", G_CALLBACK(paper_offset_y_changed), data);
-  g_signal_connect(spool_dist, "value-changed", G_CALLBACK(spool_dist_changed), data);
+  g_signal_connect(robot_type, "changed", G_CALLBACK(setting_changed), NULL);
+  g_signal_connect(paper_offset_x, "value-changed", G_CALLBACK(setting_changed), NULL);
+  g_signal_connect(paper_offset_y, "value-changed", G_CALLBACK(setting_changed), NULL);
+  g_signal_connect(spool_dist, "value-changed", G_CALLBACK(setting_changed), NULL);
 
   
   // Step bar widgets
@@ -499,9 +413,9 @@ GtkWidget *control_bar(struct draw_data *data)
   gtk_box_pack_start(GTK_BOX(step_bar), right_length, TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(step_bar), right_length_unit_label, TRUE, TRUE, 0);
   // step bar events
-  g_signal_connect(step_dist, "value-changed", G_CALLBACK(step_dist_changed), data);
-  g_signal_connect(left_length, "value-changed", G_CALLBACK(left_length_changed), data);
-  g_signal_connect(right_length, "value-changed", G_CALLBACK(right_length_changed), data);
+  g_signal_connect(step_dist, "value-changed", G_CALLBACK(setting_changed), NULL);
+  g_signal_connect(left_length, "value-changed", G_CALLBACK(setting_changed), NULL);
+  g_signal_connect(right_length, "value-changed", G_CALLBACK(setting_changed), NULL);
 
   
   //gtk_label_set_justify(GTK_LABEL(paper_y_label), GTK_JUSTIFY_RIGHT);
@@ -526,9 +440,12 @@ GtkWidget *control_bar(struct draw_data *data)
   gtk_widget_show(unstep);
   gtk_widget_show(step);
   gtk_widget_show(end);
+  gtk_widget_show(progress);
   gtk_widget_show(slider);
   gtk_widget_show(playback_bar);
 
+  gtk_widget_show(robot_type_label);
+  gtk_widget_show(robot_type);
   gtk_widget_show(paper_x_label);
   gtk_widget_show(paper_offset_y);
   gtk_widget_show(paper_y_label);
@@ -548,6 +465,17 @@ GtkWidget *control_bar(struct draw_data *data)
 
   gtk_widget_show(box);
 
+  // So the worker can show its progress and what it loaded
+  ui->slider = slider;
+  ui->progress = progress;
+  ui->robot_type = robot_type;
+  ui->paper_offset_x = paper_offset_x;
+  ui->paper_offset_y = paper_offset_y;
+  ui->spool_dist = spool_dist;
+  ui->step_dist = step_dist;
+  ui->left_length = left_length;
+  ui->right_length = right_length;
+
   return box;
 }
 
@@ -556,16 +484,15 @@ void launch_ui(int argc, char **argv)
 
     gtk_init(&argc, &argv);
 
-    const float spool_dist = 400.0;
-    struct draw_data data = {.paper_offset_y = 20.0, 
-                             .spool_dist = spool_dist, 
-                             .step_dist = 1.0,
-                             .start_llen = spool_dist * 0.6,
-                             .start_rlen = spool_dist * 0.6};
-                          
-    if(argc > 1) read_data(argv[1], &data);
+    // Tracing from the start, otherwise from when the overlay's first shown
+    const char *trace_name = g_getenv("ROBOT_SIM_TRACE");
+    if(trace_name) trace_enable(TRUE);
 
-    data.type = wires;
+    struct draw_data data;
+    draw_data_defaults(&data);
+
+    struct ui ui = {0};
+    worker_start(&ui.worker, &data, worker_progress, worker_finished, &ui);
 
     // Main window
     GtkWidget *window;
@@ -576,22 +503,26 @@ void launch_ui(int argc, char **argv)
     g_signal_connect(window, "destroy", G_CALLBACK(destroy), NULL);
     // Handle keyboard interaction
     g_signal_connect(G_OBJECT(window), "key_press_event", G_CALLBACK(keypress), NULL);
+    g_object_set_data(G_OBJECT(window), "ui", &ui);
 
     // Vertical widget container
     GtkWidget *box = gtk_vbox_new(FALSE, 0);
-    GtkWidget *controls = control_bar(&data);
+    GtkWidget *controls = control_bar(&data, &ui);
 
     gtk_box_pack_start(GTK_BOX(box), controls, FALSE, FALSE, 0);
 
     // Create a drawing area
     GtkWidget *drawing_area = gtk_drawing_area_new();
     //gtk_widget_set_size_request(drawing_area, 1400, 850);
+    struct render_cache cache = {0};
+    g_object_set_data(G_OBJECT(drawing_area), "cache", &cache);
     // Expose event is our trigger to redraw
     g_signal_connect(G_OBJECT(drawing_area), "expose_event",
             G_CALLBACK(expose_event), &data);
 
     // Add the drawing area to the box
     gtk_box_pack_start(GTK_BOX(box), drawing_area,TRUE, TRUE, 0);
+    ui.drawing_area = drawing_area;
 
     // Add the box to the main window
     gtk_container_add(GTK_CONTAINER(window), box);
@@ -601,23 +532,28 @@ void launch_ui(int argc, char **argv)
     gtk_widget_show(box);
     gtk_widget_show(window);
     
+    worker_submit(&ui.worker, argc > 1 ? argv[1] : NULL);
+
     // Main loop
     gtk_main();
 
     /* cleanup */
-    g_list_free(data.steps);
-    g_list_free(data.poses);
+    worker_stop(&ui.worker);
+    free_draw_data(&data);
+    render_cache_free(&cache);
+
+    if(trace_events()) {
+        gchar *name = trace_name && *trace_name ? g_strdup(trace_name) :
+                      g_build_filename(g_get_tmp_dir(), "robot_sim_trace.json", NULL);
+        if(0 == trace_write(name)) printf("Trace written to %s\n", name);
+        g_free(name);
+    }
 }
 
 /***********************************************/
 int main(int argc, char **argv)
 {
-    /* pre-test */
-    g_test_init(&argc, &argv, NULL);
-    g_test_add_func("/pack_unpack", pack_unpack_test);
-    g_test_run();
-
-    /* UI */
+    // The tests are robot_sim_test, make check
     launch_ui(argc, argv);
 
     return 0;
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <cairo.h>
+
+#include "sim.h"
+#include "timing.h"
+#include "validate.h"
+#include "render.h"
+
+/**
+ * Benchmarks each stage of the simulator on its own over synthetic
+ * programs, and prints the results as JSON so runs from different versions
+ * can be compared. The shapes are:
+ *
+ *   walk    a random walk with the pen down, short runs in every direction
+ *   runs    long runs of the same step, out and back
+ *   pen     the pen toggling every few steps while moving
+ *   circles lines.py's circle drawn over and over
+ *
+ * Each is about -n steps (10M by default). The stages are parsing the text
+ * and binary formats with read_data, recalc_draw_data, to_coords_batch
+ * over every pose, recalc_timing, validate_steps, and drawing the poses
+ * the way the GUI does onto an off-screen surface. Each stage is run -r
+ * times (3 by default) and the fastest kept. -j sets the kinematics and
+ * validation threads, all of them by default.
+ *
+ * usage: robot_sim_bench [-n steps] [-r repeats] [-j threads] [shape...]
+ */
+
+#define BENCH_WIDTH 1400
+#define BENCH_HEIGHT 850
+// Keeps the random walk within this many steps of where it started
+#define WALK_RANGE 800
+// Runs are out and back, as long as they can be without snapping a string
+#define RUN_MIN 200
+#define RUN_MAX 800
+
+static const char *shapes[] = {"walk", "runs", "pen", "circles"};
+
+static guint8 step_op(int dl, int dr, int pen)
+{
+    static const guint8 num[3] = {NEG_NUM, NOP_NUM, POS_NUM};
+    return num[dl + 1] << LEF_SHIFT | num[dr + 1] << RIG_SHIFT | num[pen + 1] << PEN_SHIFT;
+}
+
+static int op_delta(guint8 num)
+{
+    return num == POS_NUM ? 1 : num == NEG_NUM ? -1 : 0;
+}
+
+static void gen_walk(struct step_buf *steps, gsize n, GRand *rand)
+{
+    gint64 l = 0, r = 0;
+    step_buf_append(steps, step_op(0, 0, 1));
+    for(gsize i = 1; i < n; i++) {
+        int dl = g_rand_int_range(rand, -1, 2), dr = g_rand_int_range(rand, -1, 2);
+        // Turn back at the edges so the strings don't snap
+        if(l + dl > WALK_RANGE || l + dl < -WALK_RANGE) dl = -dl;
+        if(r + dr > WALK_RANGE || r + dr < -WALK_RANGE) dr = -dr;
+        l += dl;
+        r += dr;
+        step_buf_append(steps, step_op(dl, dr, 0));
+    }
+}
+
+static void gen_runs(struct step_buf *steps, gsize n, GRand *rand)
+{
+    gsize i = 1;
+    step_buf_append(steps, step_op(0, 0, 1));
+    while(i + 2 <= n) {
+        int dl = g_rand_int_range(rand, -1, 2), dr = g_rand_int_range(rand, -1, 2);
+        gsize len = g_rand_int_range(rand, RUN_MIN, RUN_MAX + 1);
+        len = MIN(len, (n - i) / 2);
+        for(gsize j = 0; j < len; j++) step_buf_append(steps, step_op(dl, dr, 0));
+        for(gsize j = 0; j < len; j++) step_buf_append(steps, step_op(-dl, -dr, 0));
+        i += 2 * len;
+    }
+}
+
+static void gen_pen(struct step_buf *steps, gsize n, GRand *rand)
+{
+    int pen = 1;
+    gsize i = 0;
+    while(i < n) {
+        step_buf_append(steps, step_op(0, 0, pen));
+        // Out and back so it stays put
+        gsize len = 1 + 2 * g_rand_int_range(rand, 0, 3);
+        len = MIN(len, n - i);
+        int dl = g_rand_int_range(rand, -1, 2), dr = g_rand_int_range(rand, -1, 2);
+        for(gsize j = 1; j < len; j++)
+            step_buf_append(steps, j % 2 ? step_op(dl, dr, 0) : step_op(-dl, -dr, 0));
+        i += len;
+        pen = -pen;
+    }
+}
+
+/**
+ * One circle, stepped back to where it started so going round again doesn't
+ * drift, then copied until there are n steps.
+ */
+static void gen_circles(struct draw_data *data, gsize n)
+{
+    double llen, rlen;
+    struct step_buf circle = {0};
+    gen_circle(&circle, 200, 200, 100, data->spool_dist, &llen, &rlen);
+    step_buf_flush(&circle);
+    const guint8 *end = circle.data + circle.len;
+    gint64 l = 0, r = 0;
+    for(const guint8 *p = circle.data; p < end;) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        l += op_delta((op & LEF_MASK) >> LEF_SHIFT) * (gint64)count;
+        r += op_delta((op & RIG_MASK) >> RIG_SHIFT) * (gint64)count;
+    }
+    while(l || r) {
+        int dl = (l < 0) - (l > 0), dr = (r < 0) - (r > 0);
+        step_buf_append(&circle, step_op(dl, dr, 0));
+        l += dl;
+        r += dr;
+    }
+    step_buf_flush(&circle);
+
+    end = circle.data + circle.len;
+    for(gsize i = 0; i < n; i += circle.nsteps) {
+        for(const guint8 *p = circle.data; p < end;) {
+            guint8 op;
+            guint64 count;
+            p = step_run(p, end, &op, &count);
+            for(guint64 j = 0; j < count; j++) step_buf_append(&data->steps, op);
+        }
+    }
+    step_buf_free(&circle);
+    data->start_llen = llen;
+    data->start_rlen = rlen;
+}
+
+/**
+ * Makes the program in data and saves it as text and as binary.
+ */
+static double make_program(struct draw_data *data, const char *shape, gsize n,
+                           const char *text_name, const char *bin_name)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    GTimer *timer = g_timer_new();
+    step_buf_clear(&data->steps);
+    data->step_dist = GEN_LEN_STEP;
+    data->spool_dist = 400;
+    data->start_llen = data->start_rlen = 300;
+    if(0 == strcmp(shape, "walk")) gen_walk(&data->steps, n, rand);
+    else if(0 == strcmp(shape, "runs")) gen_runs(&data->steps, n, rand);
+    else if(0 == strcmp(shape, "pen")) gen_pen(&data->steps, n, rand);
+    else gen_circles(data, n);
+    step_buf_flush(&data->steps);
+    data->steps_version++;
+    double seconds = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+    g_rand_free(rand);
+
+    FILE *f = fopen(text_name, "w");
+    if(f) {
+        fprintf(f, "Step Distance: %f\n", data->step_dist);
+        fprintf(f, "Spool Distance: %f\n", data->spool_dist);
+        fprintf(f, "Start Length Left: %f\n", data->start_llen);
+        fprintf(f, "Start Length Right: %f\n", data->start_rlen);
+        write_steps(f, &data->steps);
+        fclose(f);
+    }
+    write_binary(bin_name, data);
+    return seconds;
+}
+
+// -1 if it couldn't be read
+static double time_parse(struct draw_data *data, char *fname, int repeats)
+{
+    double best = INFINITY;
+    for(int i = 0; i < repeats; i++) {
+        GTimer *timer = g_timer_new();
+        int res = read_data(fname, data);
+        double t = g_timer_elapsed(timer, NULL);
+        best = res < 0 ? -1 : MIN(best, t);
+        g_timer_destroy(timer);
+        if(res < 0) break;
+    }
+    return best;
+}
+
+static double time_kinematics(struct draw_data *data, int repeats)
+{
+    double best = INFINITY;
+    for(int i = 0; i < repeats; i++) {
+        data->lens_valid = data->poses_valid = FALSE;
+        GTimer *timer = g_timer_new();
+        recalc_draw_data(data);
+        double t = g_timer_elapsed(timer, NULL);
+        best = MIN(best, t);
+        g_timer_destroy(timer);
+    }
+    return best;
+}
+
+static double time_to_coords(struct draw_data *data, int repeats)
+{
+    const gsize n = data->nposes;
+    float *xy = g_new(float, 2 * MAX(n, 1));
+    guint8 *snapped = g_new(guint8, MAX(n, 1));
+    double best = INFINITY;
+    for(int i = 0; i < repeats; i++) {
+        GTimer *timer = g_timer_new();
+        to_coords_batch(xy, xy + n, snapped, data->len_data, data->len_data + n, n,
+                        data->spool_dist, data->type);
+        double t = g_timer_elapsed(timer, NULL);
+        best = MIN(best, t);
+        g_timer_destroy(timer);
+    }
+    g_free(xy);
+    g_free(snapped);
+    return best;
+}
+
+static double time_timing(struct draw_data *data, int repeats, struct timing *timing)
+{
+    struct motion_limits limits;
+    motion_limits_defaults(&limits);
+    double best = INFINITY;
+    for(int i = 0; i < repeats; i++) {
+        GTimer *timer = g_timer_new();
+        recalc_timing(data, &limits, timing);
+        double t = g_timer_elapsed(timer, NULL);
+        best = MIN(best, t);
+        g_timer_destroy(timer);
+    }
+    return best;
+}
+
+static double time_validate(struct draw_data *data, int repeats, GArray *violations)
+{
+    struct workspace ws;
+    workspace_defaults(&ws);
+    double best = INFINITY;
+    for(int i = 0; i < repeats; i++) {
+        GTimer *timer = g_timer_new();
+        validate_steps(data, &ws, violations);
+        double t = g_timer_elapsed(timer, NULL);
+        best = MIN(best, t);
+        g_timer_destroy(timer);
+    }
+    return best;
+}
+
+/**
+ * A full redraw at the scale the GUI would use for a window this size.
+ */
+static double time_render(struct draw_data *data, int repeats)
+{
+    const float scale = BENCH_WIDTH / data->spool_dist;
+    struct render_cache cache = {0};
+    double best = INFINITY;
+    for(int i = 0; i < repeats; i++) {
+        GTimer *timer = g_timer_new();
+        render_cache_reset(&cache, BENCH_WIDTH, BENCH_HEIGHT, scale, BENCH_WIDTH);
+        cairo_t *cr = cairo_create(cache.surface);
+        cairo_set_source_rgb(cr, 0, 0, 0);
+        draw_strokes(cr, data, 0, data->nposes, scale);
+        cairo_destroy(cr);
+        cairo_surface_flush(cache.surface);
+        double t = g_timer_elapsed(timer, NULL);
+        best = MIN(best, t);
+        g_timer_destroy(timer);
+    }
+    render_cache_free(&cache);
+    return best;
+}
+
+static int bench(GString *out, const char *shape, gsize n, int repeats, guint threads)
+{
+    gchar *text_name = g_build_filename(g_get_tmp_dir(), "robot_sim_bench.txt", NULL);
+    gchar *bin_name = g_build_filename(g_get_tmp_dir(), "robot_sim_bench.bin", NULL);
+    struct draw_data data;
+    struct timing timing = {0};
+    draw_data_defaults(&data);
+    data.nthreads = threads;
+
+    fprintf(stderr, "%s...\n", shape);
+    double gen = make_program(&data, shape, n, text_name, bin_name);
+    struct stat st;
+    gsize text_bytes = stat(text_name, &st) < 0 ? 0 : st.st_size;
+    double parse_text = time_parse(&data, text_name, repeats);
+    double parse_binary = time_parse(&data, bin_name, repeats);
+    if(parse_text < 0 || parse_binary < 0) {
+        g_free(text_name);
+        g_free(bin_name);
+        free_draw_data(&data);
+        return -1;
+    }
+    double kinematics = time_kinematics(&data, repeats);
+    double to_coords = time_to_coords(&data, repeats);
+    double plan = time_timing(&data, repeats, &timing);
+    GArray *violations = g_array_new(FALSE, FALSE, sizeof(struct violation));
+    double validate = time_validate(&data, repeats, violations);
+    double render = time_render(&data, repeats);
+
+    g_string_append_printf(out,
+        "    {\"shape\": \"%s\", \"steps\": %lu, \"bytes\": %lu, \"text_bytes\": %lu,\n"
+        "     \"poses\": %lu, \"strokes\": %u, \"snaps\": %u, \"blocks\": %lu,\n"
+        "     \"violations\": %u,\n"
+        "     \"seconds\": {\"generate\": %.6f, \"parse_text\": %.6f, \"parse_binary\": %.6f,\n"
+        "                 \"kinematics\": %.6f, \"to_coords\": %.6f, \"timing\": %.6f,\n"
+        "                 \"validate\": %.6f, \"render\": %.6f}}",
+        shape, (unsigned long)data.steps.nsteps, (unsigned long)data.steps.len,
+        (unsigned long)text_bytes, (unsigned long)data.nposes, data.strokes->len,
+        data.snaps->len, (unsigned long)timing.nblocks, violations->len,
+        gen, parse_text, parse_binary, kinematics, to_coords, plan, validate, render);
+
+    g_remove(text_name);
+    g_remove(bin_name);
+    g_free(text_name);
+    g_free(bin_name);
+    g_array_free(violations, TRUE);
+    free_timing(&timing);
+    free_draw_data(&data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    gsize n = 10 * 1000 * 1000;
+    int repeats = 3;
+    guint threads = 0;
+    int first = 1;
+
+    for(; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        if(0 == strcmp(argv[first], "-n")) n = g_ascii_strtoull(argv[first + 1], NULL, 10);
+        else if(0 == strcmp(argv[first], "-r")) repeats = atoi(argv[first + 1]);
+        else if(0 == strcmp(argv[first], "-j")) threads = atoi(argv[first + 1]);
+        else break;
+    }
+    gboolean ok = first == argc || argv[first][0] != '-';
+    for(int i = first; i < argc && ok; i++) {
+        ok = FALSE;
+        for(int j = 0; j < G_N_ELEMENTS(shapes); j++)
+            if(0 == strcmp(argv[i], shapes[j])) ok = TRUE;
+    }
+    if(!ok || !n || repeats < 1) {
+        fprintf(stderr, "usage: %s [-n steps] [-r repeats] [-j threads] [shape...]\n"
+                        "shapes are walk, runs, pen and circles, all by default\n", argv[0]);
+        return 2;
+    }
+
+    GString *out = g_string_new(NULL);
+    g_string_append_printf(out, "{\"format\": 1, \"steps\": %lu, \"repeats\": %d, "
+                                "\"threads\": %u,\n  \"programs\": [\n",
+                           (unsigned long)n, repeats,
+                           threads ? threads : g_get_num_processors());
+    int nshapes = first < argc ? argc - first : G_N_ELEMENTS(shapes);
+    for(int i = 0; i < nshapes; i++) {
+        if(bench(out, first < argc ? argv[first + i] : shapes[i], n, repeats, threads) < 0) {
+            g_string_free(out, TRUE);
+            return 1;
+        }
+        g_string_append(out, i + 1 < nshapes ? ",\n" : "\n");
+    }
+    g_string_append(out, "  ]}\n");
+    fputs(out->str, stdout);
+    g_string_free(out, TRUE);
+    return 0;
+}
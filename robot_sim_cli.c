@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "sim.h"
+#include "timing.h"
+#include "validate.h"
+
+/**
+ * Headless simulator. Runs each step file given on the command line through
+ * the same loading and kinematics as the GUI and reports where the machine
+ * ends up, the extent of the drawing and any snapped strings.
+ * Files are simulated concurrently, output is in command line order.
+ * It also says how long each would take to plot and where that time goes,
+ * with the same max rate, acceleration and jerk (steps/s) for both motors
+ * and the same pen settle time (s) either way, as given by -l or else
+ * motion_limits_defaults. Every step is then checked with validate_steps
+ * against the default workspace and each violation listed; with -v any
+ * violation fails the run, so it can gate a job before it's sent.
+ * With -c it instead converts a step file to the binary format, and with -o
+ * it runs it through optimise_steps and saves it as text, saying how many
+ * fewer steps and seconds it takes. Only OPT_EXACT passes are run, and it
+ * isn't saved unless every pen-down pose is still drawn in the same order.
+ * -m adds OPT_MERGE, which lets the line move by up to a step.
+ *
+ * usage: robot_sim_cli [-v] [-j jobs] [-l rate,accel,jerk,settle] file...
+ *        robot_sim_cli -c in_file out_file
+ *        robot_sim_cli -o [-m] in_file out_file
+ */
+
+struct job {
+    char *fname;
+    gboolean single; // only one file, give its kinematics all the threads
+    const struct motion_limits *limits;
+    const struct workspace *ws;
+    gboolean strict; // violations fail the job
+    GString *out;
+    int status;
+};
+
+static void run_job(gpointer jobp, gpointer unused)
+{
+    struct job *job = jobp;
+    struct draw_data data;
+    struct sim_stats stats;
+    struct timing timing = {0};
+    GArray *violations;
+
+    draw_data_defaults(&data);
+    data.type = wires;
+    data.nthreads = job->single ? 0 : 1;
+
+    job->out = g_string_new(NULL);
+    g_string_append_printf(job->out, "File: %s\n", job->fname);
+    if(read_data(job->fname, &data) < 0) {
+        g_string_append_printf(job->out, "Error: failed to read file\n\n");
+        job->status = -1;
+        free_draw_data(&data);
+        return;
+    }
+    if(data.bad_line)
+        g_string_append_printf(job->out, "Bad Line: %" G_GSIZE_FORMAT "\n", data.bad_line);
+
+    recalc_draw_data(&data);
+    sim_stats(&data, &stats);
+    recalc_timing(&data, job->limits, &timing);
+    violations = g_array_new(FALSE, FALSE, sizeof(struct violation));
+    validate_steps(&data, job->ws, violations);
+
+    g_string_append_printf(job->out, "Steps: %lu\n", (unsigned long)data.steps.nsteps);
+    g_string_append_printf(job->out, "Poses: %lu\n", (unsigned long)data.nposes);
+    g_string_append_printf(job->out, "Final Position: %f, %f\n", stats.final_x, stats.final_y);
+    g_string_append_printf(job->out, "Final Lengths: %f, %f\n", stats.final_llen, stats.final_rlen);
+    g_string_append_printf(job->out, "Pen: %s\n", stats.final.pen_down ? "down" : "up");
+    if(data.nposes)
+        g_string_append_printf(job->out, "Bounding Box: %f, %f, %f, %f\n",
+                               stats.min_x, stats.min_y, stats.max_x, stats.max_y);
+    g_string_append_printf(job->out, "Pen Down Length: %f\n", stats.pen_down_length);
+    g_string_append_printf(job->out, "Pen Up Length: %f\n", stats.pen_up_length);
+    g_string_append_printf(job->out, "Time: %f\n", timing.total);
+    g_string_append_printf(job->out, "Drawing Time: %f\n", timing.drawing);
+    g_string_append_printf(job->out, "Travel Time: %f\n", timing.travel);
+    g_string_append_printf(job->out, "Pen Time: %f\n", timing.pen);
+    g_string_append_printf(job->out, "Pen Changes: %lu\n", (unsigned long)timing.pen_changes);
+    for(guint i = 0; i < data.snaps->len; i++) {
+        struct pose_range *range = &g_array_index(data.snaps, struct pose_range, i);
+        g_string_append_printf(job->out, "Snapped: %lu, %lu\n",
+                               (unsigned long)range->start, (unsigned long)range->end);
+    }
+    g_string_append_printf(job->out, "Violations: %u\n", violations->len);
+    for(guint i = 0; i < violations->len; i++) {
+        struct violation *v = &g_array_index(violations, struct violation, i);
+        g_string_append_printf(job->out, "Violation: %s, %lu, %lu, %f, %f\n",
+                               violation_kind_name(v->kind), (unsigned long)v->start,
+                               (unsigned long)v->end, v->x, v->y);
+    }
+    if(job->strict && violations->len) job->status = 1;
+    g_string_append_c(job->out, '\n');
+    g_array_free(violations, TRUE);
+    free_timing(&timing);
+    free_draw_data(&data);
+}
+
+static int convert(char *in, char *out)
+{
+    struct draw_data data;
+    draw_data_defaults(&data);
+    data.type = wires;
+
+    if(read_data(in, &data) < 0) {
+        free_draw_data(&data);
+        return 1;
+    }
+    if(data.bad_line)
+        fprintf(stderr, "Skipped bad lines, the last was %" G_GSIZE_FORMAT "\n", data.bad_line);
+    int status = write_binary(out, &data) < 0;
+    if(!status) {
+        gsize out_size = BIN_HEADER_SIZE + data.steps.len;
+        printf("Wrote %lu steps, %lu bytes to %lu (%.1fx smaller)\n",
+               (unsigned long)data.steps.nsteps, (unsigned long)data.load_bytes,
+               (unsigned long)out_size, data.load_bytes / (double)out_size);
+    }
+    free_draw_data(&data);
+    return status;
+}
+
+static int optimise(char *in, char *out, gboolean merge)
+{
+    struct draw_data data, opt;
+    struct motion_limits limits;
+    struct timing timing[2] = {{0}};
+    draw_data_defaults(&data);
+    draw_data_defaults(&opt);
+    motion_limits_defaults(&limits);
+    data.type = wires;
+
+    if(read_data(in, &data) < 0) {
+        free_draw_data(&data);
+        return 1;
+    }
+    if(data.bad_line)
+        fprintf(stderr, "Skipped bad lines, the last was %" G_GSIZE_FORMAT "\n", data.bad_line);
+    opt.type = data.type;
+    opt.paper_offset_x = data.paper_offset_x;
+    opt.paper_offset_y = data.paper_offset_y;
+    opt.step_dist = data.step_dist;
+    opt.spool_dist = data.spool_dist;
+    opt.start_llen = data.start_llen;
+    opt.start_rlen = data.start_rlen;
+    optimise_steps(&opt.steps, &data.steps, merge ? OPT_ALL : OPT_EXACT);
+    opt.steps_version++;
+
+    recalc_draw_data(&data);
+    recalc_draw_data(&opt);
+    recalc_timing(&data, &limits, &timing[0]);
+    recalc_timing(&opt, &limits, &timing[1]);
+    gboolean same = same_drawing(&data, &opt, 0);
+    int status = 0;
+    if(!same && !(merge && same_drawing(&data, &opt, 1))) {
+        fprintf(stderr, "The optimised program draws something else, not saving it\n");
+        status = 1;
+    }
+    else if(write_text(out, &opt) < 0) {
+        status = 1;
+    }
+    else {
+        const gsize before = data.steps.nsteps, after = opt.steps.nsteps;
+        printf("Optimised %lu steps to %lu (%.1f%% fewer)\n", (unsigned long)before,
+               (unsigned long)after, before ? 100.0 * (before - after) / before : 0.0);
+        printf("Time: %f to %f\n", timing[0].total, timing[1].total);
+        printf(same ? "Drawing unchanged\n" : "Drawing moved by at most a step\n");
+    }
+    free_timing(&timing[0]);
+    free_timing(&timing[1]);
+    free_draw_data(&data);
+    free_draw_data(&opt);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    int njobs = g_get_num_processors();
+    int first = 1;
+    struct motion_limits limits;
+    struct workspace ws;
+    gboolean bad_limits = FALSE, strict = FALSE;
+
+    motion_limits_defaults(&limits);
+    workspace_defaults(&ws);
+    if(argc == 4 && 0 == strcmp(argv[1], "-c"))
+        return convert(argv[2], argv[3]);
+    if(argc == 4 && 0 == strcmp(argv[1], "-o"))
+        return optimise(argv[2], argv[3], FALSE);
+    if(argc == 5 && 0 == strcmp(argv[1], "-o") && 0 == strcmp(argv[2], "-m"))
+        return optimise(argv[3], argv[4], TRUE);
+    while(argc - first > 1) {
+        if(0 == strcmp(argv[first], "-v")) {
+            strict = TRUE;
+            first++;
+            continue;
+        }
+        if(0 == strcmp(argv[first], "-j")) {
+            njobs = atoi(argv[first + 1]);
+            njobs = MAX(njobs, 1);
+        } else if(0 == strcmp(argv[first], "-l")) {
+            float rate, accel, jerk, settle;
+            // A bad -l fails the run even if a good one follows
+            gboolean bad = 4 != sscanf(argv[first + 1], "%f,%f,%f,%f",
+                                       &rate, &accel, &jerk, &settle) ||
+                           rate <= 0 || accel <= 0 || jerk <= 0 || settle < 0;
+            bad_limits |= bad;
+            if(!bad)
+                limits = (struct motion_limits){.max_rate = {rate, rate},
+                                                .accel = {accel, accel},
+                                                .jerk = {jerk, jerk},
+                                                .pen_down_settle = settle,
+                                                .pen_up_settle = settle};
+        } else {
+            break;
+        }
+        first += 2;
+    }
+    if(first >= argc || bad_limits) {
+        fprintf(stderr, "usage: %s [-v] [-j jobs] [-l rate,accel,jerk,settle] file...\n"
+                        "       %s -c in_file out_file\n"
+                        "       %s -o [-m] in_file out_file\n", argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    int nfiles = argc - first;
+    struct job *jobs = g_new0(struct job, nfiles);
+    GThreadPool *pool = g_thread_pool_new(run_job, NULL, njobs, TRUE, NULL);
+    for(int i = 0; i < nfiles; i++) {
+        jobs[i].fname = argv[first + i];
+        jobs[i].single = nfiles == 1;
+        jobs[i].limits = &limits;
+        jobs[i].ws = &ws;
+        jobs[i].strict = strict;
+        g_thread_pool_push(pool, &jobs[i], NULL);
+    }
+    // Waits for every job to finish
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    int status = 0;
+    for(int i = 0; i < nfiles; i++) {
+        fputs(jobs[i].out->str, stdout);
+        g_string_free(jobs[i].out, TRUE);
+        if(jobs[i].status) status = 1;
+    }
+    g_free(jobs);
+    return status;
+}
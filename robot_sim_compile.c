@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "sim.h"
+
+/**
+ * Compiles a drawing, as polylines or an SVG path (see read_polylines), into
+ * a step program for the wires robot and prints it in the text format. The
+ * polylines are reordered to cut down pen-up travel unless -n is given.
+ * Either way both orders are compiled and simulated, and the pen-up travel
+ * and steps of each go to stderr.
+ *
+ * usage: robot_sim_compile [-n] [file]
+ */
+
+static gchar *read_all(const char *name, gsize *len)
+{
+    gchar *text = NULL;
+    if(strcmp(name, "-")) {
+        GError *error = NULL;
+        if(!g_file_get_contents(name, &text, len, &error)) {
+            fprintf(stderr, "Failed to read file %s: %s\n", name, error->message);
+            g_error_free(error);
+        }
+        return text;
+    }
+    GString *in = g_string_new(NULL);
+    char buf[4096];
+    gsize got;
+    while((got = fread(buf, 1, sizeof(buf), stdin)) > 0)
+        g_string_append_len(in, buf, got);
+    *len = in->len;
+    return g_string_free(in, FALSE);
+}
+
+int main(int argc, char **argv)
+{
+    gboolean reorder = TRUE;
+    int first = 1;
+
+    if(argc > 1 && 0 == strcmp(argv[1], "-n")) {
+        reorder = FALSE;
+        first = 2;
+    }
+    if(argc - first > 1) {
+        fprintf(stderr, "usage: %s [-n] [file]\n", argv[0]);
+        return 2;
+    }
+
+    const char *name = first < argc ? argv[first] : "-";
+    gsize len;
+    gchar *text = read_all(name, &len);
+    if(!text) return 1;
+    struct polylines lines = {0};
+    int res = read_polylines(text, len, &lines);
+    g_free(text);
+    if(res < 0) fprintf(stderr, "Skipped bad lines, the last was %i\n", -res);
+    const guint n = lines.starts->len;
+    if(!n) {
+        fprintf(stderr, "Nothing to draw in %s\n", name);
+        free_polylines(&lines);
+        return 1;
+    }
+
+    GTimer *timer = g_timer_new();
+    struct stroke_ref *order = g_new(struct stroke_ref, n);
+    order_polylines(&lines, order);
+    double seconds = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    // Simulate both orders for the travel the machine would actually do
+    struct draw_data data;
+    struct sim_stats stats[2];
+    gsize nsteps[2];
+    draw_data_defaults(&data);
+    data.type = wires;
+    data.step_dist = GEN_LEN_STEP;
+    for(int i = 0; i < 2; i++) {
+        nsteps[i] = compile_polylines(&data, &lines, i ? order : NULL);
+        recalc_draw_data(&data);
+        sim_stats(&data, &stats[i]);
+        if(data.snaps->len)
+            fprintf(stderr, "Snapped the strings %u times%s\n", data.snaps->len,
+                    i ? " reordered" : " as given");
+    }
+    if(!reorder) compile_polylines(&data, &lines, NULL);
+
+    printf("Step Distance: %f\n", data.step_dist);
+    printf("Spool Distance: %f\n", data.spool_dist);
+    printf("Start Length Left: %f\n", data.start_llen);
+    printf("Start Length Right: %f\n", data.start_rlen);
+    write_steps(stdout, &data.steps);
+
+    fprintf(stderr, "Polylines: %u, ordered in %.3fs\n", n, seconds);
+    fprintf(stderr, "Pen Up Length: %f as given, %f reordered, %.1f%% less\n",
+            stats[0].pen_up_length, stats[1].pen_up_length,
+            stats[0].pen_up_length > 0 ?
+                100 * (1 - stats[1].pen_up_length / stats[0].pen_up_length) : 0.0);
+    fprintf(stderr, "Steps: %lu as given, %lu reordered\n",
+            (unsigned long)nsteps[0], (unsigned long)nsteps[1]);
+
+    g_free(order);
+    free_polylines(&lines);
+    free_draw_data(&data);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include "sim.h"
+
+/**
+ * Generates step programs like lines.py does, only much faster, and prints
+ * them in the text format. The output is the same as lines.py's, byte for
+ * byte. How long the generating took goes to stderr.
+ *
+ * usage: robot_sim_gen [-n repeats] [-x] square
+ *        robot_sim_gen [-n repeats] [-x] circle [x y r]
+ *
+ * circle defaults to lines.py's circle(200, 200, 100). With -n the program
+ * is generated that many times over for timing but only printed once. With
+ * -x the same lines are stepped exactly with gen_line_lattice instead, and
+ * how far the simulated pen strays from them goes to stderr too.
+ */
+
+/**
+ * The lines gen_square and gen_circle draw, as one polyline.
+ */
+static void shape_polylines(struct polylines *lines, gboolean square,
+                            double x, double y, double r)
+{
+    static const double corners[] = {100, 100, 100, 200, 200, 200, 200, 100, 100, 100, 200, 200};
+    const double pi = 3.14159265358979323846;
+    gsize start = 0;
+
+    lines->xy = g_array_new(FALSE, FALSE, sizeof(double));
+    lines->starts = g_array_new(FALSE, FALSE, sizeof(gsize));
+    g_array_append_val(lines->starts, start);
+    if(square) {
+        g_array_append_vals(lines->xy, corners, G_N_ELEMENTS(corners));
+        return;
+    }
+    for(double t = 1.0; t < GEN_CIRCLE_SEGMENTS + 2; t += 1.0) {
+        double xy[2] = {x + r * cos(2*pi * t/GEN_CIRCLE_SEGMENTS),
+                        y + r * sin(2*pi * t/GEN_CIRCLE_SEGMENTS)};
+        g_array_append_vals(lines->xy, xy, 2);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const double spool_dist = 400.0;
+    int repeats = 1;
+    gboolean exact = FALSE;
+    int first = 1;
+
+    for(; first < argc && argv[first][0] == '-'; first++) {
+        if(0 == strcmp(argv[first], "-x")) exact = TRUE;
+        else if(0 == strcmp(argv[first], "-n") && first + 1 < argc) {
+            repeats = atoi(argv[++first]);
+            repeats = MAX(repeats, 1);
+        }
+        else break;
+    }
+    gboolean square = argc - first == 1 && 0 == strcmp(argv[first], "square");
+    gboolean circle = (argc - first == 1 || argc - first == 4) &&
+                      0 == strcmp(argv[first], "circle");
+    if(!square && !circle) {
+        fprintf(stderr, "usage: %s [-n repeats] [-x] square\n"
+                        "       %s [-n repeats] [-x] circle [x y r]\n", argv[0], argv[0]);
+        return 2;
+    }
+    double x = 200, y = 200, r = 100;
+    if(argc - first == 4) {
+        x = atof(argv[first + 1]);
+        y = atof(argv[first + 2]);
+        r = atof(argv[first + 3]);
+    }
+
+    struct draw_data data;
+    struct polylines lines = {0};
+    draw_data_defaults(&data);
+    data.type = wires;
+    data.spool_dist = spool_dist;
+    data.step_dist = GEN_LEN_STEP;
+    if(exact) shape_polylines(&lines, square, x, y, r);
+
+    double llen, rlen;
+    gsize n = 0;
+    GTimer *timer = g_timer_new();
+    for(int i = 0; i < repeats; i++) {
+        if(exact) {
+            n = compile_polylines(&data, &lines, NULL);
+            llen = data.start_llen;
+            rlen = data.start_rlen;
+            continue;
+        }
+        step_buf_clear(&data.steps);
+        if(square) n = gen_square(&data.steps, spool_dist, &llen, &rlen);
+        else n = gen_circle(&data.steps, x, y, r, spool_dist, &llen, &rlen);
+        step_buf_flush(&data.steps);
+    }
+    double seconds = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    printf("Step Distance: %f\n", GEN_LEN_STEP);
+    printf("Start Length Left: %f\n", llen);
+    printf("Start Length Right: %f\n", rlen);
+    write_steps(stdout, &data.steps);
+
+    fprintf(stderr, "Generated %lu steps %d times in %.3fs, %.1f Msteps/s\n",
+            (unsigned long)n, repeats, seconds, n * (double)repeats / seconds / 1e6);
+    if(exact) {
+        recalc_draw_data(&data);
+        fprintf(stderr, "Max Deviation: %f\n", polyline_deviation(&data, &lines, NULL));
+        free_polylines(&lines);
+    }
+    free_draw_data(&data);
+    return 0;
+}
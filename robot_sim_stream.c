@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "sim.h"
+
+/**
+ * Simulates a step program as it's read, in constant memory, from a file or
+ * from stdin so a generator can be piped straight in:
+ *
+ *   python lines.py | robot_sim_stream
+ *
+ * Snapped strings are reported as they're found and, with -p, every
+ * pen-down pose is printed as "x y" with a blank line between strokes.
+ * The same summary as robot_sim_cli, less the timing, follows at the end.
+ *
+ * usage: robot_sim_stream [-p] [file]
+ */
+
+static void print_poses(const struct sim_stream *s, gpointer unused)
+{
+    for(gsize i = 0; i < s->n; i++) {
+        if(s->start[i] && s->base + i) putchar('\n');
+        printf("%f %f\n", s->x[i], s->y[i]);
+    }
+    fflush(stdout);
+}
+
+static void print_snapped(const struct pose_range *range, gpointer unused)
+{
+    printf("Snapped: %lu, %lu\n", (unsigned long)range->start, (unsigned long)range->end);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int first = 1;
+    gboolean poses = FALSE;
+
+    if(argc > 1 && 0 == strcmp(argv[1], "-p")) {
+        poses = TRUE;
+        first = 2;
+    }
+    if(argc - first > 1) {
+        fprintf(stderr, "usage: %s [-p] [file]\n", argv[0]);
+        return 2;
+    }
+
+    const char *name = first < argc ? argv[first] : "-";
+    int fd = 0;
+    if(strcmp(name, "-")) {
+        fd = g_open(name, O_RDONLY, 0);
+        if(fd < 0) {
+            fprintf(stderr, "Failed to open file %s\n", name);
+            return 1;
+        }
+    }
+
+    struct draw_data data;
+    draw_data_defaults(&data);
+    data.type = wires;
+    // Big, so not on the stack
+    struct sim_stream *s = g_new0(struct sim_stream, 1);
+    s->data = &data;
+    s->snapped_range = print_snapped;
+    if(poses) s->poses = print_poses;
+
+    int res = sim_stream(fd, name, s);
+    if(fd) close(fd);
+    if(res < 0) {
+        g_free(s);
+        free_draw_data(&data);
+        return 1;
+    }
+
+    const struct sim_stats *stats = &s->stats;
+    if(poses) putchar('\n');
+    printf("File: %s\n", name);
+    if(s->bad_line)
+        printf("Bad Line: %" G_GSIZE_FORMAT "\n", s->bad_line);
+    printf("Steps: %lu\n", (unsigned long)stats->final.step);
+    printf("Poses: %lu\n", (unsigned long)stats->final.npose);
+    printf("Final Position: %f, %f\n", stats->final_x, stats->final_y);
+    printf("Final Lengths: %f, %f\n", stats->final_llen, stats->final_rlen);
+    printf("Pen: %s\n", stats->final.pen_down ? "down" : "up");
+    if(stats->final.npose)
+        printf("Bounding Box: %f, %f, %f, %f\n",
+               stats->min_x, stats->min_y, stats->max_x, stats->max_y);
+    printf("Pen Down Length: %f\n", stats->pen_down_length);
+    printf("Pen Up Length: %f\n", stats->pen_up_length);
+
+    g_free(s);
+    free_draw_data(&data);
+    return 0;
+}
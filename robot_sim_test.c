@@ -0,0 +1,26 @@
+#include <glib.h>
+
+#include "sim.h"
+#include "timing.h"
+#include "validate.h"
+#include "trace.h"
+#include "render.h"
+#include "worker.h"
+
+/**
+ * The core's tests, the worker's and the renderer's, kept out of the GUI so
+ * it starts straight away. -m perf runs the timings too.
+ */
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    sim_add_tests();
+    g_test_add_func("/trace", trace_test);
+    g_test_add_func("/timing", timing_test);
+    g_test_add_func("/perf/timing", timing_perf_test);
+    g_test_add_func("/validate", validate_test);
+    g_test_add_func("/perf/validate", validate_perf_test);
+    g_test_add_func("/worker", worker_test);
+    g_test_add_func("/perf/render", render_perf_test);
+    return g_test_run();
+}
@@ -0,0 +1,3810 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "sim.h"
+#include "trace.h"
+
+/*********** PACKING AND UNPACKING TRIPLETS **************/
+
+char to_num(char ch)
+{
+    switch(ch) {
+        case POS_CHAR: return POS_NUM;
+        case NEG_CHAR: return NEG_NUM;
+        default: return NOP_NUM;
+    }
+}
+
+char to_char(char ch)
+{
+    switch(ch) {
+        case POS_NUM: return POS_CHAR;
+        case NEG_NUM: return NEG_CHAR;
+        default: return NOP_CHAR;
+    }
+}
+
+unsigned int pack(char ins[3])
+{
+    unsigned int res = 0;
+    res += to_num(ins[LEFT]) << LEF_SHIFT;
+    res += to_num(ins[RIGHT]) << RIG_SHIFT;
+    res += to_num(ins[PEN]) << PEN_SHIFT;
+    return res;
+}
+
+void unpack(char ins[3], unsigned int val)
+{
+    ins[LEFT] = to_char((char)((val & LEF_MASK) >> LEF_SHIFT));
+    ins[RIGHT] = to_char((char)((val & RIG_MASK) >> RIG_SHIFT));
+    ins[PEN] = to_char((char)((val & PEN_MASK) >> PEN_SHIFT));
+}
+
+void pack_unpack_test()
+{
+    char test[3][3] = {"+-.", ".+-", "-.+"};
+    g_assert(pack(test[0]) == 0b011000);
+
+
+    char out[3];
+    for(int i = 0; i < 3; i++) {
+        memset(out, 0, 3);
+        unpack(out, pack(test[i]));
+        /* printf("%c%c%c\n", test[i][0], test[i][1], test[i][2]); */
+        /* printf("%c%c%c\n", out[0], out[1], out[2]); */
+        g_assert(0 == strncmp(test[i], out, 3));
+    }
+}
+
+/*********** STEP STORAGE **************/
+
+void step_buf_reserve(struct step_buf *buf, gsize n)
+{
+    if(buf->alloc >= buf->len + n) return;
+    const gsize old = buf->alloc;
+    // Double the allocation so appending is amortised O(1)
+    buf->alloc = MAX(buf->alloc * 2, buf->len + n);
+    buf->alloc = MAX(buf->alloc, 4096);
+    buf->data = g_realloc(buf->data, buf->alloc);
+    trace_count(counter_step_bytes, buf->alloc - old);
+}
+
+/**
+ * Writes the pending run into data. Must be called once all the steps have
+ * been appended, before anything reads the buffer.
+ */
+void step_buf_flush(struct step_buf *buf)
+{
+    if(!buf->run_len) return;
+    // op byte + enough 7 bit groups for a 64 bit count
+    step_buf_reserve(buf, 1 + (64 + RUN_BITS - 1) / RUN_BITS);
+    buf->data[buf->len++] = buf->run_op;
+    for(guint64 extra = buf->run_len - 1; extra; extra >>= RUN_BITS)
+        buf->data[buf->len++] = RUN_FLAG | (extra & ~RUN_FLAG);
+    buf->run_len = 0;
+}
+
+void step_buf_append(struct step_buf *buf, guint8 step)
+{
+    buf->nsteps++;
+    if(buf->run_len && step == buf->run_op) {
+        buf->run_len++;
+        return;
+    }
+    step_buf_flush(buf);
+    buf->run_op = step;
+    buf->run_len = 1;
+}
+
+void step_buf_clear(struct step_buf *buf)
+{
+    buf->len = buf->nsteps = 0;
+    buf->run_len = 0;
+}
+
+void step_buf_free(struct step_buf *buf)
+{
+    if(buf->data) trace_count(counter_step_bytes, -(gssize)buf->alloc);
+    g_free(buf->data);
+    buf->data = NULL;
+    buf->alloc = 0;
+    step_buf_clear(buf);
+}
+
+/**
+ * Makes to into a copy of from.
+ */
+void step_buf_copy(struct step_buf *to, const struct step_buf *from)
+{
+    step_buf_clear(to);
+    step_buf_reserve(to, from->len);
+    if(from->len) memcpy(to->data, from->data, from->len);
+    to->len = from->len;
+    to->nsteps = from->nsteps;
+    to->run_op = from->run_op;
+    to->run_len = from->run_len;
+}
+
+/**
+ * Decodes the run starting at p into its triplet and step count.
+ * Returns the start of the next run.
+ */
+const guint8 *step_run(const guint8 *p, const guint8 *end, guint8 *op, guint64 *count)
+{
+    guint64 extra = 0;
+    int shift = 0;
+    *op = *p++;
+    for(; p < end && (*p & RUN_FLAG); p++, shift += RUN_BITS)
+        extra |= (guint64)(*p & ~RUN_FLAG) << shift;
+    *count = extra + 1;
+    return p;
+}
+
+void step_buf_test()
+{
+    struct step_buf buf = {0};
+    const guint64 counts[] = {1, 2, 128, 129, 300000};
+    guint8 op;
+    guint64 count;
+
+    for(int i = 0; i < G_N_ELEMENTS(counts); i++)
+        for(guint64 j = 0; j < counts[i]; j++)
+            step_buf_append(&buf, i % 2 ? pack("+-+") : pack(".+-"));
+    step_buf_flush(&buf);
+    g_assert(buf.nsteps == 1 + 2 + 128 + 129 + 300000);
+
+    // Alternating triplets never merge so each count comes back as a run
+    const guint8 *p = buf.data, *end = buf.data + buf.len;
+    for(int i = 0; i < G_N_ELEMENTS(counts); i++) {
+        p = step_run(p, end, &op, &count);
+        g_assert(op == (i % 2 ? pack("+-+") : pack(".+-")));
+        g_assert(count == counts[i]);
+    }
+    g_assert(p == end);
+    // Runs of 128 and 129 straddle the one/two extra byte boundary
+    g_assert(buf.len == 1 + 2 + 2 + 3 + 4);
+    step_buf_free(&buf);
+}
+
+/********** INPUT FILE READING *******************/
+/**
+ * Maps a triplet character straight to its 2-bit number, same as to_num()
+ * but without the branches. Anything that isn't '+' or '-' is a no-op.
+ */
+static const guint8 step_lut[256] = {
+    [(guint8)POS_CHAR] = POS_NUM,
+    [(guint8)NEG_CHAR] = NEG_NUM,
+};
+
+/**
+ * Decodes triples, one on each line, from a block of memory (usually a
+ * mapped file) and appends them to steps.
+ * Returns the number of lines read, bad ones included. A bad line is skipped
+ * and reading carries on, bad_line (if not NULL) is set to the 1-indexed
+ * number of the last one or 0 if there weren't any. Blank lines are skipped
+ * and not counted.
+ * */
+gsize read_steps(const char *text, gsize len, struct step_buf *steps, gsize *bad_line)
+{
+    const guint8 *p = (const guint8*)text;
+    const guint8 *end = p + len;
+    gsize i = 0;
+    gsize bad = 0;
+
+    while(p < end) {
+        // Fast path: "xyz\n", a single branch on where the newlines are. A
+        // '\r' before the '\n' makes it a short line with a \r\n ending.
+        while(end - p >= 4 &&
+              ((p[0] != '\n') & (p[1] != '\n') & (p[2] != '\n') & (p[2] != '\r') &
+               (p[3] == '\n'))) {
+            step_buf_append(steps, step_lut[p[LEFT]] << LEF_SHIFT |
+                                   step_lut[p[RIGHT]] << RIG_SHIFT |
+                                   step_lut[p[PEN]] << PEN_SHIFT);
+            p += 4;
+            i++;
+        }
+        if(p >= end) break;
+
+        // Slow path: short or long lines, \r\n endings, blank lines, no
+        // newline at the end of the file.
+        const guint8 *eol = memchr(p, '\n', end - p);
+        if(!eol) eol = end;
+        gsize line_len = eol - p;
+        if(line_len > 0 && p[line_len - 1] == '\r') line_len--;
+        if(line_len > 0) {
+            i++;
+            if(line_len == 3) {
+                step_buf_append(steps, step_lut[p[LEFT]] << LEF_SHIFT |
+                                       step_lut[p[RIGHT]] << RIG_SHIFT |
+                                       step_lut[p[PEN]] << PEN_SHIFT);
+            }
+            else bad = i;
+        }
+        p = eol + 1;
+    }
+    step_buf_flush(steps);
+    if(bad_line) *bad_line = bad;
+    return i;
+}
+
+void read_steps_test()
+{
+    const char good[] = "+-.\n.+-\n.+-\n-.+\n";
+    struct step_buf steps = {0};
+    gsize bad_line = 1;
+    g_assert(4 == read_steps(good, strlen(good), &steps, &bad_line));
+    g_assert(0 == bad_line);
+    g_assert(4 == steps.nsteps);
+    // The repeated ".+-" becomes a run
+    g_assert(4 == steps.len);
+    g_assert(pack("+-.") == steps.data[0]);
+    g_assert(pack(".+-") == steps.data[1]);
+    g_assert((RUN_FLAG | 1) == steps.data[2]);
+    g_assert(pack("-.+") == steps.data[3]);
+
+    // Bad lines are skipped and the last one is reported
+    const char bad[] = "+-.\r\n++\n\n..+\n+-.+\n--";
+    step_buf_clear(&steps);
+    g_assert(5 == read_steps(bad, strlen(bad), &steps, &bad_line));
+    g_assert(5 == bad_line);
+    g_assert(2 == steps.nsteps);
+    g_assert(pack("..+") == steps.data[1]);
+
+    // \r\n endings read the same as \n, short lines included
+    const char *lines[] = {"+-.", "+-", "", "..+", "+-.+", "-", "-.+"};
+    GString *lf = g_string_new(NULL), *crlf = g_string_new(NULL);
+    for(guint i = 0; i < G_N_ELEMENTS(lines); i++) {
+        g_string_append_printf(lf, "%s\n", lines[i]);
+        g_string_append_printf(crlf, "%s\r\n", lines[i]);
+    }
+    struct step_buf crlf_steps = {0};
+    gsize crlf_bad_line;
+    step_buf_clear(&steps);
+    g_assert(6 == read_steps(lf->str, lf->len, &steps, &bad_line));
+    g_assert(6 == read_steps(crlf->str, crlf->len, &crlf_steps, &crlf_bad_line));
+    g_assert(5 == bad_line && bad_line == crlf_bad_line);
+    g_assert(3 == steps.nsteps && steps.nsteps == crlf_steps.nsteps);
+    g_assert(steps.len == crlf_steps.len);
+    g_assert(0 == memcmp(steps.data, crlf_steps.data, steps.len));
+    g_string_free(lf, TRUE);
+    g_string_free(crlf, TRUE);
+    step_buf_free(&crlf_steps);
+    step_buf_free(&steps);
+}
+
+/**
+ * The optional text header fields, each may be left out but they have to
+ * come in this order.
+ */
+static const struct {
+    const char *format;
+    glong offset; // of the float in struct draw_data
+} header_fields[] = {
+    {"Paper Offset Y: %f\n", G_STRUCT_OFFSET(struct draw_data, paper_offset_y)},
+    {"Paper Offset X: %f\n", G_STRUCT_OFFSET(struct draw_data, paper_offset_x)},
+    {"Step Distance: %f\n", G_STRUCT_OFFSET(struct draw_data, step_dist)},
+    {"Spool Distance: %f\n", G_STRUCT_OFFSET(struct draw_data, spool_dist)},
+    {"Start Length Left: %f\n", G_STRUCT_OFFSET(struct draw_data, start_llen)},
+    {"Start Length Right: %f\n", G_STRUCT_OFFSET(struct draw_data, start_rlen)},
+};
+
+/**
+ * The robot type, if line is a "Robot Type: name" header line naming one.
+ * It can only come before all the other fields.
+ */
+static gboolean scan_robot_type(const char *line, enum robot_type *type)
+{
+    char name[16];
+    return 1 == sscanf(line, "Robot Type: %15s", name) && robot_type_from_name(name, type);
+}
+
+long int fscan_float_maybe(FILE *f, const char *str, float *var, long int pos)
+{
+    if(1 == fscanf(f, str, var)) 
+      pos = ftell(f);
+    else
+      fseek(f, pos, SEEK_SET);
+    return pos;
+}
+
+/**
+ * Little-endian fields of the binary header, whatever the host is.
+ */
+static void put_u32(guint8 *p, guint32 v)
+{
+    for(int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+static void put_u64(guint8 *p, guint64 v)
+{
+    for(int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+static void put_f32(guint8 *p, float v)
+{
+    guint32 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_u32(p, bits);
+}
+static guint32 get_u32(const guint8 *p)
+{
+    guint32 v = 0;
+    for(int i = 0; i < 4; i++) v |= (guint32)p[i] << (8 * i);
+    return v;
+}
+static guint64 get_u64(const guint8 *p)
+{
+    guint64 v = 0;
+    for(int i = 0; i < 8; i++) v |= (guint64)p[i] << (8 * i);
+    return v;
+}
+static float get_f32(const guint8 *p)
+{
+    guint32 bits = get_u32(p);
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+/**
+ * Saves the header fields and steps in the binary format.
+ */
+int write_binary(const char *fname, struct draw_data *data)
+{
+    guint8 header[BIN_HEADER_SIZE];
+
+    step_buf_flush(&data->steps);
+    memcpy(header, BIN_MAGIC, BIN_MAGIC_LEN);
+    put_u32(header + 8, BIN_VERSION);
+    put_u32(header + 12, data->type);
+    put_f32(header + 16, data->paper_offset_y);
+    put_f32(header + 20, data->paper_offset_x);
+    put_f32(header + 24, data->step_dist);
+    put_f32(header + 28, data->spool_dist);
+    put_f32(header + 32, data->start_llen);
+    put_f32(header + 36, data->start_rlen);
+    put_u64(header + 40, data->steps.nsteps);
+    put_u64(header + 48, data->steps.len);
+
+    FILE *f = fopen(fname, "wb");
+    if(!f) {
+        printf("Failed to open file %s\n", fname);
+        return -1;
+    }
+    gboolean ok = 1 == fwrite(header, sizeof(header), 1, f) &&
+                  data->steps.len == fwrite(data->steps.data, 1, data->steps.len, f);
+    ok = 0 == fclose(f) && ok;
+    if(!ok) {
+        printf("Failed to write file %s\n", fname);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Saves the header fields and steps in the text format.
+ */
+int write_text(const char *fname, struct draw_data *data)
+{
+    FILE *f = fopen(fname, "w");
+    if(!f) {
+        printf("Failed to open file %s\n", fname);
+        return -1;
+    }
+    fprintf(f, "Robot Type: %s\n", robot_type_name(data->type));
+    for(int i = 0; i < G_N_ELEMENTS(header_fields); i++)
+        fprintf(f, header_fields[i].format,
+                G_STRUCT_MEMBER(float, data, header_fields[i].offset));
+    step_buf_flush(&data->steps);
+    write_steps(f, &data->steps);
+    if(ferror(f) | fclose(f)) {
+        printf("Failed to write file %s\n", fname);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes steps out in the text format, a line each, in big blocks.
+ */
+void write_steps(FILE *f, const struct step_buf *steps)
+{
+    char buf[4096];
+    gsize len = 0;
+    const guint8 *p = steps->data, *end = steps->data + steps->len;
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        char line[4];
+        p = step_run(p, end, &op, &count);
+        unpack(line, op);
+        line[3] = '\n';
+        for(guint64 i = 0; i < count; i++) {
+            if(len + 4 > sizeof(buf)) {
+                fwrite(buf, 1, len, f);
+                len = 0;
+            }
+            memcpy(buf + len, line, 4);
+            len += 4;
+        }
+    }
+    fwrite(buf, 1, len, f);
+}
+
+/**
+ * Checks steps read straight from a file could have come from a step_buf:
+ * every run starts with a triplet and its count fits in 64 bits. Sets
+ * nsteps to how many steps there are. Far cheaper than parsing, it only
+ * looks at the run bytes.
+ */
+static gboolean check_binary_steps(const guint8 *p, gsize len, guint64 *nsteps)
+{
+    const guint8 *end = p + len;
+    guint64 total = 0;
+    while(p < end) {
+        if(*p & ~(LEF_MASK | RIG_MASK | PEN_MASK)) return FALSE;
+        const guint8 *run = p + 1;
+        while(run < end && (*run & RUN_FLAG)) run++;
+        if(run - p - 1 > (64 + RUN_BITS - 1) / RUN_BITS) return FALSE;
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        total += count;
+    }
+    *nsteps = total;
+    return TRUE;
+}
+
+/**
+ * Checks a binary header, leaving the step counts in nsteps and nbytes.
+ * Nothing goes into data until set_binary_header.
+ */
+static int parse_binary_header(const guint8 *header, const char *fname,
+                               guint64 *nsteps, guint64 *nbytes)
+{
+    guint32 version = get_u32(header + 8);
+    if(version != BIN_VERSION) {
+        printf("Unsupported version %u in %s\n", version, fname);
+        return -1;
+    }
+    guint32 type = get_u32(header + 12);
+    if(type > elbow) {
+        printf("Unknown robot type %u in %s\n", type, fname);
+        return -1;
+    }
+    *nsteps = get_u64(header + 40);
+    *nbytes = get_u64(header + 48);
+    if(*nbytes > G_MAXSIZE) {
+        printf("Too many steps in %s\n", fname);
+        return -1;
+    }
+    return 0;
+}
+
+static void set_binary_header(const guint8 *header, struct draw_data *data)
+{
+    data->type = get_u32(header + 12);
+    data->paper_offset_y = get_f32(header + 16);
+    data->paper_offset_x = get_f32(header + 20);
+    data->step_dist = get_f32(header + 24);
+    data->spool_dist = get_f32(header + 28);
+    data->start_llen = get_f32(header + 32);
+    data->start_rlen = get_f32(header + 36);
+}
+
+/**
+ * The binary file in bytes [0, len) into data, or nothing if any of it's bad.
+ */
+static int parse_binary(const guint8 *bytes, gsize len, const char *fname,
+                        struct draw_data *data)
+{
+    guint64 nsteps, nbytes, total;
+    if(len < BIN_HEADER_SIZE) {
+        printf("Truncated header in %s\n", fname);
+        return -1;
+    }
+    if(parse_binary_header(bytes, fname, &nsteps, &nbytes) < 0)
+        return -1;
+    const guint8 *p = bytes + BIN_HEADER_SIZE;
+    if(nbytes > len - BIN_HEADER_SIZE ||
+       !check_binary_steps(p, nbytes, &total) || total != nsteps) {
+        printf("Corrupt steps in %s\n", fname);
+        return -1;
+    }
+
+    // Keep the old allocation around, like the text path
+    step_buf_clear(&data->steps);
+    step_buf_reserve(&data->steps, nbytes);
+    memcpy(data->steps.data, p, nbytes);
+    data->steps.len = nbytes;
+    data->steps.nsteps = nsteps;
+    set_binary_header(bytes, data);
+    return 0;
+}
+
+/**
+ * The rest of read_data for a binary file. It's mapped like a text one and
+ * the steps checked in place, so they're only copied once they're known good.
+ */
+static int read_binary(char *fname, struct draw_data *data)
+{
+    GError *error = NULL;
+    GMappedFile *map = g_mapped_file_new(fname, FALSE, &error);
+    if(!map) {
+        printf("Failed to map file %s: %s\n", fname, error->message);
+        g_error_free(error);
+        return -1;
+    }
+    gsize len = g_mapped_file_get_length(map);
+    int res = parse_binary((const guint8*)g_mapped_file_get_contents(map), len,
+                           fname, data);
+    if(res == 0) data->load_bytes = len;
+    g_mapped_file_unref(map);
+    return res;
+}
+
+/**
+ * Reads a step file into data, header values override what's already there.
+ * Returns -1 if the file couldn't be read at all.
+ */
+int read_data(char *fname, struct draw_data *data)
+{
+    FILE *f = fopen(fname, "r");
+    if(!f) {
+        printf("Failed to open file %s\n", fname);
+        return -1;
+    }
+    char magic[BIN_MAGIC_LEN];
+    if(BIN_MAGIC_LEN == fread(magic, 1, BIN_MAGIC_LEN, f) &&
+       0 == memcmp(magic, BIN_MAGIC, BIN_MAGIC_LEN)) {
+        fclose(f);
+        GTimer *timer = g_timer_new();
+        gint64 t = trace_begin();
+        data->steps_version++;
+        data->bad_line = 0;
+        int res = read_binary(fname, data);
+        trace_end(span_parse, t);
+        data->load_seconds = g_timer_elapsed(timer, NULL);
+        g_timer_destroy(timer);
+        return res;
+    }
+    rewind(f);
+
+    long int pos = ftell(f);
+    char line[128];
+    if(fgets(line, sizeof(line), f) && scan_robot_type(line, &data->type)) pos = ftell(f);
+    else fseek(f, pos, SEEK_SET);
+    for(int i = 0; i < G_N_ELEMENTS(header_fields); i++)
+        pos = fscan_float_maybe(f, header_fields[i].format,
+                                G_STRUCT_MEMBER_P(data, header_fields[i].offset), pos);
+    fclose(f);
+
+    // Keep the old allocation around, it's likely the right size anyway
+    step_buf_clear(&data->steps);
+    data->steps_version++;
+    data->bad_line = 0;
+    GTimer *timer = g_timer_new();
+    GError *error = NULL;
+    GMappedFile *map = g_mapped_file_new(fname, FALSE, &error);
+    if(!map) {
+        printf("Failed to map file %s: %s\n", fname, error->message);
+        g_error_free(error);
+        g_timer_destroy(timer);
+        return -1;
+    }
+    // Empty files map to NULL contents
+    const char *text = g_mapped_file_get_contents(map);
+    gsize len = g_mapped_file_get_length(map);
+    data->load_bytes = len;
+    if(text && pos < len) {
+        gint64 t = trace_begin();
+        // Bad lines are non-fatal, it's up to the caller to mention them
+        read_steps(text + pos, len - pos, &data->steps, &data->bad_line);
+        trace_end(span_parse, t);
+    }
+    g_mapped_file_unref(map);
+
+    data->load_seconds = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+    return 0;
+}
+
+void binary_test()
+{
+    gchar *text_name = g_build_filename(g_get_tmp_dir(), "robot_sim_test.txt", NULL);
+    gchar *bin_name = g_build_filename(g_get_tmp_dir(), "robot_sim_test.bin", NULL);
+
+    // Long enough for runs with several count bytes
+    GString *text = g_string_new("Paper Offset Y: 25.5\nStep Distance: 0.1\n"
+                                 "Start Length Left: 250\n");
+    for(int i = 0; i < 1000; i++) g_string_append(text, "+-.\n.+-\n");
+    for(int i = 0; i < 20000; i++) g_string_append(text, "+..\n");
+    g_string_append(text, "--+\n");
+    g_assert(g_file_set_contents(text_name, text->str, text->len, NULL));
+
+    struct draw_data a, b;
+    draw_data_defaults(&a);
+    draw_data_defaults(&b);
+    a.type = planar;
+    g_assert(0 == read_data(text_name, &a));
+    g_assert(0 == write_binary(bin_name, &a));
+    g_assert(0 == read_data(bin_name, &b));
+
+    g_assert(b.type == planar);
+    g_assert(b.paper_offset_y == 25.5f && b.paper_offset_x == a.paper_offset_x);
+    g_assert(b.step_dist == a.step_dist && b.spool_dist == a.spool_dist);
+    g_assert(b.start_llen == 250 && b.start_rlen == a.start_rlen);
+    g_assert(b.bad_line == 0);
+    g_assert(b.steps.nsteps == 22001 && b.steps.nsteps == a.steps.nsteps);
+    g_assert(b.steps.len == a.steps.len);
+    g_assert(0 == memcmp(a.steps.data, b.steps.data, a.steps.len));
+
+    gchar *bin;
+    gsize bin_len;
+    g_assert(g_file_get_contents(bin_name, &bin, &bin_len, NULL));
+    g_assert(bin_len == BIN_HEADER_SIZE + a.steps.len);
+    g_assert(a.load_bytes == text->len && b.load_bytes == bin_len);
+    g_test_message("%lu text bytes, %lu binary", (unsigned long)text->len,
+                   (unsigned long)bin_len);
+
+    // A run count byte where a triplet should be
+    bin[BIN_HEADER_SIZE] = RUN_FLAG;
+    g_assert(g_file_set_contents(bin_name, bin, bin_len, NULL));
+    g_assert(-1 == read_data(bin_name, &b));
+    // Steps missing off the end
+    bin[BIN_HEADER_SIZE] = a.steps.data[0];
+    g_assert(g_file_set_contents(bin_name, bin, bin_len - 1, NULL));
+    g_assert(-1 == read_data(bin_name, &b));
+    // Or the header cut short
+    g_assert(g_file_set_contents(bin_name, bin, BIN_HEADER_SIZE - 1, NULL));
+    g_assert(-1 == read_data(bin_name, &b));
+    // Far more steps than the file holds, and none of its header is taken
+    put_u64((guint8 *)bin + 48, (guint64)1 << 40);
+    put_f32((guint8 *)bin + 24, 2 * a.step_dist);
+    g_assert(g_file_set_contents(bin_name, bin, bin_len, NULL));
+    g_assert(-1 == read_data(bin_name, &b));
+    g_assert(b.step_dist == a.step_dist && b.load_bytes == bin_len);
+    g_assert(b.steps.nsteps == a.steps.nsteps);
+    g_assert(0 == memcmp(a.steps.data, b.steps.data, a.steps.len));
+
+    g_remove(text_name);
+    g_remove(bin_name);
+    g_free(bin);
+    g_free(text_name);
+    g_free(bin_name);
+    g_string_free(text, TRUE);
+    free_draw_data(&a);
+    free_draw_data(&b);
+}
+
+/***************** GEOMETRY *********************/
+
+static const char *const robot_type_names[] = {
+    [wires] = "wires", [planar] = "planar", [elbow] = "elbow",
+};
+
+const char *robot_type_name(enum robot_type type)
+{
+    return type <= elbow ? robot_type_names[type] : "unknown";
+}
+
+gboolean robot_type_from_name(const char *name, enum robot_type *type)
+{
+    for(int i = 0; i < G_N_ELEMENTS(robot_type_names); i++) {
+        if(g_ascii_strcasecmp(name, robot_type_names[i])) continue;
+        *type = i;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * Where the pen is for one pair of motor positions. Leaves x and y alone
+ * where the strings can't reach each other, validate_steps is what reports
+ * that.
+ */
+void to_coords(float *x, float *y, float spool_dist, float llen, float rlen, enum robot_type type)
+{
+    if(type != wires) {
+        guint8 snapped;
+        coords_kernel_for(type)(x, y, &snapped, &llen, &rlen, 1, spool_dist);
+        return;
+    }
+    if(llen + rlen < spool_dist)
+        return;
+    float xf = (spool_dist*spool_dist + llen*llen - rlen*rlen) / (2.0 * spool_dist);
+    *x = xf;
+    *y = sqrt(llen*llen - xf*xf);
+}
+
+/**
+ * The wires robot, the triangle between the spools and the pen.
+ */
+static gsize wires_coords(float *x, float *y, guint8 *snapped,
+                          const float *llen, const float *rlen, gsize n, float spool_dist)
+{
+    const float sd2 = spool_dist * spool_dist;
+    const float inv = 1.0f / (2.0f * spool_dist);
+    gsize nsnapped = 0;
+    gsize i = 0;
+
+#ifdef __SSE2__
+    const __m128 vsd = _mm_set1_ps(spool_dist);
+    const __m128 vsd2 = _mm_set1_ps(sd2);
+    const __m128 vinv = _mm_set1_ps(inv);
+    for(; i + 4 <= n; i += 4) {
+        __m128 l = _mm_loadu_ps(&llen[i]);
+        __m128 r = _mm_loadu_ps(&rlen[i]);
+        __m128 ll = _mm_mul_ps(l, l);
+        __m128 xf = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(vsd2, ll), _mm_mul_ps(r, r)), vinv);
+        _mm_storeu_ps(&x[i], xf);
+        _mm_storeu_ps(&y[i], _mm_sqrt_ps(_mm_sub_ps(ll, _mm_mul_ps(xf, xf))));
+        int mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(l, r), vsd));
+        for(int j = 0; j < 4; j++) {
+            snapped[i + j] = (mask >> j) & 1;
+            nsnapped += snapped[i + j];
+        }
+    }
+#endif
+    // Same sums in the same order as above so both paths agree exactly
+    for(; i < n; i++) {
+        float ll = llen[i] * llen[i];
+        float xf = (sd2 + ll - rlen[i] * rlen[i]) * inv;
+        x[i] = xf;
+        y[i] = sqrtf(ll - xf * xf);
+        snapped[i] = llen[i] + rlen[i] < spool_dist;
+        nsnapped += snapped[i];
+    }
+    return nsnapped;
+}
+
+/**
+ * The gantry, each motor drives an axis directly. Nothing to snap.
+ */
+static gsize planar_coords(float *x, float *y, guint8 *snapped,
+                           const float *llen, const float *rlen, gsize n, float spool_dist)
+{
+    memcpy(x, llen, n * sizeof(float));
+    memcpy(y, rlen, n * sizeof(float));
+    memset(snapped, 0, n);
+    return 0;
+}
+
+/**
+ * The arm, shoulder angle from the x axis and elbow angle from the upper
+ * arm, in degrees. Every pair of angles is somewhere so nothing snaps.
+ */
+static gsize elbow_coords(float *x, float *y, guint8 *snapped,
+                          const float *llen, const float *rlen, gsize n, float spool_dist)
+{
+    const float link = spool_dist / 2;
+    const float rad = 3.14159265358979323846f / 180;
+    for(gsize i = 0; i < n; i++) {
+        float shoulder = llen[i] * rad, forearm = (llen[i] + rlen[i]) * rad;
+        x[i] = link + link * (cosf(shoulder) + cosf(forearm));
+        y[i] = link * (sinf(shoulder) + sinf(forearm));
+    }
+    memset(snapped, 0, n);
+    return 0;
+}
+
+/**
+ * The batch kinematics for a robot type, to look up once and then call for
+ * every batch rather than to switch on the type inside the loop.
+ */
+coords_kernel coords_kernel_for(enum robot_type type)
+{
+    static const coords_kernel kernels[] = {
+        [wires] = wires_coords, [planar] = planar_coords, [elbow] = elbow_coords,
+    };
+    return type <= elbow ? kernels[type] : wires_coords;
+}
+
+/**
+ * to_coords for n poses at once, lengths in and coordinates out as separate
+ * arrays. Where the strings can't reach each other snapped[i] is set and
+ * x[i], y[i] are meaningless. Returns how many snapped.
+ */
+gsize to_coords_batch(float *x, float *y, guint8 *snapped,
+                      const float *llen, const float *rlen, gsize n,
+                      float spool_dist, enum robot_type type)
+{
+    return coords_kernel_for(type)(x, y, snapped, llen, rlen, n, spool_dist);
+}
+
+void to_coords_batch_test()
+{
+    // Includes some snapped strings and isn't a multiple of the vector width
+    enum { n = 11 };
+    float llen[n], rlen[n], x[n], y[n], bx[n], by[n];
+    guint8 snapped[n];
+    const float spool_dist = 400.0;
+    for(int i = 0; i < n; i++) {
+        llen[i] = 100.0 + 40.0 * i;
+        rlen[i] = 250.0 - 5.0 * i;
+    }
+    gsize nsnapped = to_coords_batch(bx, by, snapped, llen, rlen, n, spool_dist, wires);
+    g_assert(nsnapped == 2);
+    for(int i = 0; i < n; i++) {
+        g_assert(snapped[i] == (llen[i] + rlen[i] < spool_dist));
+        if(snapped[i]) continue;
+        to_coords(&x[i], &y[i], spool_dist, llen[i], rlen[i], wires);
+        // Multiplying by the reciprocal costs the odd ulp
+        g_assert(fabs(x[i] - bx[i]) <= fabs(x[i]) * 4 * FLT_EPSILON);
+        g_assert(fabs(y[i] - by[i]) <= y[i] * 64 * FLT_EPSILON);
+    }
+}
+
+/**
+ * Each robot type's kinematics, whole batches agreeing with to_coords, and
+ * the type coming from the file.
+ */
+void robot_types_test()
+{
+    enum { n = 7 };
+    const float spool_dist = 400.0;
+    float llen[n] = {0, 90, 0, 45, 180, -30, 10};
+    float rlen[n] = {0, 0, 90, 90, 10, 60, 170};
+    float x[n], y[n], sx, sy;
+    guint8 snapped[n];
+
+    g_assert(0 == to_coords_batch(x, y, snapped, llen, rlen, n, spool_dist, planar));
+    for(int i = 0; i < n; i++) {
+        g_assert(x[i] == llen[i] && y[i] == rlen[i] && !snapped[i]);
+        to_coords(&sx, &sy, spool_dist, llen[i], rlen[i], planar);
+        g_assert(sx == x[i] && sy == y[i]);
+    }
+
+    // Straight out along x, straight down, and bent down at the elbow
+    g_assert(0 == to_coords_batch(x, y, snapped, llen, rlen, n, spool_dist, elbow));
+    g_assert(fabsf(x[0] - 600) < 1e-3 && fabsf(y[0]) < 1e-3);
+    g_assert(fabsf(x[1] - 200) < 1e-3 && fabsf(y[1] - 400) < 1e-3);
+    g_assert(fabsf(x[2] - 400) < 1e-3 && fabsf(y[2] - 200) < 1e-3);
+    for(int i = 0; i < n; i++) {
+        // The hand is never further than both links from the shoulder
+        g_assert(hypotf(x[i] - 200, y[i]) <= 400 + 1e-3 && !snapped[i]);
+        to_coords(&sx, &sy, spool_dist, llen[i], rlen[i], elbow);
+        g_assert(sx == x[i] && sy == y[i]);
+    }
+
+    // From the header, in both readers, and only a type it knows
+    gchar *name = g_build_filename(g_get_tmp_dir(), "robot_sim_types.txt", NULL);
+    const char text[] = "Robot Type: planar\nStep Distance: 0.5\n..+\n+..\n+-.\n";
+    g_assert(g_file_set_contents(name, text, strlen(text), NULL));
+    struct draw_data data;
+    draw_data_defaults(&data);
+    g_assert(0 == read_data(name, &data));
+    g_assert(data.type == planar && data.step_dist == 0.5f && !data.bad_line);
+    data.start_llen = 10;
+    data.start_rlen = 20;
+    recalc_draw_data(&data);
+    g_assert(data.nposes == 3 && data.snaps->len == 0);
+    g_assert(data.pos_data[2] == 11 && data.pos_data[data.nposes + 2] == 19.5);
+
+    struct sim_stream *s = g_new0(struct sim_stream, 1);
+    struct draw_data streamed;
+    draw_data_defaults(&streamed);
+    s->data = &streamed;
+    int fd = g_open(name, O_RDONLY, 0);
+    g_assert(fd >= 0);
+    g_assert(0 == sim_stream(fd, "test", s));
+    close(fd);
+    g_assert(streamed.type == planar && s->stats.final.npose == 3 && !s->bad_line);
+    g_free(s);
+    free_draw_data(&streamed);
+
+    const char unknown[] = "Robot Type: delta\n..+\n";
+    g_assert(g_file_set_contents(name, unknown, strlen(unknown), NULL));
+    draw_data_defaults(&data);
+    g_assert(0 == read_data(name, &data));
+    g_assert(data.type == wires && data.bad_line == 1);
+
+    g_remove(name);
+    g_free(name);
+    free_draw_data(&data);
+}
+
+/**
+ * Microbenchmark, batch vs. one to_coords call per pose.
+ * Only runs with -m perf.
+ */
+void to_coords_perf_test()
+{
+    if(!g_test_perf()) return;
+    const gsize n = 10 * 1000 * 1000;
+    const float spool_dist = 400.0;
+    float *llen = g_malloc(n * sizeof(float));
+    float *rlen = g_malloc(n * sizeof(float));
+    float *x = g_malloc(n * sizeof(float));
+    float *y = g_malloc(n * sizeof(float));
+    guint8 *snapped = g_malloc(n);
+    for(gsize i = 0; i < n; i++) {
+        llen[i] = 200.0 + (i % 1000) * 0.1;
+        rlen[i] = 300.0 - (i % 777) * 0.1;
+    }
+
+    g_test_timer_start();
+    for(gsize i = 0; i < n; i++)
+        to_coords(&x[i], &y[i], spool_dist, llen[i], rlen[i], wires);
+    double scalar = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    to_coords_batch(x, y, snapped, llen, rlen, n, spool_dist, wires);
+    double batch = g_test_timer_elapsed();
+
+    g_test_minimized_result(scalar, "to_coords: %.1f Mposes/s", n / scalar / 1e6);
+    g_test_minimized_result(batch, "to_coords_batch: %.1f Mposes/s", n / batch / 1e6);
+    g_free(llen);
+    g_free(rlen);
+    g_free(x);
+    g_free(y);
+    g_free(snapped);
+}
+
+/************** PATH GENERATION ****************/
+/**
+ * The inverse of to_coords, the string lengths that put the pen at (x, y).
+ * In doubles like lines.py so programs come out the same.
+ */
+void to_lengths(double *llen, double *rlen, double spool_dist, double x, double y)
+{
+    *llen = sqrt(x*x + y*y);
+    *rlen = sqrt(pow(spool_dist - x, 2) + y*y);
+}
+
+/**
+ * Appends the pen-down steps that draw a straight line from (x1, y1) to
+ * (x2, y2), as lines.py's draw_line does: walk the line GEN_CART_STEP mm at
+ * a time and step each motor until its length is within GEN_LEN_STEP of the
+ * point. Returns how many steps were added.
+ */
+gsize gen_line(struct step_buf *steps, double x1, double y1, double x2, double y2,
+               double spool_dist)
+{
+    const double len_step = GEN_LEN_STEP;
+    double prev_llen = 0, prev_rlen = 0;
+    gsize n = 0;
+
+    // lines.py's alpha_blend
+    double dx = x2 - x1, dy = y2 - y1;
+    double x = x1, y = y1;
+    double xstep = GEN_CART_STEP, ystep = GEN_CART_STEP;
+    if(fabs(dx) > fabs(dy)) {
+        xstep = copysign(xstep, dx);
+        ystep = copysign(GEN_CART_STEP * (dy / dx), dy);
+    }
+    else {
+        xstep = copysign(GEN_CART_STEP * (dx / dy), dx);
+        ystep = copysign(ystep, dy);
+    }
+    // Steps too small to move x or y would never get there
+    if(x == x + xstep) x = x2;
+    if(y == y + ystep) y = y2;
+
+    for(; fabs(x - x2) > fabs(xstep) || fabs(y - y2) > fabs(ystep); x += xstep, y += ystep) {
+        double llen, rlen;
+        to_lengths(&llen, &rlen, spool_dist, x, y);
+        if(prev_llen == 0 && prev_rlen == 0) {
+            prev_llen = llen;
+            prev_rlen = rlen;
+        }
+
+        while(fabs(llen - prev_llen) > len_step || fabs(rlen - prev_rlen) > len_step) {
+            guint8 l = NOP_NUM, r = NOP_NUM;
+            if(llen - prev_llen > len_step) {
+                l = POS_NUM;
+                prev_llen += len_step;
+            }
+            else if(prev_llen - llen > len_step) {
+                l = NEG_NUM;
+                prev_llen -= len_step;
+            }
+            if(rlen - prev_rlen > len_step) {
+                r = POS_NUM;
+                prev_rlen += len_step;
+            }
+            else if(prev_rlen - rlen > len_step) {
+                r = NEG_NUM;
+                prev_rlen -= len_step;
+            }
+            step_buf_append(steps, l << LEF_SHIFT | r << RIG_SHIFT | POS_NUM << PEN_SHIFT);
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * lines.py's circle, GEN_CIRCLE_SEGMENTS lines around (x, y). The start
+ * lengths for the program go in llen and rlen.
+ */
+gsize gen_circle(struct step_buf *steps, double x, double y, double r,
+                 double spool_dist, double *llen, double *rlen)
+{
+    const double pi = 3.14159265358979323846;
+    const double segments = GEN_CIRCLE_SEGMENTS;
+    double xp = 0, yp = 0;
+    gsize n = 0;
+
+    // Both the first and last segment, t = 1 to segments + 1
+    for(double t = 1.0; t < segments + 2; t += 1.0) {
+        double xn = x + r * cos(2*pi * t/segments);
+        double yn = y + r * sin(2*pi * t/segments);
+        if(t == 1.0) to_lengths(llen, rlen, spool_dist, xn, yn);
+        else n += gen_line(steps, xp, yp, xn, yn, spool_dist);
+        xp = xn;
+        yp = yn;
+    }
+    return n;
+}
+
+/**
+ * lines.py's test_square, a 100mm square and one diagonal.
+ */
+gsize gen_square(struct step_buf *steps, double spool_dist, double *llen, double *rlen)
+{
+    static const double corners[][4] = {
+        {100, 100, 100, 200},
+        {100, 200, 200, 200},
+        {200, 200, 200, 100},
+        {200, 100, 100, 100},
+        {100, 100, 200, 200},
+    };
+    gsize n = 0;
+    to_lengths(llen, rlen, spool_dist, 100, 100);
+    for(int i = 0; i < G_N_ELEMENTS(corners); i++)
+        n += gen_line(steps, corners[i][0], corners[i][1], corners[i][2], corners[i][3],
+                      spool_dist);
+    return n;
+}
+
+/**
+ * The motor step counts, from the start lengths, nearest to putting the pen
+ * at (x, y). Relative to the same float start lengths recalc_lengths uses.
+ */
+static void counts_at(const struct draw_data *data, double x, double y,
+                      gint64 *lcount, gint64 *rcount)
+{
+    double llen, rlen;
+    to_lengths(&llen, &rlen, data->spool_dist, x, y);
+    *lcount = llround((llen - data->start_llen) / data->step_dist);
+    *rcount = llround((rlen - data->start_rlen) / data->step_dist);
+}
+
+static guint8 delta_num(int d)
+{
+    return d > 0 ? POS_NUM : d < 0 ? NEG_NUM : NOP_NUM;
+}
+
+static void step_move(struct step_buf *steps, gint64 *lcount, gint64 *rcount, int dl, int dr)
+{
+    step_buf_append(steps, delta_num(dl) << LEF_SHIFT | delta_num(dr) << RIG_SHIFT);
+    *lcount += dl;
+    *rcount += dr;
+}
+
+/**
+ * Steps both motors together towards the counts, then whichever has further
+ * to go on its own.
+ */
+static void step_towards(struct step_buf *steps, gint64 *lcount, gint64 *rcount,
+                         gint64 lto, gint64 rto)
+{
+    while(*lcount != lto || *rcount != rto)
+        step_move(steps, lcount, rcount, (lto > *lcount) - (lto < *lcount),
+                  (rto > *rcount) - (rto < *rcount));
+}
+
+
+/**
+ * Where one cable's length crosses from one step count to the next along a
+ * line. The distance from a spool to the point t along the line falls until
+ * the foot of the perpendicular from the spool, tf, then rises, and reaches
+ * any given length at a root of a quadratic in t. So the crossings come out
+ * in order of t, exactly, without sampling the line.
+ */
+struct len_walk {
+    double tf, d2, dlen; // foot of the perpendicular, squared distance to it, line length
+    double start, step;
+    gint64 k, turn, end; // step count now, at the foot and at the end of the line
+    gboolean rising;
+};
+
+static gboolean len_walk_next(struct len_walk *w, double *t, int *dir)
+{
+    gint64 k;
+    // Count k covers lengths from k - 0.5 to k + 0.5 steps
+    if(!w->rising && w->k > w->turn) {
+        k = w->k--;
+        *dir = -1;
+    }
+    else {
+        w->rising = TRUE;
+        if(w->k >= w->end) return FALSE;
+        k = ++w->k;
+        *dir = 1;
+    }
+    double level = w->start + (k - 0.5) * w->step;
+    double h = sqrt(MAX(level * level - w->d2, 0)) / w->dlen;
+    *t = *dir < 0 ? w->tf - h : w->tf + h;
+    return TRUE;
+}
+
+/**
+ * Appends the pen-down steps that take the pen from (x1, y1) to (x2, y2)
+ * along a straight line, walking the lattice of motor step counts like a
+ * DDA rather than sampling the line. The crossings of both cables from one
+ * count to the next are merged in order along the line, which alone would
+ * visit the count nearest the line at every point of it. Each crossing is
+ * then paired with the next one if that's the other motor's, making a
+ * diagonal step that only skips the corner between them. Every pose is
+ * still the nearest count to some point on the line, within half a step
+ * on each cable. No step is a no-op, and it takes the fewest steps that
+ * keeps to that bound.
+ *
+ * lcount and rcount are where the motors are, counted in steps from data's
+ * start lengths, and are moved on to the end of the line. If they aren't at
+ * the start of the line they're first stepped there. Returns how many steps
+ * were added.
+ */
+gsize gen_line_lattice(struct step_buf *steps, const struct draw_data *data,
+                       gint64 *lcount, gint64 *rcount,
+                       double x1, double y1, double x2, double y2)
+{
+    const double dx = x2 - x1, dy = y2 - y1, dd = dx*dx + dy*dy;
+    const gsize before = steps->nsteps;
+    gint64 l, r, lto, rto;
+
+    counts_at(data, x1, y1, &l, &r);
+    step_towards(steps, lcount, rcount, l, r);
+    counts_at(data, x2, y2, &lto, &rto);
+    if(dd > 0) {
+        const double spool_x[2] = {0, data->spool_dist};
+        const double start[2] = {data->start_llen, data->start_rlen};
+        const gint64 from[2] = {l, r}, to[2] = {lto, rto};
+        struct len_walk walk[2];
+        double t[2];
+        int dir[2];
+        gboolean more[2];
+        for(int i = 0; i < 2; i++) {
+            struct len_walk *w = &walk[i];
+            w->tf = ((spool_x[i] - x1) * dx - y1 * dy) / dd;
+            double fx = x1 + w->tf * dx - spool_x[i], fy = y1 + w->tf * dy;
+            w->d2 = fx*fx + fy*fy;
+            w->dlen = sqrt(dd);
+            w->start = start[i];
+            w->step = data->step_dist;
+            w->k = from[i];
+            w->end = to[i];
+            w->rising = FALSE;
+            double tm = CLAMP(w->tf, 0, 1);
+            gint64 turn[2];
+            counts_at(data, x1 + tm * dx, y1 + tm * dy, &turn[LEFT], &turn[RIGHT]);
+            w->turn = turn[i];
+            more[i] = len_walk_next(w, &t[i], &dir[i]);
+        }
+
+        int pending = -1, pending_dir = 0;
+        while(more[LEFT] || more[RIGHT]) {
+            int i = !more[RIGHT] || (more[LEFT] && t[LEFT] <= t[RIGHT]) ? LEFT : RIGHT;
+            int d = dir[i];
+            more[i] = len_walk_next(&walk[i], &t[i], &dir[i]);
+            if(pending >= 0 && pending != i) {
+                step_move(steps, lcount, rcount, i == LEFT ? d : pending_dir,
+                          i == RIGHT ? d : pending_dir);
+                pending = -1;
+                continue;
+            }
+            if(pending >= 0)
+                step_move(steps, lcount, rcount, (pending == LEFT) * pending_dir,
+                          (pending == RIGHT) * pending_dir);
+            pending = i;
+            pending_dir = d;
+        }
+        if(pending >= 0)
+            step_move(steps, lcount, rcount, (pending == LEFT) * pending_dir,
+                      (pending == RIGHT) * pending_dir);
+    }
+    // Only if rounding put the crossings out by one
+    step_towards(steps, lcount, rcount, lto, rto);
+    return steps->nsteps - before;
+}
+
+/**
+ * The SHA-256 of steps as write_steps writes them out.
+ */
+static gchar *steps_checksum(const struct step_buf *steps)
+{
+    gchar *name = g_build_filename(g_get_tmp_dir(), "robot_sim_gen.txt", NULL);
+    FILE *f = fopen(name, "wb");
+    g_assert(f);
+    write_steps(f, steps);
+    g_assert(0 == fclose(f));
+    gchar *text;
+    gsize len;
+    g_assert(g_file_get_contents(name, &text, &len, NULL));
+    gchar *sum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar*)text, len);
+    g_free(text);
+    g_remove(name);
+    g_free(name);
+    return sum;
+}
+
+/**
+ * Generated programs should draw what they were asked to, and be what
+ * lines.py makes byte for byte. The step counts and checksums are of the
+ * triplet lines lines.py prints.
+ */
+void gen_test()
+{
+    // lines.py's test_square and circle(200, 200, 100)
+    const gsize square_steps = 4440, circle_steps = 4833;
+    const char *square_sum = "da1bf02819740b1c2110b0838232cdd5f8f927f74ef87543121ccb5cc0d8a034";
+    const char *circle_sum = "f45562473546e2f59d1bfd7a9a0dfb93f9ab014c03597d8c5795c4603559f3ca";
+    gchar *sum;
+    struct draw_data data;
+    draw_data_defaults(&data);
+    data.type = wires;
+    data.step_dist = GEN_LEN_STEP;
+    data.nthreads = 1;
+
+    double llen, rlen;
+    gsize n = gen_square(&data.steps, data.spool_dist, &llen, &rlen);
+    step_buf_flush(&data.steps);
+    data.steps_version++;
+    g_assert(n == data.steps.nsteps);
+    g_assert(n == square_steps);
+    sum = steps_checksum(&data.steps);
+    g_assert(0 == strcmp(sum, square_sum));
+    g_free(sum);
+    data.start_llen = llen;
+    data.start_rlen = rlen;
+    recalc_draw_data(&data);
+    g_assert(data.nposes == n && data.strokes->len == 1);
+
+    // Every pose is near one of the lines (lines.py's stepping lags by a few
+    // mm coming out of the corners) and the diagonal ends near the far corner,
+    // short of it by the last step along the line and the lag
+    const float *xs = data.pos_data, *ys = data.pos_data + n;
+    for(gsize i = 0; i < n; i++) {
+        float off = MIN(MIN(fabsf(xs[i] - 100), fabsf(xs[i] - 200)),
+                        MIN(fabsf(ys[i] - 100), fabsf(ys[i] - 200)));
+        off = MIN(off, fabsf(xs[i] - ys[i]) / sqrtf(2));
+        g_assert(off < 3);
+    }
+    g_assert(hypot(xs[n - 1] - 200, ys[n - 1] - 200) < 5);
+
+    step_buf_clear(&data.steps);
+    n = gen_circle(&data.steps, 200, 200, 100, data.spool_dist, &llen, &rlen);
+    step_buf_flush(&data.steps);
+    data.steps_version++;
+    g_assert(n == circle_steps);
+    sum = steps_checksum(&data.steps);
+    g_assert(0 == strcmp(sum, circle_sum));
+    g_free(sum);
+    data.start_llen = llen;
+    data.start_rlen = rlen;
+    recalc_draw_data(&data);
+    // Only the start, as in lines.py each line assumes it starts exactly
+    // where it should so the error adds up on the way round
+    const double pi = 3.14159265358979323846;
+    g_assert(hypot(data.pos_data[0] - (200 + 100 * cos(2 * pi / GEN_CIRCLE_SEGMENTS)),
+                   data.pos_data[n] - (200 + 100 * sin(2 * pi / GEN_CIRCLE_SEGMENTS))) < 1);
+    free_draw_data(&data);
+}
+
+/************** COMPILING ****************/
+/**
+ * Adds a point to the open polyline, starting a new one if none is open.
+ */
+static void polyline_add(struct polylines *lines, gboolean *open, double x, double y)
+{
+    if(!*open) {
+        gsize start = lines->xy->len / 2;
+        g_array_append_val(lines->starts, start);
+        *open = TRUE;
+    }
+    double xy[2] = {x, y};
+    g_array_append_vals(lines->xy, xy, 2);
+}
+
+static gboolean path_number(const char **p, double *v)
+{
+    while(g_ascii_isspace(**p) || **p == ',') (*p)++;
+    char *after;
+    *v = g_ascii_strtod(*p, &after);
+    if(after == *p) return FALSE;
+    *p = after;
+    return TRUE;
+}
+
+/**
+ * Reads SVG path data up to end or a closing quote. Returns NULL if it was
+ * all understood, otherwise where it went wrong.
+ */
+static const char *read_path(const char *p, struct polylines *lines)
+{
+    double x = 0, y = 0, x0 = 0, y0 = 0;
+    gboolean open = FALSE;
+    char cmd = 0;
+
+    while(TRUE) {
+        while(g_ascii_isspace(*p) || *p == ',') p++;
+        if(!*p || *p == '"' || *p == '\'') return NULL;
+        if(g_ascii_isalpha(*p)) {
+            cmd = *p++;
+            if(cmd == 'Z' || cmd == 'z') {
+                if(open) polyline_add(lines, &open, x0, y0);
+                x = x0;
+                y = y0;
+                open = FALSE;
+            }
+            continue;
+        }
+
+        const char *at = p;
+        gboolean rel = g_ascii_islower(cmd);
+        double a, b;
+        switch(g_ascii_toupper(cmd)) {
+            case 'M':
+            case 'L':
+                if(!path_number(&p, &a) || !path_number(&p, &b)) return at;
+                x = rel ? x + a : a;
+                y = rel ? y + b : b;
+                if(g_ascii_toupper(cmd) == 'M') {
+                    open = FALSE;
+                    x0 = x;
+                    y0 = y;
+                    // Any more pairs are lines
+                    cmd = rel ? 'l' : 'L';
+                    break;
+                }
+                // Lines start where the last M or Z left the pen
+                if(!open) polyline_add(lines, &open, x0, y0);
+                polyline_add(lines, &open, x, y);
+                break;
+            case 'H':
+            case 'V':
+                if(!path_number(&p, &a)) return at;
+                if(g_ascii_toupper(cmd) == 'H') x = rel ? x + a : a;
+                else y = rel ? y + a : a;
+                if(!open) polyline_add(lines, &open, x0, y0);
+                polyline_add(lines, &open, x, y);
+                break;
+            default:
+                // Curves, arcs, or numbers with no command
+                return at;
+        }
+    }
+}
+
+/**
+ * 1-indexed line that p is on.
+ */
+static int line_of(const char *text, const char *p)
+{
+    int line = 1;
+    for(; text < p; text++)
+        if(*text == '\n') line++;
+    return line;
+}
+
+/**
+ * Appends the polylines in text to lines. An SVG document has the d of every
+ * path read, a path on its own is read as one, and anything else is read as
+ * "x y" lines where blank lines end a polyline and '#' starts a comment.
+ * Returns how many polylines there are or the negative 1-indexed line
+ * number of the last bad line. A bad path stops the reading.
+ */
+int read_polylines(const char *text, gsize len, struct polylines *lines)
+{
+    if(!lines->xy) lines->xy = g_array_new(FALSE, FALSE, sizeof(double));
+    if(!lines->starts) lines->starts = g_array_new(FALSE, FALSE, sizeof(gsize));
+    // Mapped files aren't terminated
+    gchar *copy = g_strndup(text, len);
+    const char *p = copy;
+    int err = 0;
+
+    while(g_ascii_isspace(*p)) p++;
+    if(strstr(copy, "<svg")) {
+        // d="..." or d='...'
+        for(p = strstr(copy, "d="); p && !err; p = strstr(p, "d=")) {
+            gboolean attr = (p == copy || g_ascii_isspace(p[-1])) &&
+                            (p[2] == '"' || p[2] == '\'');
+            p += attr ? 3 : 2;
+            if(!attr) continue;
+            const char *bad = read_path(p, lines);
+            if(bad) err = -line_of(copy, bad);
+        }
+    }
+    else if(*p == 'M' || *p == 'm') {
+        const char *bad = read_path(p, lines);
+        if(bad) err = -line_of(copy, bad);
+    }
+    else {
+        gboolean open = FALSE;
+        int i = 1;
+        for(p = copy; *p; i++) {
+            const char *eol = strchr(p, '\n');
+            if(!eol) eol = p + strlen(p);
+            const char *q = p;
+            while(q < eol && g_ascii_isspace(*q)) q++;
+            double x, y;
+            if(q == eol) open = FALSE;
+            else if(*q == '#');
+            else if(path_number(&q, &x) && path_number(&q, &y) && q <= eol) {
+                while(q < eol && g_ascii_isspace(*q)) q++;
+                if(q == eol) polyline_add(lines, &open, x, y);
+                else err = -i;
+            }
+            else err = -i;
+            p = *eol ? eol + 1 : eol;
+        }
+    }
+    g_free(copy);
+    return err ? err : (int)lines->starts->len;
+}
+
+void free_polylines(struct polylines *lines)
+{
+    if(lines->xy) g_array_free(lines->xy, TRUE);
+    if(lines->starts) g_array_free(lines->starts, TRUE);
+    lines->xy = lines->starts = NULL;
+}
+
+static const double *polyline_point(const struct polylines *lines, gsize i)
+{
+    return &g_array_index(lines->xy, double, 2 * i);
+}
+
+/**
+ * One past the last point of polyline i.
+ */
+static gsize polyline_end(const struct polylines *lines, guint i)
+{
+    if(i + 1 < lines->starts->len)
+        return g_array_index(lines->starts, gsize, i + 1);
+    return lines->xy->len / 2;
+}
+
+/**
+ * The first and last point of a polyline, the way round it'll be drawn.
+ */
+static void stroke_ref_ends(const struct polylines *lines, struct stroke_ref ref,
+                            const double **first, const double **last)
+{
+    const double *a = polyline_point(lines, g_array_index(lines->starts, gsize, ref.line));
+    const double *b = polyline_point(lines, polyline_end(lines, ref.line) - 1);
+    *first = ref.reversed ? b : a;
+    *last = ref.reversed ? a : b;
+}
+
+/**
+ * Point i of a polyline, counting the way round it'll be drawn. Past the end
+ * is the last point.
+ */
+static const double *stroke_point(const struct polylines *lines, struct stroke_ref ref, gsize i)
+{
+    gsize first = g_array_index(lines->starts, gsize, ref.line);
+    gsize last = polyline_end(lines, ref.line) - 1;
+    i = MIN(i, last - first);
+    return polyline_point(lines, ref.reversed ? last - i : first + i);
+}
+
+static struct stroke_ref order_at(const struct stroke_ref *order, guint k)
+{
+    return order ? order[k] : (struct stroke_ref){k, FALSE};
+}
+
+static double point_dist(const double *a, const double *b)
+{
+    return hypot(a[0] - b[0], a[1] - b[1]);
+}
+
+/**
+ * Pen-up distance, in straight lines, to draw the polylines in order. A NULL
+ * order is the order they were given in.
+ */
+double polyline_travel(const struct polylines *lines, const struct stroke_ref *order)
+{
+    double travel = 0;
+    const double *first, *last = NULL;
+    for(guint k = 0; k < lines->starts->len; k++) {
+        const double *prev = last;
+        stroke_ref_ends(lines, order_at(order, k), &first, &last);
+        if(prev) travel += point_dist(prev, first);
+    }
+    return travel;
+}
+
+/**
+ * An order to draw the polylines in that cuts down the pen-up travel. The
+ * first polyline stays first, as given, since the machine starts there.
+ * Nearest neighbour picks each next polyline, from whichever end is closer,
+ * then 2-opt reverses stretches of the order (and each polyline in them)
+ * while that shortens it. Reversing a stretch only changes the two hops at
+ * its ends, so each try costs four distances.
+ */
+void order_polylines(const struct polylines *lines, struct stroke_ref *order)
+{
+    const guint n = lines->starts->len;
+    if(!n) return;
+
+    // Nearest neighbour, taking each pick out of left by swapping the last in
+    guint *left = g_new(guint, n);
+    for(guint i = 0; i < n; i++) left[i] = i;
+    guint nleft = n - 1;
+    left[0] = left[nleft];
+    order[0] = (struct stroke_ref){0, FALSE};
+    for(guint k = 1; k < n; k++, nleft--) {
+        const double *at, *first, *last;
+        stroke_ref_ends(lines, order[k - 1], &first, &at);
+        double best = INFINITY;
+        guint pick = 0;
+        for(guint i = 0; i < nleft; i++) {
+            stroke_ref_ends(lines, (struct stroke_ref){left[i], FALSE}, &first, &last);
+            double d = point_dist(at, first), d_rev = point_dist(at, last);
+            if(d < best) {
+                best = d;
+                pick = i;
+                order[k] = (struct stroke_ref){left[i], FALSE};
+            }
+            if(d_rev < best) {
+                best = d_rev;
+                pick = i;
+                order[k] = (struct stroke_ref){left[i], TRUE};
+            }
+        }
+        left[pick] = left[nleft - 1];
+    }
+    g_free(left);
+    if(n > COMPILE_2OPT_MAX) return;
+
+    // 2-opt on copies of each slot's ends
+    struct { double first[2], last[2]; } *ends = g_malloc(n * sizeof(*ends)), tmp;
+    for(guint k = 0; k < n; k++) {
+        const double *first, *last;
+        stroke_ref_ends(lines, order[k], &first, &last);
+        memcpy(ends[k].first, first, sizeof(ends[k].first));
+        memcpy(ends[k].last, last, sizeof(ends[k].last));
+    }
+    gboolean improved = TRUE;
+    for(int pass = 0; improved && pass < COMPILE_2OPT_PASSES; pass++) {
+        improved = FALSE;
+        for(guint i = 1; i < n; i++) {
+            for(guint j = i; j < n; j++) {
+                // Reversing [i, j] joins i - 1's last to j's last and i's
+                // first to j + 1's first
+                double before = point_dist(ends[i - 1].last, ends[i].first);
+                double after = point_dist(ends[i - 1].last, ends[j].last);
+                if(j + 1 < n) {
+                    before += point_dist(ends[j].last, ends[j + 1].first);
+                    after += point_dist(ends[i].first, ends[j + 1].first);
+                }
+                if(after >= before - 1e-9) continue;
+                for(guint a = i, b = j; a < b; a++, b--) {
+                    struct stroke_ref ref = order[a];
+                    order[a] = order[b];
+                    order[b] = ref;
+                    tmp = ends[a];
+                    ends[a] = ends[b];
+                    ends[b] = tmp;
+                }
+                for(guint a = i; a <= j; a++) {
+                    order[a].reversed = !order[a].reversed;
+                    tmp = ends[a];
+                    memcpy(ends[a].first, tmp.last, sizeof(tmp.last));
+                    memcpy(ends[a].last, tmp.first, sizeof(tmp.first));
+                }
+                improved = TRUE;
+            }
+        }
+    }
+    g_free(ends);
+}
+
+/**
+ * Replaces data's steps with a program for the wires robot that draws the
+ * polylines in order (NULL for as given), using data's spool and step
+ * distance. The start lengths are set to the first point. Each polyline is
+ * drawn from a pen down to a pen up with gen_line_lattice, and the pen goes
+ * between them by the shortest way in steps.
+ * Returns how many steps there are.
+ */
+gsize compile_polylines(struct draw_data *data, const struct polylines *lines,
+                        const struct stroke_ref *order)
+{
+    const guint8 pen_down = POS_NUM << PEN_SHIFT, pen_up = NEG_NUM << PEN_SHIFT;
+    struct step_buf *steps = &data->steps;
+    gint64 lcount = 0, rcount = 0, lto, rto;
+
+    step_buf_clear(steps);
+    data->steps_version++;
+    for(guint k = 0; k < lines->starts->len; k++) {
+        struct stroke_ref ref = order_at(order, k);
+        gsize npoints = polyline_end(lines, ref.line) - g_array_index(lines->starts, gsize, ref.line);
+        const double *prev = NULL;
+        for(gsize j = 0; j < npoints; j++) {
+            const double *p = stroke_point(lines, ref, j);
+            if(!prev) {
+                if(k == 0) {
+                    double llen, rlen;
+                    to_lengths(&llen, &rlen, data->spool_dist, p[0], p[1]);
+                    data->start_llen = llen;
+                    data->start_rlen = rlen;
+                }
+                else {
+                    step_buf_append(steps, pen_up);
+                    counts_at(data, p[0], p[1], &lto, &rto);
+                    step_towards(steps, &lcount, &rcount, lto, rto);
+                }
+                step_buf_append(steps, pen_down);
+                prev = p;
+                continue;
+            }
+            gen_line_lattice(steps, data, &lcount, &rcount, prev[0], prev[1], p[0], p[1]);
+            prev = p;
+        }
+    }
+    if(lines->starts->len) step_buf_append(steps, pen_up);
+    step_buf_flush(steps);
+    return steps->nsteps;
+}
+
+static double segment_dist(const double *a, const double *b, double x, double y)
+{
+    double dx = b[0] - a[0], dy = b[1] - a[1], dd = dx*dx + dy*dy;
+    double t = dd > 0 ? CLAMP(((x - a[0]) * dx + (y - a[1]) * dy) / dd, 0, 1) : 0;
+    return hypot(a[0] + t * dx - x, a[1] + t * dy - y);
+}
+
+/**
+ * The furthest any pose is from the polyline its stroke draws, once
+ * recalc_draw_data has simulated compile_polylines' program. Poses are
+ * measured against the segment being drawn, which moves on whenever the
+ * next one is at least as close.
+ */
+double polyline_deviation(const struct draw_data *data, const struct polylines *lines,
+                          const struct stroke_ref *order)
+{
+    const float *xs = data->pos_data, *ys = data->pos_data + data->nposes;
+    const guint n = MIN(lines->starts->len, data->strokes->len);
+    double worst = 0;
+
+    for(guint k = 0; k < n; k++) {
+        struct stroke_ref ref = order_at(order, k);
+        gsize nseg = polyline_end(lines, ref.line) -
+                     g_array_index(lines->starts, gsize, ref.line) - 1;
+        gsize seg = 0;
+        for(gsize j = g_array_index(data->strokes, gsize, k); j < stroke_end(data, k); j++) {
+            double d = segment_dist(stroke_point(lines, ref, seg),
+                                    stroke_point(lines, ref, seg + 1), xs[j], ys[j]);
+            while(seg + 1 < nseg) {
+                double next = segment_dist(stroke_point(lines, ref, seg + 1),
+                                           stroke_point(lines, ref, seg + 2), xs[j], ys[j]);
+                if(next > d) break;
+                d = next;
+                seg++;
+            }
+            worst = MAX(worst, d);
+        }
+    }
+    return worst;
+}
+
+/**
+ * Reordering should shorten the pen-up travel the simulator sees without
+ * changing what's drawn.
+ */
+void compile_test()
+{
+    // A row of dashes given in a bad order, every other one backwards
+    GString *text = g_string_new("# dashes\n");
+    const int order_in[] = {0, 5, 2, 7, 1, 4, 6, 3};
+    for(int i = 0; i < G_N_ELEMENTS(order_in); i++) {
+        double x = 100 + 20 * order_in[i];
+        if(i % 2) g_string_append_printf(text, "%f 150\n%f 150\n\n", x + 10, x);
+        else g_string_append_printf(text, "%f 150\n%f 150\n\n", x, x + 10);
+    }
+    struct polylines lines = {0};
+    g_assert(G_N_ELEMENTS(order_in) == read_polylines(text->str, text->len, &lines));
+    const guint n = lines.starts->len;
+    struct stroke_ref *order = g_new(struct stroke_ref, n);
+    order_polylines(&lines, order);
+    // Left to right is the best there is
+    g_assert(fabs(polyline_travel(&lines, order) - 10 * (n - 1)) < 1e-9);
+    g_assert(polyline_travel(&lines, NULL) > polyline_travel(&lines, order));
+
+    struct sim_stats before, after;
+    struct draw_data data;
+    draw_data_defaults(&data);
+    data.type = wires;
+    data.step_dist = GEN_LEN_STEP;
+    data.nthreads = 1;
+    for(int i = 0; i < 2; i++) {
+        compile_polylines(&data, &lines, i ? order : NULL);
+        recalc_draw_data(&data);
+        sim_stats(&data, i ? &after : &before);
+        g_assert(data.strokes->len == n && data.snaps->len == 0);
+        g_assert(!(i ? after : before).final.pen_down);
+        // Every pose is on a dash and every stroke starts at the end of one
+        g_assert(polyline_deviation(&data, &lines, i ? order : NULL) < 1.5 * data.step_dist);
+        const float *xs = data.pos_data;
+        for(guint k = 0; k < n; k++) {
+            gsize j = g_array_index(data.strokes, gsize, k);
+            g_assert(fabsf(remainderf(xs[j] - 100, 10)) < 0.1);
+        }
+    }
+    g_assert(fabs(before.pen_down_length - after.pen_down_length) < 1);
+    g_assert(fabs(after.pen_up_length - polyline_travel(&lines, order)) < 1);
+    g_assert(fabs(before.pen_up_length - polyline_travel(&lines, NULL)) < 1);
+    free_polylines(&lines);
+
+    // SVG paths, relative and closed ones too
+    const char svg[] = "<svg>\n<path d=\"M 10 10 L 20 10 20 20 Z\"/>\n"
+                       "<path id='a' d='m5,5 h10v10 m 1 1 l 1 1'/>\n</svg>\n";
+    g_assert(3 == read_polylines(svg, strlen(svg), &lines));
+    g_assert(lines.xy->len == 2 * (4 + 3 + 2));
+    const double *p = polyline_point(&lines, 3);
+    g_assert(p[0] == 10 && p[1] == 10);
+    p = polyline_point(&lines, 6);
+    g_assert(p[0] == 15 && p[1] == 15);
+    p = polyline_point(&lines, 8);
+    g_assert(p[0] == 17 && p[1] == 17);
+    free_polylines(&lines);
+
+    // Curves aren't supported, nor are lines that aren't two numbers
+    const char curve[] = "M 0 0\nC 1 1 2 2 3 3\n";
+    g_assert(-2 == read_polylines(curve, strlen(curve), &lines));
+    free_polylines(&lines);
+    const char bad[] = "1 2\n3\n\n4 5 6\n7 8\n";
+    g_assert(-4 == read_polylines(bad, strlen(bad), &lines));
+    g_assert(lines.starts->len == 2);
+    free_polylines(&lines);
+
+    g_free(order);
+    g_string_free(text, TRUE);
+    free_draw_data(&data);
+}
+
+/**
+ * Stepping the lattice should take as few steps as following the lengths
+ * continuously would and keep every pose within the rounding of the line.
+ */
+static double lattice_bound(const double *a, const double *b, double spool_dist, double step)
+{
+    const int samples = 10000;
+    double bound = 0, llen0, rlen0;
+    to_lengths(&llen0, &rlen0, spool_dist, a[0], a[1]);
+    for(int i = 1; i <= samples; i++) {
+        double t = i / (double)samples, llen, rlen;
+        to_lengths(&llen, &rlen, spool_dist, a[0] + t * (b[0] - a[0]), a[1] + t * (b[1] - a[1]));
+        bound += MAX(fabs(llen - llen0), fabs(rlen - rlen0)) / step;
+        llen0 = llen;
+        rlen0 = rlen;
+    }
+    return bound;
+}
+
+void gen_lattice_test()
+{
+    // lines.py's test_square, and a line that gets closer to both spools
+    // and then further away
+    const char text[] = "100 100\n100 200\n200 200\n200 100\n100 100\n200 200\n\n"
+                        "50 300\n300 50\n";
+    struct polylines lines = {0};
+    g_assert(2 == read_polylines(text, strlen(text), &lines));
+    struct draw_data data;
+    draw_data_defaults(&data);
+    data.type = wires;
+    data.step_dist = GEN_LEN_STEP;
+    data.nthreads = 1;
+    compile_polylines(&data, &lines, NULL);
+    recalc_draw_data(&data);
+    g_assert(data.strokes->len == 2);
+
+    // Each stroke is a pose for the pen going down and then one per step.
+    // The fewest steps is at least the largest change in length of the two
+    // cables, summed along the line, and the rounding at the ends of each
+    // line can add one more.
+    for(guint k = 0; k < 2; k++) {
+        struct stroke_ref ref = {k, FALSE};
+        gsize start = g_array_index(lines.starts, gsize, k);
+        gsize npoints = polyline_end(&lines, k) - start;
+        double bound = 0;
+        for(gsize i = 1; i < npoints; i++)
+            bound += lattice_bound(stroke_point(&lines, ref, i - 1), stroke_point(&lines, ref, i),
+                                   data.spool_dist, data.step_dist);
+        gsize steps = stroke_end(&data, k) - g_array_index(data.strokes, gsize, k) - 1;
+        g_test_message("stroke %u: %lu steps, at least %.1f", k, (unsigned long)steps, bound);
+        g_assert(steps >= floor(bound) && steps <= bound + npoints);
+    }
+    // Half a step on each cable keeps the pen this close to the line here
+    double dev = polyline_deviation(&data, &lines, NULL);
+    g_test_message("max deviation %f mm", dev);
+    g_assert(dev < 1.5 * data.step_dist);
+
+    // Only the pen commands don't move a motor
+    const guint8 *p = data.steps.data, *end = p + data.steps.len;
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        g_assert((op & (LEF_MASK | RIG_MASK)) || (op & PEN_MASK));
+    }
+    free_polylines(&lines);
+    free_draw_data(&data);
+}
+
+/**
+ * Kinematics is spread over threads by cutting the step buffer into chunks at
+ * run boundaries. Every step only moves a motor by +-1 and the pen state is
+ * whatever the last pen command said, so each chunk can be summarised on its
+ * own (pass 1), the summaries combined with an exclusive scan to give the
+ * state each chunk starts in, and then every chunk filled in independently
+ * (pass 2). The result is identical to doing it all on one thread.
+ */
+#define KIN_CHUNK_BYTES (256 * 1024)
+#define POSE_CHUNK (256 * 1024)
+#define POSE_SLICE (1024 * 1024)
+#define LEN_SLICE (16 * KIN_CHUNK_BYTES)
+struct kin_chunk {
+    struct draw_data *data;
+    const guint8 *start, *end;
+    // Pass 1: what this chunk does, whatever state it starts in
+    gint64 lsteps, rsteps;
+    gsize nsteps, nruns;
+    gsize npose;     // poses after the chunk's first pen command
+    gsize npose_pre; // poses before it, only if the pen started down
+    int pen;         // last pen command, POS_NUM, NEG_NUM or NOP_NUM
+    // Pass 2: the state this chunk starts in, from the scan
+    struct checkpoint in;
+    gsize run;
+    // and where it writes, only swapped into data once pass 2 is done
+    float *lens;
+    gsize nposes;
+    struct checkpoint *checkpoints;
+};
+
+// One run_chunks call's chunks that were handed to the pool
+struct chunk_batch {
+    GThreadFunc func;
+    GMutex lock;
+    GCond done;
+    guint left; // still running
+};
+struct chunk_job {
+    struct chunk_batch *batch;
+    gpointer chunk;
+};
+
+static void chunk_job(gpointer jobp, gpointer unused)
+{
+    struct chunk_job *job = jobp;
+    struct chunk_batch *batch = job->batch;
+    batch->func(job->chunk);
+    g_mutex_lock(&batch->lock);
+    if(--batch->left == 0) g_cond_signal(&batch->done);
+    g_mutex_unlock(&batch->lock);
+}
+
+/**
+ * The threads every run_chunks shares, one per processor, started the first
+ * time they're needed and kept for good.
+ */
+static GThreadPool *chunk_pool(void)
+{
+    static GThreadPool *pool;
+    if(g_once_init_enter(&pool)) {
+        GThreadPool *p = g_thread_pool_new(chunk_job, NULL, g_get_num_processors(),
+                                           TRUE, NULL);
+        g_once_init_leave(&pool, p);
+    }
+    return pool;
+}
+
+/**
+ * Runs func on each of n chunks of size bytes, the calling thread taking the
+ * first and the pool the rest, and waits for them all. The pool's threads
+ * are reused, so the slices of a recalc don't each start their own. Chunks
+ * beyond the number of processors just wait their turn.
+ */
+void run_chunks(GThreadFunc func, gpointer chunks, gsize size, guint n)
+{
+    if(n == 1) {
+        func(chunks);
+        return;
+    }
+    struct chunk_batch batch = {.func = func, .left = n - 1};
+    struct chunk_job *jobs = g_new(struct chunk_job, n);
+    GThreadPool *pool = chunk_pool();
+    g_mutex_init(&batch.lock);
+    g_cond_init(&batch.done);
+    for(guint i = 1; i < n; i++) {
+        jobs[i] = (struct chunk_job){&batch, (char*)chunks + i * size};
+        g_thread_pool_push(pool, &jobs[i], NULL);
+    }
+    func(chunks);
+    g_mutex_lock(&batch.lock);
+    while(batch.left) g_cond_wait(&batch.done, &batch.lock);
+    g_mutex_unlock(&batch.lock);
+    g_mutex_clear(&batch.lock);
+    g_cond_clear(&batch.done);
+    g_free(jobs);
+}
+
+/**
+ * How many threads to spread work over, at least per_thread of it each.
+ */
+guint kin_threads(const struct draw_data *data, gsize work, gsize per_thread)
+{
+    guint n = data->nthreads ? data->nthreads : g_get_num_processors();
+    return CLAMP(work / per_thread, 1, n);
+}
+
+gpointer summarise_chunk(gpointer chunkp)
+{
+    struct kin_chunk *c = chunkp;
+    gboolean pen_known = FALSE, pen_down = FALSE;
+    const guint8 *p = c->start;
+    while(p < c->end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, c->end, &op, &count);
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: pen_known = pen_down = TRUE; c->pen = POS_NUM; break;
+            case NEG_NUM: pen_known = TRUE; pen_down = FALSE; c->pen = NEG_NUM; break;
+        }
+        c->lsteps += step_delta[(op & LEF_MASK) >> LEF_SHIFT] * (gint64)count;
+        c->rsteps += step_delta[(op & RIG_MASK) >> RIG_SHIFT] * (gint64)count;
+        if(!pen_known) c->npose_pre += count;
+        else if(pen_down) c->npose += count;
+        c->nsteps += count;
+        c->nruns++;
+    }
+    return NULL;
+}
+
+/**
+ * Integrates a chunk's steps into cable lengths from the state it starts
+ * in, recording (llen, rlen) for every step where the pen is down and
+ * dropping checkpoints as it goes. Works a run at a time on integer step
+ * counts, so pen-up travel costs one multiply per run and lengths don't pick
+ * up rounding error however long the program is.
+ */
+gpointer integrate_chunk(gpointer chunkp)
+{
+    struct kin_chunk *c = chunkp;
+    struct draw_data *data = c->data;
+    struct checkpoint state = c->in;
+    const double start_llen = data->start_llen;
+    const double start_rlen = data->start_rlen;
+    const double step_dist = data->step_dist;
+    float *llens = c->lens;
+    float *rlens = c->lens + c->nposes;
+    gsize run = c->run;
+
+    const guint8 *p = c->start;
+    for(; p < c->end; run++) {
+        if(run % CHECKPOINT_INTERVAL == 0) {
+            state.offset = p - data->steps.data;
+            c->checkpoints[run / CHECKPOINT_INTERVAL] = state;
+        }
+        guint8 op;
+        guint64 count;
+        p = step_run(p, c->end, &op, &count);
+        int dl = step_delta[(op & LEF_MASK) >> LEF_SHIFT];
+        int dr = step_delta[(op & RIG_MASK) >> RIG_SHIFT];
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: state.pen_down = TRUE; break;
+            case NEG_NUM: state.pen_down = FALSE; break;
+        }
+        state.step += count;
+
+        // Was there actually a movement worth recording?
+        // not if the pen wasn't down there wasn't!
+        if(!state.pen_down) {
+            state.lcount += dl * (gint64)count;
+            state.rcount += dr * (gint64)count;
+            continue;
+        }
+        for(guint64 j = 0; j < count; j++) {
+            state.lcount += dl;
+            state.rcount += dr;
+            llens[state.npose + j] = start_llen + state.lcount * step_dist;
+            rlens[state.npose + j] = start_rlen + state.rcount * step_dist;
+        }
+        state.npose += count;
+    }
+    // The last chunk also drops the checkpoint for the very end
+    if(c->end == data->steps.data + data->steps.len && run % CHECKPOINT_INTERVAL == 0) {
+        state.offset = p - data->steps.data;
+        c->checkpoints[run / CHECKPOINT_INTERVAL] = state;
+    }
+    return NULL;
+}
+
+/**
+ * Notes the first pose of every stroke, the stretches of poses drawn without
+ * lifting the pen. Costs one pass over the runs.
+ */
+void find_strokes(struct draw_data *data)
+{
+    gboolean pen_down = FALSE, in_stroke = FALSE;
+    gsize pose = 0;
+
+    if(!data->strokes) data->strokes = g_array_new(FALSE, FALSE, sizeof(gsize));
+    g_array_set_size(data->strokes, 0);
+
+    const guint8 *p = data->steps.data, *end = p + data->steps.len;
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: pen_down = TRUE; break;
+            case NEG_NUM: pen_down = FALSE; break;
+        }
+        if(!pen_down) {
+            in_stroke = FALSE;
+            continue;
+        }
+        if(!in_stroke) g_array_append_val(data->strokes, pose);
+        in_stroke = TRUE;
+        pose += count;
+    }
+}
+
+/**
+ * One past the last pose of stroke i.
+ */
+gsize stroke_end(const struct draw_data *data, guint i)
+{
+    if(i + 1 < data->strokes->len)
+        return g_array_index(data->strokes, gsize, i + 1);
+    return data->nposes;
+}
+
+/**
+ * Index of the stroke that pose belongs to.
+ */
+guint stroke_at(const struct draw_data *data, gsize pose)
+{
+    guint lo = 0, hi = data->strokes->len;
+    while(hi - lo > 1) {
+        guint mid = (lo + hi) / 2;
+        if(g_array_index(data->strokes, gsize, mid) <= pose) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Integrates the steps into cable lengths for every pen-down step and sets up
+ * the checkpoints, in parallel for anything big enough to be worth it. Both
+ * passes go LEN_SLICE bytes of steps at a time so that lens_progress() hears
+ * how far they've got and cancel is noticed in between. Nothing in data
+ * changes until both are done, and then the poses, strokes, snaps and levels
+ * of detail are all cleared for recalc_poses to fill in again.
+ * Returns FALSE if it was cancelled, leaving data as it was.
+ */
+gboolean recalc_lengths(struct draw_data *data)
+{
+    const guint8 *begin = data->steps.data;
+    const guint8 *end = begin + data->steps.len;
+    const double work = 2.0 * MAX(data->steps.len, 1);
+    GArray *chunks = g_array_new(FALSE, TRUE, sizeof(struct kin_chunk));
+    GArray *slices = g_array_new(FALSE, FALSE, sizeof(guint)); // first chunk of each
+    gboolean cancelled = FALSE;
+
+    // At least one chunk, even for no steps, so the last checkpoint is set
+    const guint8 *slice = begin;
+    do {
+        if((cancelled = g_atomic_int_get(&data->cancel))) break;
+        const guint8 *slice_end = end - slice > LEN_SLICE ? slice + LEN_SLICE : end;
+        while(slice_end < end && (*slice_end & RUN_FLAG))
+            slice_end++;
+        const gsize len = slice_end - slice;
+        const guint n = kin_threads(data, len, KIN_CHUNK_BYTES);
+        guint first = chunks->len;
+        g_array_set_size(chunks, first + n);
+        g_array_append_val(slices, first);
+        struct kin_chunk *c = &g_array_index(chunks, struct kin_chunk, first);
+
+        // Cut at the first run that starts at or after each even split
+        for(guint i = 0; i < n; i++) {
+            c[i].data = data;
+            c[i].start = i ? c[i - 1].end : slice;
+            c[i].end = i == n - 1 ? slice_end : slice + len * (i + 1) / n;
+            while(c[i].end < slice_end && (*c[i].end & RUN_FLAG))
+                c[i].end++;
+        }
+        run_chunks(summarise_chunk, c, sizeof(*c), n);
+        slice = slice_end;
+        if(data->lens_progress)
+            data->lens_progress(data, (slice - begin) / work, data->progress_data);
+    } while(slice < end);
+    if(cancelled) {
+        g_array_free(chunks, TRUE);
+        g_array_free(slices, TRUE);
+        return FALSE;
+    }
+    guint nchunks = chunks->len;
+    g_array_append_val(slices, nchunks);
+
+    // Exclusive scan for the state at the start of each chunk
+    struct checkpoint state = {0};
+    gsize run = 0;
+    for(guint i = 0; i < nchunks; i++) {
+        struct kin_chunk *c = &g_array_index(chunks, struct kin_chunk, i);
+        c->in = state;
+        c->run = run;
+        state.step += c->nsteps;
+        state.lcount += c->lsteps;
+        state.rcount += c->rsteps;
+        state.npose += c->npose + (state.pen_down ? c->npose_pre : 0);
+        if(c->pen != NOP_NUM) state.pen_down = c->pen == POS_NUM;
+        run += c->nruns;
+    }
+
+    // Integrate into new arrays so a cancel leaves the old ones consistent
+    const gsize nposes = state.npose;
+    const gsize ncheckpoints = run / CHECKPOINT_INTERVAL + 1;
+    float *lens = g_malloc(2 * nposes * sizeof(float));
+    struct checkpoint *checkpoints = g_malloc(ncheckpoints * sizeof(struct checkpoint));
+    for(guint i = 0; i < nchunks; i++) {
+        struct kin_chunk *c = &g_array_index(chunks, struct kin_chunk, i);
+        c->lens = lens;
+        c->nposes = nposes;
+        c->checkpoints = checkpoints;
+    }
+
+    for(guint i = 0; i + 1 < slices->len; i++) {
+        if((cancelled = g_atomic_int_get(&data->cancel))) break;
+        guint first = g_array_index(slices, guint, i);
+        guint n = g_array_index(slices, guint, i + 1) - first;
+        struct kin_chunk *c = &g_array_index(chunks, struct kin_chunk, first);
+        run_chunks(integrate_chunk, c, sizeof(*c), n);
+        if(data->lens_progress)
+            data->lens_progress(data, (data->steps.len + (c[n - 1].end - begin)) / work,
+                                data->progress_data);
+    }
+    g_array_free(chunks, TRUE);
+    g_array_free(slices, TRUE);
+    if(cancelled) {
+        g_free(lens);
+        g_free(checkpoints);
+        return FALSE;
+    }
+
+    // Both are nposes long, and the poses were for the old lengths
+    const gssize pose_bytes = 2 * data->nposes * sizeof(float);
+    trace_count(counter_pose_bytes, -(data->len_data ? pose_bytes : 0) -
+                                    (data->pos_data ? pose_bytes : 0));
+    g_free(data->len_data);
+    g_free(data->pos_data);
+    g_free(data->checkpoints);
+    data->pos_data = NULL;
+    data->nposes = nposes;
+    data->len_data = lens;
+    trace_count(counter_pose_bytes, 2 * nposes * sizeof(float));
+    data->ncheckpoints = ncheckpoints;
+    data->checkpoints = checkpoints;
+    if(data->snaps) g_array_set_size(data->snaps, 0);
+    free_lod(data);
+    find_strokes(data);
+    return TRUE;
+}
+
+/**
+ * Replays from the nearest checkpoint at or before k to k, or with part
+ * FALSE only to the start of the run that k falls in.
+ */
+struct checkpoint replay_to(const struct draw_data *data, gsize k, gboolean part)
+{
+    k = MIN(k, data->steps.nsteps);
+
+    // Last checkpoint at or before k
+    gsize lo = 0, hi = data->ncheckpoints;
+    while(hi - lo > 1) {
+        gsize mid = (lo + hi) / 2;
+        if(data->checkpoints[mid].step <= k) lo = mid;
+        else hi = mid;
+    }
+    struct checkpoint state = data->checkpoints[lo];
+
+    const guint8 *p = data->steps.data + state.offset;
+    const guint8 *end = data->steps.data + data->steps.len;
+    while(state.step < k) {
+        guint8 op;
+        guint64 count;
+        const guint8 *next = step_run(p, end, &op, &count);
+        // Only part of the last run if k lands in the middle of it
+        guint64 take = MIN(count, k - state.step);
+        if(take < count && !part) break;
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: state.pen_down = TRUE; break;
+            case NEG_NUM: state.pen_down = FALSE; break;
+        }
+        state.lcount += step_delta[(op & LEF_MASK) >> LEF_SHIFT] * (gint64)take;
+        state.rcount += step_delta[(op & RIG_MASK) >> RIG_SHIFT] * (gint64)take;
+        if(state.pen_down) state.npose += take;
+        state.step += take;
+        if(take < count) break;
+        p = next;
+    }
+    state.offset = p - data->steps.data;
+    return state;
+}
+
+/**
+ * Machine state after the first k steps. Starts at the nearest checkpoint at
+ * or before k and replays the rest a run at a time, so this is cheap for
+ * any k. Only valid once recalc_lengths has run on the current steps.
+ */
+struct checkpoint state_at(const struct draw_data *data, gsize k)
+{
+    return replay_to(data, k, TRUE);
+}
+
+/**
+ * Test helper, one packed triplet per step with the runs expanded.
+ */
+guint8 *expand_steps(const struct step_buf *steps)
+{
+    guint8 *ops = g_malloc(steps->nsteps + 1);
+    const guint8 *p = steps->data, *end = steps->data + steps->len;
+    gsize n = 0;
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        memset(&ops[n], op, count);
+        n += count;
+    }
+    g_assert(n == steps->nsteps);
+    return ops;
+}
+
+/**
+ * Fills data with a program of n steps, a mix of long runs and singles.
+ */
+void make_test_steps(struct draw_data *data, gsize n)
+{
+    // Every motor nets to zero over a cycle so the lengths don't wander off
+    char *ops[] = {"+.+", "-+.", "..-", ".-.", "++.", "--+", "+++", "--."};
+    step_buf_clear(&data->steps);
+    for(gsize i = 0; i < n; i++) {
+        // Runs of up to 300 steps every so often
+        int which = (i / 300) % 3 ? (i * 7 + i / 5) % 8 : 6 + (i / 300) % 2;
+        step_buf_append(&data->steps, pack(ops[which]));
+    }
+    step_buf_flush(&data->steps);
+    data->steps_version++;
+}
+
+void state_at_test()
+{
+    struct draw_data data = {.step_dist = 0.1, .start_llen = 240, .start_rlen = 240};
+    make_test_steps(&data, 3 * CHECKPOINT_INTERVAL + 7);
+    recalc_lengths(&data);
+    guint8 *ops = expand_steps(&data.steps);
+
+    // Compare against replaying every step from the start
+    gsize ks[] = {0, 1, 299, 300, 301, CHECKPOINT_INTERVAL, CHECKPOINT_INTERVAL + 3,
+                  2 * CHECKPOINT_INTERVAL - 1, data.steps.nsteps};
+    for(int j = 0; j < G_N_ELEMENTS(ks); j++) {
+        struct checkpoint replay = {0};
+        char lrp[3];
+        for(gsize i = 0; i < ks[j]; i++) {
+            unpack(lrp, ops[i]);
+            if(lrp[LEFT] != NOP_CHAR) replay.lcount += lrp[LEFT] == POS_CHAR ? 1 : -1;
+            if(lrp[RIGHT] != NOP_CHAR) replay.rcount += lrp[RIGHT] == POS_CHAR ? 1 : -1;
+            if(lrp[PEN] != NOP_CHAR) replay.pen_down = lrp[PEN] == POS_CHAR;
+            if(replay.pen_down) replay.npose++;
+        }
+        struct checkpoint cp = state_at(&data, ks[j]);
+        g_assert(cp.step == ks[j]);
+        g_assert(cp.lcount == replay.lcount);
+        g_assert(cp.rcount == replay.rcount);
+        g_assert(cp.npose == replay.npose);
+        g_assert(cp.pen_down == replay.pen_down);
+    }
+    g_assert(state_at(&data, data.steps.nsteps).npose == data.nposes);
+
+    g_free(ops);
+    step_buf_free(&data.steps);
+    g_free(data.len_data);
+    g_free(data.checkpoints);
+}
+
+/**
+ * The run-length integration should match stepping one triplet at a time
+ * (as recalc_draw_data used to) done in doubles, give or take the final
+ * rounding to float. The old float loop's drift is reported.
+ */
+void run_length_test()
+{
+    struct draw_data data = {.step_dist = 0.1, .start_llen = 240, .start_rlen = 260};
+    make_test_steps(&data, 200000);
+    recalc_lengths(&data);
+    guint8 *ops = expand_steps(&data.steps);
+
+    gboolean pen_down = FALSE;
+    float llen = data.start_llen, rlen = data.start_rlen;
+    double dllen = data.start_llen, drlen = data.start_rlen;
+    float drift = 0;
+    gsize nposes = 0;
+    for(gsize i = 0; i < data.steps.nsteps; i++) {
+        int dl = step_delta[(ops[i] & LEF_MASK) >> LEF_SHIFT];
+        int dr = step_delta[(ops[i] & RIG_MASK) >> RIG_SHIFT];
+        llen += dl * data.step_dist;
+        rlen += dr * data.step_dist;
+        dllen += dl * (double)data.step_dist;
+        drlen += dr * (double)data.step_dist;
+        switch((ops[i] & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: pen_down = TRUE; break;
+            case NEG_NUM: pen_down = FALSE; break;
+        }
+        if(!pen_down) continue;
+        g_assert(nposes < data.nposes);
+        // i.e. only rounded once, to the nearest float
+        float new_llen = data.len_data[nposes];
+        float new_rlen = data.len_data[data.nposes + nposes];
+        g_assert(fabs(new_llen - dllen) <= dllen * FLT_EPSILON);
+        g_assert(fabs(new_rlen - drlen) <= drlen * FLT_EPSILON);
+        drift = MAX(drift, fabs(new_llen - llen));
+        drift = MAX(drift, fabs(new_rlen - rlen));
+        nposes++;
+    }
+    g_assert(nposes == data.nposes);
+    // Not asserted, it's the reason this was changed. Usually > step_dist.
+    g_test_message("per-step float loop drifted %f mm over %lu steps",
+                   drift, (unsigned long)data.steps.nsteps);
+
+    g_free(ops);
+    step_buf_free(&data.steps);
+    g_free(data.len_data);
+    g_free(data.checkpoints);
+}
+
+struct pose_chunk {
+    struct draw_data *data;
+    coords_kernel kernel;
+    guint8 *snapped; // for the slice starting at pose base
+    gsize base, start, end;
+    gsize nsnapped;
+};
+
+gpointer pose_chunk(gpointer chunkp)
+{
+    struct pose_chunk *c = chunkp;
+    const gsize n = c->data->nposes;
+    const float *lens = c->data->len_data;
+    float *pos = c->data->pos_data;
+    gint64 t = trace_begin();
+    c->nsnapped = c->kernel(pos + c->start, pos + n + c->start,
+                            c->snapped + c->start - c->base,
+                            lens + c->start, lens + n + c->start,
+                            c->end - c->start, c->data->spool_dist);
+    trace_end(span_to_coords, t);
+    return NULL;
+}
+
+/**
+ * Works out the coordinates of every pose, in slices of POSE_SLICE so that
+ * progress() sees them finished in order and cancel is noticed in between.
+ * Returns FALSE if it was cancelled, leaving the rest of pos_data unset.
+ */
+gboolean recalc_poses(struct draw_data *data)
+{
+    const gsize n = data->nposes;
+    const coords_kernel kernel = coords_kernel_for(data->type);
+    guint8 *snapped = g_malloc(POSE_SLICE);
+    float *xs, *ys;
+
+    // Already the right size unless the lengths changed
+    if(!data->pos_data) {
+        data->pos_data = g_malloc(2 * n * sizeof(float));
+        trace_count(counter_pose_bytes, 2 * n * sizeof(float));
+    }
+    xs = data->pos_data;
+    ys = data->pos_data + n;
+    if(!data->snaps) data->snaps = g_array_new(FALSE, FALSE, sizeof(struct pose_range));
+    g_array_set_size(data->snaps, 0);
+
+    for(gsize base = 0; base < n; base += POSE_SLICE) {
+        if(g_atomic_int_get(&data->cancel)) {
+            g_free(snapped);
+            return FALSE;
+        }
+        const gsize slice = MIN(n - base, POSE_SLICE);
+        guint nthreads = kin_threads(data, slice, POSE_CHUNK);
+        struct pose_chunk *chunks = g_new0(struct pose_chunk, nthreads);
+
+        // Keep chunk edges on 4 pose boundaries so the vector loop covers the
+        // same poses it would on one thread
+        for(guint i = 0; i < nthreads; i++) {
+            chunks[i].data = data;
+            chunks[i].kernel = kernel;
+            chunks[i].snapped = snapped;
+            chunks[i].base = base;
+            chunks[i].start = i ? chunks[i - 1].end : base;
+            chunks[i].end = i == nthreads - 1 ? base + slice :
+                            base + ((slice * (i + 1) / nthreads) & ~(gsize)3);
+        }
+        run_chunks(pose_chunk, chunks, sizeof(*chunks), nthreads);
+
+        gsize nsnapped = 0;
+        for(guint i = 0; i < nthreads; i++)
+            nsnapped += chunks[i].nsnapped;
+        g_free(chunks);
+
+        // Leave the pen where it was before the string snapped and note each
+        // stretch where it was snapped, joining on to one left open by the
+        // last slice
+        for(gsize i = 0; nsnapped && i < slice; i++) {
+            if(!snapped[i]) continue;
+            struct pose_range range = {base + i, base + i};
+            struct pose_range *last = data->snaps->len ?
+                &g_array_index(data->snaps, struct pose_range, data->snaps->len - 1) : NULL;
+            for(; range.end < base + slice && snapped[range.end - base]; range.end++) {
+                xs[range.end] = range.end ? xs[range.end - 1] : 0;
+                ys[range.end] = range.end ? ys[range.end - 1] : 0;
+            }
+            if(last && last->end == range.start) last->end = range.end;
+            else g_array_append_val(data->snaps, range);
+            i = range.end - base;
+        }
+        if(data->progress) data->progress(data, base + slice, data->progress_data);
+    }
+    g_free(snapped);
+    return TRUE;
+}
+
+/**
+ * Thins the poses out into LOD_LEVELS coarser copies, each built from the
+ * one before so the whole lot costs about two passes over the poses.
+ * Stops early once a level is down to the ends of the strokes.
+ */
+void build_lod(struct draw_data *data)
+{
+    const gsize n = data->nposes;
+    const float *xs = data->pos_data, *ys = data->pos_data + n;
+    const gsize *src = NULL; // every pose
+    const guint8 *src_breaks = NULL;
+    gsize nsrc = n;
+    float cell = LOD_CELL;
+
+    free_lod(data);
+
+    // Everything the grids have to cover. NaNs, which snapped poses can be,
+    // are outside every grid and never count as drawn over
+    float minx = FLT_MAX, miny = FLT_MAX, maxx = -FLT_MAX, maxy = -FLT_MAX;
+    for(gsize j = 0; j < n; j++) {
+        if(xs[j] < minx) minx = xs[j];
+        if(xs[j] > maxx) maxx = xs[j];
+        if(ys[j] < miny) miny = ys[j];
+        if(ys[j] > maxy) maxy = ys[j];
+    }
+
+    while(data->nlod < LOD_LEVELS && nsrc > 2 * (gsize)data->strokes->len) {
+        struct lod_level *level = &data->lod[data->nlod++];
+        level->cell = cell;
+        level->poses = g_new(gsize, nsrc);
+        level->breaks = g_new(guint8, nsrc);
+        level->n = 0;
+
+        // A bit per square, kept poses mark theirs
+        float gw = minx <= maxx ? floorf((maxx - minx) / cell) + 1 : 0;
+        float gh = miny <= maxy ? floorf((maxy - miny) / cell) + 1 : 0;
+        guint8 *grid = gw * gh <= LOD_GRID_MAX ? g_malloc0((gsize)(gw * gh) / 8 + 1) : NULL;
+
+        guint s = 0;
+        gsize first = 0, end = 0;
+        float lastx = 0, lasty = 0;
+        gboolean gap = FALSE; // poses left out since the last kept as drawn already
+        for(gsize k = 0; k < nsrc; k++) {
+            gsize j = src ? src[k] : k;
+            if(src_breaks && src_breaks[k]) gap = TRUE;
+            // Every level keeps the first pose of every stroke, so this
+            // lands on the stroke j starts
+            if(j >= end) {
+                first = g_array_index(data->strokes, gsize, s);
+                end = stroke_end(data, s);
+                s++;
+                gap = FALSE;
+            }
+            const gboolean ends = j == first || j == end - 1;
+            if(!ends && fabsf(xs[j] - lastx) < cell && fabsf(ys[j] - lasty) < cell)
+                continue;
+
+            const float gx = (xs[j] - minx) / cell, gy = (ys[j] - miny) / cell;
+            gsize sq = G_MAXSIZE;
+            if(grid && gx >= 0 && gx < gw && gy >= 0 && gy < gh)
+                sq = (gsize)gy * (gsize)gw + (gsize)gx;
+            if(sq != G_MAXSIZE && (grid[sq / 8] & (1 << sq % 8))) {
+                if(!ends) {
+                    gap = TRUE;
+                    continue;
+                }
+            }
+            else if(sq != G_MAXSIZE) {
+                grid[sq / 8] |= 1 << sq % 8;
+            }
+            level->poses[level->n] = j;
+            level->breaks[level->n++] = gap;
+            gap = FALSE;
+            lastx = xs[j];
+            lasty = ys[j];
+        }
+        g_free(grid);
+        level->poses = g_renew(gsize, level->poses, MAX(level->n, 1));
+        level->breaks = g_renew(guint8, level->breaks, MAX(level->n, 1));
+        src = level->poses;
+        src_breaks = level->breaks;
+        nsrc = level->n;
+        cell *= 2;
+    }
+}
+
+void free_lod(struct draw_data *data)
+{
+    for(guint i = 0; i < data->nlod; i++) {
+        g_free(data->lod[i].poses);
+        g_free(data->lod[i].breaks);
+    }
+    data->nlod = 0;
+}
+
+/**
+ * The coarsest level that still looks the same when drawn scale pixels to
+ * the mm, i.e. no pose moves by half a pixel or more. NULL means draw every
+ * pose.
+ */
+const struct lod_level *lod_for_scale(const struct draw_data *data, float scale)
+{
+    const struct lod_level *best = NULL;
+    for(guint i = 0; i < data->nlod; i++)
+        if(data->lod[i].cell * scale <= 0.5) best = &data->lod[i];
+    return best;
+}
+
+/**
+ * Index into level of the first kept pose at or after pose.
+ */
+gsize lod_find(const struct lod_level *level, gsize pose)
+{
+    gsize lo = 0, hi = level->n;
+    while(lo < hi) {
+        gsize mid = (lo + hi) / 2;
+        if(level->poses[mid] < pose) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void lod_test()
+{
+    struct draw_data data;
+    draw_data_defaults(&data);
+    data.step_dist = 0.01;
+    make_test_steps(&data, 300000);
+    recalc_draw_data(&data);
+    const float *xs = data.pos_data, *ys = data.pos_data + data.nposes;
+    g_assert(data.nlod > 1);
+    float minx = FLT_MAX, miny = FLT_MAX, maxx = -FLT_MAX, maxy = -FLT_MAX;
+    for(gsize j = 0; j < data.nposes; j++) {
+        minx = MIN(minx, xs[j]);
+        maxx = MAX(maxx, xs[j]);
+        miny = MIN(miny, ys[j]);
+        maxy = MAX(maxy, ys[j]);
+    }
+
+    gsize prev_n = data.nposes;
+    for(guint i = 0; i < data.nlod; i++) {
+        const struct lod_level *level = &data.lod[i];
+        g_assert(level->n <= prev_n);
+        prev_n = level->n;
+
+        // Which squares of the level's grid have a pose it kept
+        const gsize gw = (maxx - minx) / level->cell + 1, gh = (maxy - miny) / level->cell + 1;
+        guint8 *kept_in = g_malloc0(gw * gh);
+        for(gsize k = 0; k < level->n; k++) {
+            gsize j = level->poses[k];
+            kept_in[(gsize)((ys[j] - miny) / level->cell) * gw +
+                    (gsize)((xs[j] - minx) / level->cell)] = 1;
+        }
+
+        // Every stroke keeps its ends and every pose dropped is within the
+        // sum of the cells so far (< 2 cells) of the last one kept, or if
+        // the line breaks after it, of some pose kept
+        gsize k = 0, nbreaks = 0;
+        for(guint s = 0; s < data.strokes->len; s++) {
+            gsize first = g_array_index(data.strokes, gsize, s);
+            gsize end = stroke_end(&data, s);
+            g_assert(k < level->n && level->poses[k] == first && !level->breaks[k]);
+            for(gsize j = first; j < end; j++) {
+                if(k + 1 < level->n && level->poses[k + 1] == j) {
+                    k++;
+                    nbreaks += level->breaks[k];
+                }
+                gsize kept = level->poses[k];
+                if(kept == j || !level->breaks[k + 1]) {
+                    g_assert(fabsf(xs[j] - xs[kept]) < 2 * level->cell + 1e-3);
+                    g_assert(fabsf(ys[j] - ys[kept]) < 2 * level->cell + 1e-3);
+                    continue;
+                }
+                const gssize gx = (xs[j] - minx) / level->cell, gy = (ys[j] - miny) / level->cell;
+                gboolean near = FALSE;
+                for(gssize y = MAX(gy - 2, 0); y <= MIN(gy + 2, (gssize)gh - 1); y++)
+                    for(gssize x = MAX(gx - 2, 0); x <= MIN(gx + 2, (gssize)gw - 1); x++)
+                        near |= kept_in[y * gw + x];
+                g_assert(near);
+            }
+            g_assert(level->poses[k] == end - 1);
+            k++;
+        }
+        g_assert(k == level->n);
+        g_free(kept_in);
+        if(i == 0) g_assert(nbreaks > 0);
+        g_assert(lod_find(level, 0) == 0);
+        g_assert(lod_find(level, level->poses[level->n - 1] + 1) == level->n);
+    }
+    g_test_message("%lu poses, coarsest level of %u has %lu",
+                   (unsigned long)data.nposes, data.nlod,
+                   (unsigned long)data.lod[data.nlod - 1].n);
+
+    g_assert(lod_for_scale(&data, 1000) == NULL);
+    g_assert(lod_for_scale(&data, 0.5 / LOD_CELL) == &data.lod[0]);
+
+    // Going round the same square again only adds poses in squares of the
+    // grid that no kept pose has landed in yet, so the levels stop growing
+    // after a few laps however many more there are
+    char *sides[] = {"+..", ".+.", "-..", ".-."};
+    int laps[] = {1, 8, 64};
+    gsize n[G_N_ELEMENTS(laps)][LOD_LEVELS];
+    guint nlod[G_N_ELEMENTS(laps)];
+    for(int t = 0; t < G_N_ELEMENTS(laps); t++) {
+        step_buf_clear(&data.steps);
+        step_buf_append(&data.steps, pack("..+"));
+        for(int lap = 0; lap < laps[t]; lap++)
+            for(int side = 0; side < 4; side++)
+                for(int i = 0; i < 500; i++)
+                    step_buf_append(&data.steps, pack(sides[side]));
+        step_buf_flush(&data.steps);
+        data.steps_version++;
+        recalc_draw_data(&data);
+        nlod[t] = data.nlod;
+        for(guint i = 0; i < data.nlod; i++) n[t][i] = data.lod[i].n;
+    }
+    g_assert(nlod[0] > 1 && nlod[1] >= nlod[0]);
+    for(guint i = 0; i < nlod[0]; i++) g_assert(n[1][i] < 2 * n[0][i]);
+    // Only the last pose is new
+    g_assert(nlod[2] == nlod[1]);
+    for(guint i = 0; i < nlod[1]; i++) g_assert(n[2][i] <= n[1][i] + 1);
+    free_draw_data(&data);
+}
+
+/**
+ * The settings the results depend on, as they are now.
+ */
+struct kin_key draw_data_key(const struct draw_data *data)
+{
+    return (struct kin_key){
+        .steps_version = data->steps_version,
+        .step_dist = data->step_dist,
+        .start_llen = data->start_llen,
+        .start_rlen = data->start_rlen,
+        .spool_dist = data->spool_dist,
+        .type = data->type,
+    };
+}
+
+static gboolean lens_current(const struct draw_data *data, const struct kin_key *key)
+{
+    return data->lens_valid &&
+           key->steps_version == data->lens_key.steps_version &&
+           key->step_dist == data->lens_key.step_dist &&
+           key->start_llen == data->lens_key.start_llen &&
+           key->start_rlen == data->lens_key.start_rlen;
+}
+
+static gboolean poses_current(const struct draw_data *data, const struct kin_key *key)
+{
+    return data->poses_valid &&
+           key->spool_dist == data->poses_key.spool_dist &&
+           key->type == data->poses_key.type;
+}
+
+/**
+ * TRUE if recalc_draw_data has nothing to do.
+ */
+gboolean draw_data_current(const struct draw_data *data)
+{
+    struct kin_key key = draw_data_key(data);
+    return lens_current(data, &key) && poses_current(data, &key);
+}
+
+/**
+ * Brings pos_data up to date, only redoing the work whose inputs changed
+ * since last time. An expose with nothing changed costs nothing here.
+ * Returns TRUE if pos_data changed. If cancel is set part way the lengths or
+ * poses are left invalid.
+ */
+gboolean recalc_draw_data(struct draw_data *data)
+{
+    struct kin_key key = draw_data_key(data);
+    gint64 whole = trace_begin();
+    gboolean changed = FALSE;
+
+    if(!lens_current(data, &key)) {
+        changed = TRUE;
+        data->lens_valid = data->poses_valid = FALSE;
+        gint64 t = trace_begin();
+        gboolean done = recalc_lengths(data);
+        trace_end(span_lengths, t);
+        if(done) {
+            data->lens_key = key;
+            data->lens_valid = TRUE;
+        }
+    }
+
+    if(data->lens_valid && !poses_current(data, &key)) {
+        changed = TRUE;
+        data->poses_valid = FALSE;
+        gint64 t = trace_begin();
+        gboolean done = !g_atomic_int_get(&data->cancel) && recalc_poses(data);
+        trace_end(span_poses, t);
+        if(done) {
+            t = trace_begin();
+            build_lod(data);
+            trace_end(span_lod, t);
+            data->poses_key = key;
+            data->poses_valid = TRUE;
+        }
+    }
+    trace_end(span_recalc, whole);
+    return changed;
+}
+
+/**
+ * Swaps everything loaded and worked out between a and b, but not the
+ * parameters or playback position, so a second draw_data can be filled in
+ * the background and then shown in one go.
+ */
+void draw_data_swap_results(struct draw_data *a, struct draw_data *b)
+{
+    struct draw_data t = *a;
+#define SWAP_FIELD(f) a->f = b->f; b->f = t.f
+    SWAP_FIELD(steps);
+    SWAP_FIELD(steps_version);
+    SWAP_FIELD(checkpoints);
+    SWAP_FIELD(ncheckpoints);
+    SWAP_FIELD(len_data);
+    SWAP_FIELD(pos_data);
+    SWAP_FIELD(nposes);
+    SWAP_FIELD(lens_valid);
+    SWAP_FIELD(poses_valid);
+    SWAP_FIELD(lens_key);
+    SWAP_FIELD(poses_key);
+    SWAP_FIELD(snaps);
+    SWAP_FIELD(strokes);
+    SWAP_FIELD(nlod);
+    SWAP_FIELD(bad_line);
+    SWAP_FIELD(load_seconds);
+    SWAP_FIELD(load_bytes);
+#undef SWAP_FIELD
+    for(int i = 0; i < LOD_LEVELS; i++) {
+        a->lod[i] = b->lod[i];
+        b->lod[i] = t.lod[i];
+    }
+}
+
+struct progress_test {
+    gsize calls, last;
+    gsize cancel_after;
+};
+
+static void progress_test_cb(struct draw_data *data, gsize done, gpointer user)
+{
+    struct progress_test *t = user;
+    g_assert(done > t->last && done <= data->nposes);
+    // Everything reported done is final
+    g_assert(done == data->nposes || done % POSE_SLICE == 0);
+    t->last = done;
+    if(++t->calls == t->cancel_after) g_atomic_int_set(&data->cancel, 1);
+}
+
+static void lens_progress_test_cb(struct draw_data *data, double fraction, gpointer user)
+{
+    struct progress_test *t = user;
+    g_assert(fraction > 0 && fraction <= 1);
+    if(++t->calls == t->cancel_after) g_atomic_int_set(&data->cancel, 1);
+}
+
+/**
+ * Poses arrive in order and a cancelled recalc picks up where it should.
+ */
+void progress_test()
+{
+    struct draw_data data, whole;
+    draw_data_defaults(&data);
+    data.step_dist = 0.01;
+    make_test_steps(&data, 5 * POSE_SLICE);
+    struct progress_test t = {.cancel_after = 2};
+    data.progress = progress_test_cb;
+    data.progress_data = &t;
+    g_assert(recalc_draw_data(&data));
+    g_assert(!data.poses_valid && !draw_data_current(&data));
+    g_assert(t.calls == 2 && t.last == 2 * POSE_SLICE);
+
+    g_atomic_int_set(&data.cancel, 0);
+    t = (struct progress_test){0};
+    g_assert(recalc_draw_data(&data));
+    g_assert(draw_data_current(&data));
+    g_assert(t.last == data.nposes);
+
+    draw_data_defaults(&whole);
+    whole.step_dist = 0.01;
+    make_test_steps(&whole, 5 * POSE_SLICE);
+    whole.nthreads = 1;
+    recalc_draw_data(&whole);
+    g_assert(whole.nposes == data.nposes);
+    g_assert(0 == memcmp(whole.pos_data, data.pos_data, 2 * data.nposes * sizeof(float)));
+
+    // The lengths stop part way too, in either pass, and start again. With
+    // three slices the first call is in pass 1 and the fourth in pass 2.
+    struct draw_data lens, one;
+    draw_data_defaults(&lens);
+    lens.step_dist = 0.01;
+    make_test_steps(&lens, 12 * POSE_SLICE);
+    g_assert(lens.steps.len > 2 * LEN_SLICE && lens.steps.len <= 3 * LEN_SLICE);
+    lens.lens_progress = lens_progress_test_cb;
+    lens.progress_data = &t;
+    for(gsize cancel_after = 1; cancel_after <= 4; cancel_after += 3) {
+        t = (struct progress_test){.cancel_after = cancel_after};
+        recalc_draw_data(&lens);
+        g_assert(!lens.lens_valid && !lens.poses_valid && t.calls == cancel_after);
+        g_atomic_int_set(&lens.cancel, 0);
+    }
+
+    // Cancelled in pass 2 once there are poses, whatever draws them or
+    // replays the steps still sees the last lengths that finished
+    t = (struct progress_test){0};
+    g_assert(recalc_draw_data(&lens) && draw_data_current(&lens));
+    const float *len_data = lens.len_data, *pos_data = lens.pos_data;
+    const gsize nposes = lens.nposes, nlod = lens.nlod;
+    lens.step_dist = 0.02;
+    t = (struct progress_test){.cancel_after = 4};
+    recalc_draw_data(&lens);
+    g_assert(!lens.lens_valid && t.calls == 4);
+    g_atomic_int_set(&lens.cancel, 0);
+    g_assert(lens.len_data == len_data && lens.pos_data == pos_data);
+    g_assert(lens.nposes == nposes && lens.nlod == nlod);
+    g_assert(state_at(&lens, lens.steps.nsteps).npose == lens.nposes);
+    g_assert(stroke_at(&lens, lens.nposes - 1) == lens.strokes->len - 1);
+    for(guint i = 0; i < lens.nlod; i++)
+        g_assert(!lens.lod[i].n || lens.lod[i].poses[lens.lod[i].n - 1] < lens.nposes);
+    for(guint i = 0; i < lens.snaps->len; i++)
+        g_assert(g_array_index(lens.snaps, struct pose_range, i).end <= lens.nposes);
+
+    // Once it does finish, none of the old poses are left behind
+    lens.step_dist = 0.01;
+    t = (struct progress_test){0};
+    g_assert(recalc_lengths(&lens) && t.calls == 6);
+    g_assert(!lens.pos_data && lens.nlod == 0 && lens.snaps->len == 0);
+    draw_data_defaults(&one);
+    one.step_dist = 0.01;
+    make_test_steps(&one, 12 * POSE_SLICE);
+    one.nthreads = 1;
+    g_assert(recalc_lengths(&one));
+    g_assert(lens.nposes == one.nposes && lens.ncheckpoints == one.ncheckpoints);
+    g_assert(0 == memcmp(one.len_data, lens.len_data, 2 * lens.nposes * sizeof(float)));
+    for(gsize i = 0; i < one.ncheckpoints; i++) {
+        struct checkpoint *a = &one.checkpoints[i], *b = &lens.checkpoints[i];
+        g_assert(a->step == b->step && a->offset == b->offset);
+        g_assert(a->lcount == b->lcount && a->rcount == b->rcount);
+        g_assert(a->npose == b->npose && a->pen_down == b->pen_down);
+    }
+    free_draw_data(&one);
+    free_draw_data(&lens);
+
+    // Swapping hands over the results but not the settings
+    whole.spool_dist = 500;
+    draw_data_swap_results(&data, &whole);
+    g_assert(data.spool_dist == 400 && whole.spool_dist == 500);
+    g_assert(draw_data_current(&data) && !draw_data_current(&whole));
+    g_assert(data.lod[0].poses && whole.lod[0].poses);
+    free_draw_data(&data);
+    free_draw_data(&whole);
+}
+
+/**
+ * Where the machine ends up, the extent of the drawing and how much line
+ * was drawn. recalc_draw_data must be up to date.
+ */
+void sim_stats(const struct draw_data *data, struct sim_stats *stats)
+{
+    const gsize n = data->nposes;
+    const float *xs = data->pos_data, *ys = data->pos_data + n;
+
+    stats->final = state_at(data, data->steps.nsteps);
+    stats->final_llen = data->start_llen + stats->final.lcount * (double)data->step_dist;
+    stats->final_rlen = data->start_rlen + stats->final.rcount * (double)data->step_dist;
+    guint8 snapped;
+    to_coords_batch(&stats->final_x, &stats->final_y, &snapped,
+                    &stats->final_llen, &stats->final_rlen, 1,
+                    data->spool_dist, data->type);
+
+    stats->min_x = stats->min_y = INFINITY;
+    stats->max_x = stats->max_y = -INFINITY;
+    for(gsize i = 0; i < n; i++) {
+        stats->min_x = MIN(stats->min_x, xs[i]);
+        stats->max_x = MAX(stats->max_x, xs[i]);
+        stats->min_y = MIN(stats->min_y, ys[i]);
+        stats->max_y = MAX(stats->max_y, ys[i]);
+    }
+
+    // Poses are only joined up within a stroke, the pen is up between
+    stats->pen_down_length = stats->pen_up_length = 0;
+    for(guint i = 0; i < data->strokes->len; i++) {
+        gsize start = g_array_index(data->strokes, gsize, i);
+        gsize end = stroke_end(data, i);
+        if(i) stats->pen_up_length += hypot(xs[start] - xs[start - 1], ys[start] - ys[start - 1]);
+        for(gsize j = start + 1; j < end; j++)
+            stats->pen_down_length += hypot(xs[j] - xs[j - 1], ys[j] - ys[j - 1]);
+    }
+}
+
+void sim_stats_test()
+{
+    // Two strokes with a lift in the middle
+    struct draw_data data = {.spool_dist = 400, .step_dist = 1,
+                             .start_llen = 300, .start_rlen = 300, .nthreads = 1};
+    const char text[] = "..+\n++.\n+..\n..-\n--.\n..+\n-+.\n";
+    g_assert(7 == read_steps(text, strlen(text), &data.steps, NULL));
+    recalc_draw_data(&data);
+    g_assert(data.nposes == 5);
+
+    struct sim_stats stats;
+    sim_stats(&data, &stats);
+    g_assert(stats.final.step == 7);
+    g_assert(stats.final.lcount == 0 && stats.final.rcount == 1);
+    g_assert(stats.final.pen_down);
+    g_assert(stats.final_llen == 300 && stats.final_rlen == 301);
+
+    const float *xs = data.pos_data, *ys = data.pos_data + data.nposes;
+    double expect = hypot(xs[1] - xs[0], ys[1] - ys[0]) +
+                    hypot(xs[2] - xs[1], ys[2] - ys[1]) +
+                    hypot(xs[4] - xs[3], ys[4] - ys[3]);
+    g_assert(fabs(stats.pen_down_length - expect) < 1e-9);
+    g_assert(fabs(stats.pen_up_length - hypot(xs[3] - xs[2], ys[3] - ys[2])) < 1e-9);
+    g_assert(data.strokes->len == 2);
+    g_assert(g_array_index(data.strokes, gsize, 1) == 3);
+    g_assert(stats.min_x <= xs[0] && xs[0] <= stats.max_x);
+    free_draw_data(&data);
+}
+
+/************** OPTIMISING ****************/
+/**
+ * Where optimise_steps has got to. While the pen is up with OPT_TRAVEL the
+ * steps aren't written at all, only where they get to. Otherwise the last
+ * step is held back in case the next can be merged into it.
+ */
+struct optimiser {
+    guint flags;
+    struct step_buf *out;
+    gboolean pen_down;
+    gboolean travelling;
+    gboolean lift; // the pen has to go up at the start of the travel
+    gint64 tl, tr; // where the travel has to get to
+    gboolean held;
+    int hl, hr;
+};
+
+static int op_dl(guint8 op)
+{
+    return step_delta[(op & LEF_MASK) >> LEF_SHIFT];
+}
+
+static int op_dr(guint8 op)
+{
+    return step_delta[(op & RIG_MASK) >> RIG_SHIFT];
+}
+
+static void release_held(struct optimiser *o)
+{
+    if(o->held) step_buf_append(o->out, delta_num(o->hl) << LEF_SHIFT |
+                                        delta_num(o->hr) << RIG_SHIFT);
+    o->held = FALSE;
+}
+
+/**
+ * Writes the travel as diagonal steps then steps on one motor, lifting the
+ * pen on the first and, if down, putting it down on the last. Each needs a
+ * step of its own even if there's nowhere to go.
+ */
+static void write_travel(struct optimiser *o, gboolean down)
+{
+    const gint64 diag = MIN(ABS(o->tl), ABS(o->tr));
+    const gint64 moves = MAX(ABS(o->tl), ABS(o->tr));
+    const int dl = (o->tl > 0) - (o->tl < 0), dr = (o->tr > 0) - (o->tr < 0);
+    const guint8 both = delta_num(dl) << LEF_SHIFT | delta_num(dr) << RIG_SHIFT;
+    const guint8 one = ABS(o->tl) > ABS(o->tr) ? delta_num(dl) << LEF_SHIFT :
+                                                 delta_num(dr) << RIG_SHIFT;
+    const gint64 n = MAX(moves, o->lift + down);
+    for(gint64 i = 0; i < n; i++) {
+        guint8 op = i < diag ? both : i < moves ? one : 0;
+        if(i == 0 && o->lift) op |= NEG_NUM << PEN_SHIFT;
+        else if(i == n - 1 && down) op |= POS_NUM << PEN_SHIFT;
+        step_buf_append(o->out, op);
+    }
+    o->travelling = o->lift = FALSE;
+    o->tl = o->tr = 0;
+}
+
+/**
+ * A step that puts the pen down or lifts it, which nothing is merged across.
+ */
+static void optimise_pen_change(struct optimiser *o, guint8 op)
+{
+    const gboolean down = (op & PEN_MASK) >> PEN_SHIFT == POS_NUM;
+    release_held(o);
+    o->pen_down = down;
+    if(!(o->flags & OPT_TRAVEL)) {
+        step_buf_append(o->out, op);
+        return;
+    }
+    // Its move is travel too, the first pose is only where it ends up
+    o->tl += op_dl(op);
+    o->tr += op_dr(op);
+    if(down) write_travel(o, TRUE);
+    else o->travelling = o->lift = TRUE;
+}
+
+/**
+ * count steps of op, none of which change the pen.
+ */
+static void optimise_run(struct optimiser *o, guint8 op, guint64 count)
+{
+    if(o->flags & OPT_PEN) op &= ~PEN_MASK;
+    const int dl = op_dl(op), dr = op_dr(op);
+    if(o->travelling) {
+        o->tl += dl * (gint64)count;
+        o->tr += dr * (gint64)count;
+        return;
+    }
+    if(!op && (o->flags & OPT_NOOPS)) return;
+    if((op & PEN_MASK) || !(o->flags & OPT_MERGE)) {
+        release_held(o);
+        for(guint64 i = 0; i < count; i++) step_buf_append(o->out, op);
+        return;
+    }
+    // Merging only gets anywhere for the first few, after that each step
+    // just pushes the one before out
+    for(; count && !(o->held && o->hl == dl && o->hr == dr); count--) {
+        int l = o->hl + dl, r = o->hr + dr;
+        if(o->held && ABS(l) <= 1 && ABS(r) <= 1) {
+            o->hl = l;
+            o->hr = r;
+            // A step and its undo, neither is needed
+            if(!l && !r) o->held = FALSE;
+            continue;
+        }
+        release_held(o);
+        o->held = TRUE;
+        o->hl = dl;
+        o->hr = dr;
+    }
+    for(guint64 i = 0; i < count; i++) step_buf_append(o->out, op);
+}
+
+/**
+ * Rewrites in into out with the passes in flags (see OPT_PEN and on).
+ * Returns how many steps out has.
+ */
+gsize optimise_steps(struct step_buf *out, const struct step_buf *in, guint flags)
+{
+    // Until the first pen command the pen is as good as up
+    struct optimiser o = {.flags = flags, .out = out, .travelling = flags & OPT_TRAVEL};
+    const guint8 *p = in->data, *end = in->data + in->len;
+    step_buf_clear(out);
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        const guint8 pen = (op & PEN_MASK) >> PEN_SHIFT;
+        if((pen == POS_NUM && !o.pen_down) || (pen == NEG_NUM && o.pen_down)) {
+            optimise_pen_change(&o, op);
+            count--;
+        }
+        if(count) optimise_run(&o, op, count);
+    }
+    release_held(&o);
+    if(o.travelling) write_travel(&o, FALSE);
+    step_buf_flush(out);
+    return out->nsteps;
+}
+
+/**
+ * A pose as whole steps of both lengths, packed so keys sort and nearby
+ * poses are a fixed offset away.
+ */
+static guint64 pose_key(const struct draw_data *data, gsize i)
+{
+    gint64 l = llround(data->len_data[i] / data->step_dist);
+    gint64 r = llround(data->len_data[data->nposes + i] / data->step_dist);
+    return (guint64)(l + G_MAXINT32) << 32 | (guint32)(r + G_MAXINT32);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorted keys of poses [from, to)
+static void stroke_keys(const struct draw_data *data, gsize from, gsize to, guint64 *keys)
+{
+    for(gsize i = from; i < to; i++) keys[i - from] = pose_key(data, i);
+    qsort(keys, to - from, sizeof(*keys), compare_keys);
+}
+
+// Whether some key within skip steps of key is in keys, sorted
+static gboolean near_key(const guint64 *keys, gsize n, guint64 key, int skip)
+{
+    for(gint64 dl = -skip; dl <= skip; dl++)
+        for(gint64 dr = -skip; dr <= skip; dr++) {
+            guint64 k = key + ((guint64)dl << 32) + (guint64)dr;
+            if(bsearch(&k, keys, n, sizeof(*keys), compare_keys)) return TRUE;
+        }
+    return FALSE;
+}
+
+/**
+ * Whether b draws what a does, going by recalc_draw_data's poses for both.
+ * With skip 0 each stroke has to visit the same poses in the same order,
+ * less repeats. Otherwise each pose of a stroke of b has to be one of the
+ * poses of that stroke of a, and each of a's within skip steps (on either
+ * motor) of one of b's. Both have to end up in the same place too.
+ */
+gboolean same_drawing(const struct draw_data *a, const struct draw_data *b, int skip)
+{
+    struct checkpoint afinal = state_at(a, a->steps.nsteps);
+    struct checkpoint bfinal = state_at(b, b->steps.nsteps);
+    if(afinal.lcount != bfinal.lcount || afinal.rcount != bfinal.rcount ||
+       a->strokes->len != b->strokes->len)
+        return FALSE;
+
+    guint64 *akeys = NULL, *bkeys = NULL;
+    if(skip) {
+        akeys = g_new(guint64, MAX(a->nposes, 1));
+        bkeys = g_new(guint64, MAX(b->nposes, 1));
+    }
+    gboolean same = TRUE;
+    for(guint s = 0; same && s < a->strokes->len; s++) {
+        gsize i = g_array_index(a->strokes, gsize, s), aend = stroke_end(a, s);
+        gsize j = g_array_index(b->strokes, gsize, s), bend = stroke_end(b, s);
+        if(!skip) {
+            while(same && i < aend && j < bend) {
+                guint64 key = pose_key(a, i);
+                same = key == pose_key(b, j);
+                while(i < aend && pose_key(a, i) == key) i++;
+                while(j < bend && pose_key(b, j) == key) j++;
+            }
+            same = same && i == aend && j == bend;
+            continue;
+        }
+        const gsize na = aend - i, nb = bend - j;
+        stroke_keys(a, i, aend, akeys);
+        stroke_keys(b, j, bend, bkeys);
+        for(gsize k = 0; same && k < nb; k++)
+            same = near_key(akeys, na, bkeys[k], 0);
+        for(gsize k = 0; same && k < na; k++)
+            same = near_key(bkeys, nb, akeys[k], skip);
+    }
+    g_free(akeys);
+    g_free(bkeys);
+    return same;
+}
+
+void optimise_test()
+{
+    struct draw_data data = {.spool_dist = 400, .step_dist = 1,
+                             .start_llen = 300, .start_rlen = 300, .nthreads = 1};
+    struct draw_data opt = data;
+    // Travel out, a stroke with repeated pens, a no-op, a step and its undo
+    // and steps on one motor then the other, wandering travel, a second
+    // stroke, then travel off the end
+    const char program[] = "+..\n-..\n.+.\n"
+                           "..+\n+.+\n...\n.++\n+..\n-..\n-..\n.+.\n"
+                           "..-\n+..\n-..\n++-\n+..\n"
+                           "-++\n.-.\n"
+                           "..-\n.+.\n.+.\n";
+    g_assert(21 == read_steps(program, strlen(program), &data.steps, NULL));
+    step_buf_flush(&data.steps);
+    recalc_draw_data(&data);
+
+    // The pen only goes down once per stroke and travel takes the short way
+    g_assert(12 == optimise_steps(&opt.steps, &data.steps, OPT_EXACT));
+    opt.steps_version++;
+    recalc_draw_data(&opt);
+    g_assert(same_drawing(&data, &opt, 0));
+    g_assert(opt.nposes == data.nposes - 1);
+
+    // Merging takes out the undo and makes a diagonal
+    g_assert(8 == optimise_steps(&opt.steps, &data.steps, OPT_ALL));
+    opt.steps_version++;
+    recalc_draw_data(&opt);
+    g_assert(!same_drawing(&data, &opt, 0));
+    g_assert(same_drawing(&data, &opt, 1));
+
+    // Nothing asked for, nothing changes
+    g_assert(21 == optimise_steps(&opt.steps, &data.steps, 0));
+    g_assert(opt.steps.len == data.steps.len);
+    g_assert(0 == memcmp(opt.steps.data, data.steps.data, data.steps.len));
+
+    // A loop round the first pose merges away, though it goes through the
+    // second pose on the way
+    const char loop[] = "+++\n-+.\n.-.\n.+.\n+..\n+-.\n-..\n-..\n";
+    step_buf_clear(&data.steps);
+    g_assert(8 == read_steps(loop, strlen(loop), &data.steps, NULL));
+    step_buf_flush(&data.steps);
+    data.steps_version++;
+    recalc_draw_data(&data);
+    g_assert(2 == optimise_steps(&opt.steps, &data.steps, OPT_ALL));
+    opt.steps_version++;
+    recalc_draw_data(&opt);
+    g_assert(same_drawing(&data, &opt, 1));
+
+    // lines.py's circle puts the pen down on every step, which is all that
+    // goes as it never steps one motor then the other
+    double llen, rlen;
+    step_buf_clear(&data.steps);
+    gen_circle(&data.steps, 200, 200, 100, 400, &llen, &rlen);
+    step_buf_flush(&data.steps);
+    data.step_dist = opt.step_dist = GEN_LEN_STEP;
+    data.start_llen = opt.start_llen = llen;
+    data.start_rlen = opt.start_rlen = rlen;
+    data.steps_version++;
+    recalc_draw_data(&data);
+    for(int i = 0; i < 2; i++) {
+        g_assert(data.steps.nsteps ==
+                 optimise_steps(&opt.steps, &data.steps, i ? OPT_ALL : OPT_EXACT));
+        opt.steps_version++;
+        recalc_draw_data(&opt);
+        g_assert(same_drawing(&data, &opt, 0));
+        gsize pens = 0;
+        const guint8 *p = opt.steps.data, *end = p + opt.steps.len;
+        while(p < end) {
+            guint8 op;
+            guint64 count;
+            p = step_run(p, end, &op, &count);
+            if(op & PEN_MASK) pens += count;
+        }
+        g_assert(pens == 1);
+    }
+
+    // Random steps with plenty of pen changes
+    make_test_steps(&data, 100000);
+    data.step_dist = opt.step_dist = 0.1;
+    recalc_draw_data(&data);
+    for(int i = 0; i < 2; i++) {
+        optimise_steps(&opt.steps, &data.steps, i ? OPT_ALL : OPT_EXACT);
+        opt.steps_version++;
+        recalc_draw_data(&opt);
+        g_assert(same_drawing(&data, &opt, i));
+        g_assert(opt.steps.nsteps < data.steps.nsteps);
+    }
+
+    free_draw_data(&opt);
+    free_draw_data(&data);
+}
+
+/************** STREAMING ****************/
+/**
+ * Works out the coordinates of the batch, carries the pen over snapped
+ * strings as recalc_poses does, and adds it to the stats.
+ */
+static void stream_flush(struct sim_stream *s)
+{
+    const gsize n = s->n;
+    struct sim_stats *st = &s->stats;
+    struct draw_data *data = s->data;
+
+    to_coords_batch(s->x, s->y, s->snapped, s->llen, s->rlen, n,
+                    data->spool_dist, data->type);
+    for(gsize i = 0; i < n; i++) {
+        if(s->snapped[i]) {
+            s->x[i] = s->last_x;
+            s->y[i] = s->last_y;
+            if(!s->snapping) s->snap.start = s->base + i;
+            s->snapping = TRUE;
+        }
+        else if(s->snapping) {
+            s->snapping = FALSE;
+            s->snap.end = s->base + i;
+            if(s->snapped_range) s->snapped_range(&s->snap, s->user);
+        }
+
+        st->min_x = MIN(st->min_x, s->x[i]);
+        st->max_x = MAX(st->max_x, s->x[i]);
+        st->min_y = MIN(st->min_y, s->y[i]);
+        st->max_y = MAX(st->max_y, s->y[i]);
+        if(!s->start[i])
+            st->pen_down_length += hypot(s->x[i] - s->last_x, s->y[i] - s->last_y);
+        else if(s->base + i)
+            st->pen_up_length += hypot(s->x[i] - s->last_x, s->y[i] - s->last_y);
+        s->last_x = s->x[i];
+        s->last_y = s->y[i];
+    }
+    if(s->poses && n) s->poses(s, s->user);
+    s->base += n;
+    s->n = 0;
+}
+
+/**
+ * Integrates runs into the batch, flushing it whenever it fills up. The same
+ * sums as integrate_chunk so the poses come out identical.
+ */
+static void stream_runs(struct sim_stream *s, const guint8 *p, const guint8 *end)
+{
+    const double start_llen = s->data->start_llen;
+    const double start_rlen = s->data->start_rlen;
+    const double step_dist = s->data->step_dist;
+    struct checkpoint *state = &s->state;
+
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        int dl = step_delta[(op & LEF_MASK) >> LEF_SHIFT];
+        int dr = step_delta[(op & RIG_MASK) >> RIG_SHIFT];
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: state->pen_down = TRUE; break;
+            case NEG_NUM: state->pen_down = FALSE; break;
+        }
+        state->step += count;
+
+        if(!state->pen_down) {
+            state->lcount += dl * (gint64)count;
+            state->rcount += dr * (gint64)count;
+            s->in_stroke = FALSE;
+            continue;
+        }
+        for(guint64 j = 0; j < count; j++) {
+            if(s->n == STREAM_POSES) stream_flush(s);
+            state->lcount += dl;
+            state->rcount += dr;
+            s->llen[s->n] = start_llen + state->lcount * step_dist;
+            s->rlen[s->n] = start_rlen + state->rcount * step_dist;
+            s->start[s->n] = !s->in_stroke;
+            s->in_stroke = TRUE;
+            s->n++;
+        }
+        state->npose += count;
+    }
+}
+
+/**
+ * Picks the text header fields off the front of buf like read_data does.
+ * Returns how many bytes they took.
+ */
+static gsize stream_text_header(const guint8 *buf, gsize len, struct draw_data *data)
+{
+    gsize pos = 0;
+    int next = 0;
+    while(pos < len && next < G_N_ELEMENTS(header_fields)) {
+        const guint8 *eol = memchr(buf + pos, '\n', len - pos);
+        gsize line_len = (eol ? eol - buf : len) - pos;
+        char line[128];
+        if(line_len >= sizeof(line)) break;
+        memcpy(line, buf + pos, line_len);
+        line[line_len] = '\0';
+        if(pos == 0 && scan_robot_type(line, &data->type)) {
+            pos += line_len + (eol != NULL);
+            continue;
+        }
+
+        int i;
+        float v;
+        for(i = next; i < G_N_ELEMENTS(header_fields); i++)
+            if(1 == sscanf(line, header_fields[i].format, &v)) break;
+        if(i == G_N_ELEMENTS(header_fields)) break;
+        G_STRUCT_MEMBER(float, data, header_fields[i].offset) = v;
+        next = i + 1;
+        pos += line_len + (eol != NULL);
+    }
+    return pos;
+}
+
+/**
+ * Whether the first have bytes of the stream hold its whole header, binary
+ * or text, so it's known where the steps start.
+ */
+static gboolean stream_header_read(const guint8 *buf, gsize have, struct draw_data *data)
+{
+    if(0 == memcmp(buf, BIN_MAGIC, MIN(have, BIN_MAGIC_LEN)))
+        return have >= BIN_HEADER_SIZE;
+    // The text header ends at the first whole line that isn't a field
+    gsize off = stream_text_header(buf, have, data);
+    return NULL != memchr(buf + off, '\n', have - off);
+}
+
+/**
+ * Simulates the text or binary program read from fd into s, which only
+ * needs data and the callbacks set. Each read takes whatever's there so a
+ * slow producer's steps are simulated as they come. name is for messages.
+ */
+int sim_stream(int fd, const char *name, struct sim_stream *s)
+{
+    struct draw_data *data = s->data;
+    guint8 *buf = g_malloc(STREAM_READ);
+    gsize have = 0, off = 0;
+    gboolean eof = FALSE, binary = FALSE;
+    guint64 bin_steps = 0;
+    int res = 0;
+
+    s->state = (struct checkpoint){0};
+    s->stats.min_x = s->stats.min_y = INFINITY;
+    s->stats.max_x = s->stats.max_y = -INFINITY;
+    s->stats.pen_down_length = s->stats.pen_up_length = 0;
+    s->bad_line = 0;
+    s->lines = s->base = s->n = 0;
+    s->in_stroke = s->snapping = FALSE;
+    s->last_x = s->last_y = 0;
+
+    // Only as much as it takes to be sure of the header, which is tiny
+    while(!eof && have < STREAM_READ && !stream_header_read(buf, have, data)) {
+        gssize got = read(fd, buf + have, STREAM_READ - have);
+        if(got < 0) res = -1;
+        if(got <= 0) eof = TRUE;
+        else have += got;
+    }
+    if(have >= BIN_MAGIC_LEN && 0 == memcmp(buf, BIN_MAGIC, BIN_MAGIC_LEN)) {
+        guint64 nbytes;
+        binary = TRUE;
+        if(have < BIN_HEADER_SIZE) {
+            printf("Truncated header in %s\n", name);
+            res = -1;
+        }
+        else res = parse_binary_header(buf, name, &bin_steps, &nbytes);
+        if(res == 0) set_binary_header(buf, data);
+        off = BIN_HEADER_SIZE;
+    }
+    else off = stream_text_header(buf, have, data);
+
+    while(res == 0) {
+        // Only whole lines or runs, the rest waits for the next read
+        gsize cut = have;
+        if(!eof) {
+            while(cut > off && (binary ? buf[cut - 1] & RUN_FLAG : buf[cut - 1] != '\n'))
+                cut--;
+            // A run's count can go on into the next read
+            if(binary && cut > off) cut--;
+            // Or the buffer is one enormous line
+            if(cut == off && have == STREAM_READ) cut = have;
+        }
+
+        if(binary) {
+            guint64 nsteps;
+            if(!check_binary_steps(buf + off, cut - off, &nsteps)) {
+                printf("Corrupt steps in %s\n", name);
+                res = -1;
+                break;
+            }
+            stream_runs(s, buf + off, buf + cut);
+        }
+        else {
+            step_buf_clear(&data->steps);
+            gsize bad_line;
+            gsize lines = read_steps((const char*)buf + off, cut - off, &data->steps, &bad_line);
+            if(bad_line) s->bad_line = s->lines + bad_line;
+            s->lines += lines;
+            stream_runs(s, data->steps.data, data->steps.data + data->steps.len);
+        }
+        stream_flush(s);
+        if(eof) break;
+
+        memmove(buf, buf + cut, have - cut);
+        have -= cut;
+        off = 0;
+        gssize got = read(fd, buf + have, STREAM_READ - have);
+        if(got < 0) {
+            printf("Failed reading %s\n", name);
+            res = -1;
+        }
+        if(got <= 0) eof = TRUE;
+        else have += got;
+    }
+    g_free(buf);
+    if(res < 0) return res;
+    if(binary && s->state.step != bin_steps) {
+        printf("Corrupt steps in %s\n", name);
+        return -1;
+    }
+
+    if(s->snapping) {
+        s->snapping = FALSE;
+        s->snap.end = s->base;
+        if(s->snapped_range) s->snapped_range(&s->snap, s->user);
+    }
+    struct sim_stats *st = &s->stats;
+    guint8 snapped;
+    st->final = s->state;
+    st->final_llen = data->start_llen + st->final.lcount * (double)data->step_dist;
+    st->final_rlen = data->start_rlen + st->final.rcount * (double)data->step_dist;
+    to_coords_batch(&st->final_x, &st->final_y, &snapped,
+                    &st->final_llen, &st->final_rlen, 1,
+                    data->spool_dist, data->type);
+    return 0;
+}
+
+struct stream_test_out {
+    const struct draw_data *whole;
+    gsize nposes, nbatches, nsnaps;
+};
+
+static void stream_test_poses(const struct sim_stream *s, gpointer user)
+{
+    struct stream_test_out *out = user;
+    const gsize n = out->whole->nposes;
+    const float *xs = out->whole->pos_data, *ys = out->whole->pos_data + n;
+    g_assert(s->base == out->nposes && s->base + s->n <= n);
+    for(gsize i = 0; i < s->n; i++) {
+        g_assert(s->x[i] == xs[s->base + i]);
+        g_assert(s->y[i] == ys[s->base + i]);
+        g_assert(s->start[i] == (s->base + i == g_array_index(out->whole->strokes, gsize,
+                                 stroke_at(out->whole, s->base + i))));
+    }
+    out->nposes += s->n;
+    out->nbatches++;
+}
+
+static void stream_test_snapped(const struct pose_range *range, gpointer user)
+{
+    struct stream_test_out *out = user;
+    g_assert(out->nsnaps < out->whole->snaps->len);
+    struct pose_range *expect = &g_array_index(out->whole->snaps, struct pose_range,
+                                               out->nsnaps);
+    g_assert(range->start == expect->start && range->end == expect->end);
+    out->nsnaps++;
+}
+
+#ifdef G_OS_UNIX
+// The producer only finishes once it's seen poses come out
+static void stream_test_pipe_poses(const struct sim_stream *s, gpointer user)
+{
+    int *fd = user;
+    if(*fd >= 0) close(*fd);
+    *fd = -1;
+}
+#endif
+
+/**
+ * Streaming a file, text or binary, should match loading it whole.
+ */
+void stream_test()
+{
+    gchar *text_name = g_build_filename(g_get_tmp_dir(), "robot_sim_stream.txt", NULL);
+    gchar *bin_name = g_build_filename(g_get_tmp_dir(), "robot_sim_stream.bin", NULL);
+
+    // More than one read's worth, with a bad line, and short enough strings
+    // to snap them now and then
+    struct draw_data gen;
+    draw_data_defaults(&gen);
+    make_test_steps(&gen, STREAM_READ / 4 + 12345);
+    guint8 *ops = expand_steps(&gen.steps);
+    GString *text = g_string_new("Step Distance: 0.01\nStart Length Right: 159.9\n");
+    for(gsize i = 0; i < gen.steps.nsteps; i++) {
+        char lrp[3];
+        unpack(lrp, ops[i]);
+        g_string_append_len(text, lrp, 3);
+        g_string_append_c(text, '\n');
+        if(i == 1000) g_string_append(text, "+-\n");
+    }
+    g_assert(g_file_set_contents(text_name, text->str, text->len, NULL));
+
+    struct draw_data whole;
+    draw_data_defaults(&whole);
+    g_assert(0 == read_data(text_name, &whole));
+    g_assert(0 == write_binary(bin_name, &whole));
+    recalc_draw_data(&whole);
+    g_assert(whole.snaps->len > 0);
+    struct sim_stats stats;
+    sim_stats(&whole, &stats);
+
+    for(int i = 0; i < 2; i++) {
+        struct draw_data data;
+        draw_data_defaults(&data);
+        struct sim_stream *s = g_new0(struct sim_stream, 1);
+        struct stream_test_out out = {.whole = &whole};
+        s->data = &data;
+        s->poses = stream_test_poses;
+        s->snapped_range = stream_test_snapped;
+        s->user = &out;
+
+        int fd = g_open(i ? bin_name : text_name, O_RDONLY, 0);
+        g_assert(fd >= 0);
+        g_assert(0 == sim_stream(fd, "test", s));
+        close(fd);
+
+        g_assert(data.step_dist == 0.01f && data.start_rlen == 159.9f);
+        g_assert(s->bad_line == (i ? 0 : whole.bad_line));
+        g_assert(out.nposes == whole.nposes);
+        g_assert(out.nsnaps == whole.snaps->len);
+        g_assert(out.nbatches > 1);
+        g_assert(s->stats.final.step == stats.final.step);
+        g_assert(s->stats.final.lcount == stats.final.lcount);
+        g_assert(s->stats.final.rcount == stats.final.rcount);
+        g_assert(s->stats.final.npose == stats.final.npose);
+        g_assert(s->stats.final_x == stats.final_x && s->stats.final_y == stats.final_y);
+        g_assert(s->stats.min_x == stats.min_x && s->stats.max_x == stats.max_x);
+        g_assert(s->stats.min_y == stats.min_y && s->stats.max_y == stats.max_y);
+        g_assert(s->stats.pen_down_length == stats.pen_down_length);
+        g_assert(s->stats.pen_up_length == stats.pen_up_length);
+        g_free(s);
+        free_draw_data(&data);
+    }
+
+#ifdef G_OS_UNIX
+    // From a pipe the first steps are simulated as soon as the header and
+    // they are there, not held back for a fuller read
+    int fds[2];
+    g_assert(0 == pipe(fds));
+    const char *start = "Step Distance: 0.01\n+-+\n++.\n-+.\n";
+    g_assert(write(fds[1], start, strlen(start)) == (gssize)strlen(start));
+    struct draw_data data;
+    draw_data_defaults(&data);
+    struct sim_stream *s = g_new0(struct sim_stream, 1);
+    s->data = &data;
+    s->poses = stream_test_pipe_poses;
+    s->user = &fds[1];
+    g_assert(0 == sim_stream(fds[0], "test", s));
+    close(fds[0]);
+    g_assert(fds[1] == -1 && data.step_dist == 0.01f);
+    g_assert(s->base == 3 && s->stats.final.step == 3);
+    g_free(s);
+    free_draw_data(&data);
+#endif
+
+    g_remove(text_name);
+    g_remove(bin_name);
+    g_free(text_name);
+    g_free(bin_name);
+    g_free(ops);
+    g_string_free(text, TRUE);
+    free_draw_data(&gen);
+    free_draw_data(&whole);
+}
+
+/**
+ * What we assume about the machine when the file doesn't say.
+ */
+void draw_data_defaults(struct draw_data *data)
+{
+    const float spool_dist = 400.0;
+    *data = (struct draw_data){.type = wires,
+                               .paper_offset_y = 20.0, 
+                               .spool_dist = spool_dist, 
+                               .step_dist = 1.0,
+                               .start_llen = spool_dist * 0.6,
+                               .start_rlen = spool_dist * 0.6};
+}
+
+void free_draw_data(struct draw_data *data)
+{
+    const gssize pose_bytes = 2 * data->nposes * sizeof(float);
+    trace_count(counter_pose_bytes, -(data->len_data ? pose_bytes : 0) -
+                                    (data->pos_data ? pose_bytes : 0));
+    step_buf_free(&data->steps);
+    g_free(data->len_data);
+    g_free(data->pos_data);
+    g_free(data->checkpoints);
+    if(data->snaps) g_array_free(data->snaps, TRUE);
+    if(data->strokes) g_array_free(data->strokes, TRUE);
+    free_lod(data);
+    data->len_data = data->pos_data = NULL;
+    data->checkpoints = NULL;
+    data->snaps = NULL;
+    data->strokes = NULL;
+    data->lens_valid = data->poses_valid = FALSE;
+}
+
+/**
+ * Splitting the kinematics over threads mustn't change a single bit.
+ */
+void parallel_kinematics_test()
+{
+    struct draw_data one = {.step_dist = 0.1, .start_llen = 240, .start_rlen = 260,
+                            .spool_dist = 400, .nthreads = 1};
+    // Enough for 4 chunks of steps and of poses
+    make_test_steps(&one, 4 * MAX(KIN_CHUNK_BYTES, 2 * POSE_CHUNK) + 123);
+    recalc_draw_data(&one);
+
+    struct draw_data four = one;
+    four.nthreads = 4;
+    four.len_data = four.pos_data = NULL;
+    four.checkpoints = NULL;
+    four.snaps = NULL;
+    four.strokes = NULL;
+    four.nlod = 0;
+    four.lens_valid = four.poses_valid = FALSE;
+    recalc_draw_data(&four);
+
+    g_assert(one.nposes == four.nposes);
+    g_assert(one.ncheckpoints == four.ncheckpoints);
+    g_assert(0 == memcmp(one.len_data, four.len_data, 2 * one.nposes * sizeof(float)));
+    g_assert(0 == memcmp(one.pos_data, four.pos_data, 2 * one.nposes * sizeof(float)));
+    for(gsize i = 0; i < one.ncheckpoints; i++) {
+        struct checkpoint *a = &one.checkpoints[i], *b = &four.checkpoints[i];
+        g_assert(a->step == b->step && a->offset == b->offset);
+        g_assert(a->lcount == b->lcount && a->rcount == b->rcount);
+        g_assert(a->npose == b->npose && a->pen_down == b->pen_down);
+    }
+
+    step_buf_clear(&four.steps);
+    four.steps.data = NULL;
+    free_draw_data(&four);
+    free_draw_data(&one);
+}
+
+/**
+ * Kinematics on a 100M step program with 1, 2, 4 and 8 threads.
+ * Only runs with -m perf.
+ */
+void kinematics_perf_test()
+{
+    if(!g_test_perf()) return;
+    struct draw_data data = {.step_dist = 0.1, .start_llen = 240, .start_rlen = 260,
+                             .spool_dist = 400};
+    make_test_steps(&data, 100 * 1000 * 1000);
+    for(guint n = 1; n <= 8; n *= 2) {
+        data.nthreads = n;
+        data.lens_valid = FALSE;
+        g_test_timer_start();
+        recalc_draw_data(&data);
+        double t = g_test_timer_elapsed();
+        g_test_minimized_result(t, "kinematics, %u threads: %.3fs, %lu poses",
+                                n, t, (unsigned long)data.nposes);
+    }
+    free_draw_data(&data);
+}
+
+/***************** TESTS *********************/
+void sim_add_tests(void)
+{
+    g_test_add_func("/pack_unpack", pack_unpack_test);
+    g_test_add_func("/step_buf", step_buf_test);
+    g_test_add_func("/read_steps", read_steps_test);
+    g_test_add_func("/binary", binary_test);
+    g_test_add_func("/state_at", state_at_test);
+    g_test_add_func("/run_length", run_length_test);
+    g_test_add_func("/to_coords_batch", to_coords_batch_test);
+    g_test_add_func("/robot_types", robot_types_test);
+    g_test_add_func("/perf/to_coords", to_coords_perf_test);
+    g_test_add_func("/gen", gen_test);
+    g_test_add_func("/gen_lattice", gen_lattice_test);
+    g_test_add_func("/compile", compile_test);
+    g_test_add_func("/optimise", optimise_test);
+    g_test_add_func("/parallel_kinematics", parallel_kinematics_test);
+    g_test_add_func("/perf/kinematics", kinematics_perf_test);
+    g_test_add_func("/sim_stats", sim_stats_test);
+    g_test_add_func("/lod", lod_test);
+    g_test_add_func("/stream", stream_test);
+    g_test_add_func("/progress", progress_test);
+}
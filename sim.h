@@ -0,0 +1,378 @@
+#ifndef SIM_H
+#define SIM_H
+/**
+ * Step programs, parsing and kinematics. Only depends on GLib so it can be
+ * shared between the GTK simulator and the headless tools.
+ */
+#include <stdio.h>
+
+#include <glib.h>
+
+#define LEFT 0
+#define RIGHT 1
+#define PEN 2
+
+#define LEF_MASK 0b110000
+#define RIG_MASK 0b001100
+#define PEN_MASK 0b000011
+
+#define LEF_SHIFT 4
+#define RIG_SHIFT 2
+#define PEN_SHIFT 0
+
+#define POS_CHAR '+'
+#define NEG_CHAR '-'
+#define NOP_CHAR '.'
+
+#define POS_NUM 0b01
+#define NEG_NUM 0b10
+#define NOP_NUM 0b00
+// Signed motor movement for each 2-bit step number
+static const int step_delta[4] = { [NOP_NUM] = 0, [POS_NUM] = 1, [NEG_NUM] = -1, 0 };
+/**
+ * File format is 3 characters per line.
+ * Each character is either '+', '-' or any other usually '.'.
+ * + means step clockwise or put pen down
+ * - means step anti-clockwise or pick pen up
+ * . means no action for this time-step
+ *
+ * The first character is the left motor command.
+ * The second character is the right motor command.
+ * The third character is the pen command.
+ */
+
+/*********** STEP STORAGE **************/
+/**
+ * Steps are stored as packed triplets (see pack()) in one contiguous,
+ * growable buffer, run-length encoded. A triplet only needs 6 bits so each
+ * run starts with a byte holding the triplet, bit 7 clear. It is followed by
+ * zero or more bytes with bit 7 set, each carrying 7 more bits (least
+ * significant first) of the number of extra times the triplet repeats.
+ *
+ * A lone step costs one byte, four to a 32-bit word, and a straight stroke of
+ * thousands of identical steps costs two or three.
+ */
+#define RUN_FLAG 0x80
+#define RUN_BITS 7
+struct step_buf {
+    guint8 *data;
+    gsize len;    // bytes used in data
+    gsize alloc;
+    gsize nsteps; // steps encoded, including the pending run
+    // The run currently being appended to, not in data until flushed
+    guint8 run_op;
+    guint64 run_len;
+};
+
+/*********** BINARY FORMAT **************/
+/**
+ * A step file can also be binary, which read_data tells apart by the magic
+ * at the start. A fixed little-endian header of BIN_HEADER_SIZE bytes:
+ *
+ *   0  magic, BIN_MAGIC
+ *   8  u32 version, BIN_VERSION
+ *  12  u32 robot type
+ *  16  f32 paper offset y, paper offset x, step distance, spool distance,
+ *          start length left, start length right
+ *  40  u64 number of steps
+ *  48  u64 number of bytes of steps that follow
+ *
+ * followed by the steps exactly as a step_buf stores them, packed triplets
+ * with run lengths, so loading is one read with nothing to parse.
+ */
+#define BIN_MAGIC "RSIMSTEP"
+#define BIN_MAGIC_LEN 8
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE 56
+
+/********** DRAW DATA *******************/
+/**
+ * What the two motors move, which decides where the pen is for a pair of
+ * motor positions (the "lengths"):
+ *
+ *   wires  strings from spools spool_dist apart, positions are the lengths
+ *   planar a gantry, positions are x and y
+ *   elbow  a two link arm with its shoulder halfway between where the
+ *          spools would be and links spool_dist / 2 long, so it reaches the
+ *          same places. Positions are the shoulder angle from the x axis and
+ *          the elbow angle from the upper arm, in degrees.
+ *
+ * A text file can say which with a first line of "Robot Type: " and the
+ * name, otherwise it's whatever it was before, wires by default.
+ */
+enum robot_type { wires, planar, elbow };
+/**
+ * The parameters that the cached lengths and poses were computed from.
+ * Lengths only depend on the steps, step_dist and start lengths, poses
+ * also depend on the spool distance and robot type.
+ */
+struct kin_key {
+    guint steps_version;
+    float step_dist;
+    float start_llen, start_rlen;
+    float spool_dist;
+    enum robot_type type;
+};
+/**
+ * Machine state after the first step steps. recalc_lengths drops one of
+ * these at the start of every CHECKPOINT_INTERVAL-th run so the state at any
+ * step can be found by replaying at most CHECKPOINT_INTERVAL runs, each of
+ * which only costs a multiply.
+ * Motor positions are kept as signed step counts so they're exact, the
+ * length is start + count * step_dist.
+ */
+#define CHECKPOINT_INTERVAL 4096
+struct checkpoint {
+    gsize step;
+    gsize offset; // byte offset in steps of the run that step falls in
+    gint64 lcount, rcount;
+    gsize npose; // pen-down poses recorded before this point
+    gboolean pen_down;
+};
+// Poses [start, end)
+struct pose_range {
+    gsize start, end;
+};
+/**
+ * A coarser copy of the drawing for when it's shown too small to see every
+ * pose. Level i keeps a pose if it's at least cell mm (in x or y) from the
+ * last pose it kept and no pose it's kept already lies in the same square of
+ * a cell mm grid, plus the first and last pose of every stroke so strokes
+ * stay where they are. Going back over what's drawn, as a fill or a shape
+ * drawn again does, then only adds poses in squares the line crossed
+ * without keeping one, so how many a level has is bounded by the squares
+ * drawn on, not how often they were. Where poses were left out for that,
+ * breaks marks the next pose kept so the line isn't joined across them.
+ * Each level doubles the cell of the one before, so a renderer can pick the
+ * level whose cell is under a pixel and draw a number of points that depends
+ * on the window size and the number of strokes rather than the program size.
+ * Levels whose grid would need more than LOD_GRID_MAX squares only thin by
+ * distance.
+ */
+#define LOD_LEVELS 16
+#define LOD_CELL 0.125
+#define LOD_GRID_MAX (64 * 1024 * 1024)
+struct lod_level {
+    float cell;
+    gsize *poses;   // indices into pos_data, ascending
+    guint8 *breaks; // 1 where poses[k] starts a new line within its stroke
+    gsize n;
+};
+// The paper, US legal on its side, in mm from the paper offset
+#define PAPER_WIDTH 355.6
+#define PAPER_HEIGHT 215.9
+struct draw_data {
+    struct step_buf steps;
+    guint steps_version; // bump whenever steps changes
+    struct checkpoint *checkpoints;
+    gsize ncheckpoints;
+    gsize playback_step; // only the first playback_step steps are drawn
+    // Lengths and coordinates for every pen-down step, stored as arrays:
+    // len_data is nposes llens then nposes rlens, pos_data is xs then ys.
+    float *len_data;
+    float *pos_data;
+    gsize nposes;
+    gboolean lens_valid, poses_valid;
+    struct kin_key lens_key, poses_key;
+    guint nthreads; // for kinematics, 0 means one per processor
+    GArray *snaps; // struct pose_range, where the strings couldn't reach
+    GArray *strokes; // gsize, first pose of each pen-down stroke
+    struct lod_level lod[LOD_LEVELS]; // rebuilt whenever the poses are
+    guint nlod;
+    gsize bad_line; // last bad line read_data found, 0 if none
+    double load_seconds;
+    gsize load_bytes; // size of the file read_data last read
+    enum robot_type type;
+    float start_llen, start_rlen;
+    float paper_offset_y, paper_offset_x;
+    float spool_dist;
+    float step_dist;
+    // Set from another thread to stop recalc_draw_data early
+    gint cancel;
+    // Called as recalc_draw_data finishes poses, [0, done) are final
+    void (*progress)(struct draw_data *data, gsize done, gpointer user);
+    // and before that as it works out the lengths, fraction from 0 to 1
+    void (*lens_progress)(struct draw_data *data, double fraction, gpointer user);
+    gpointer progress_data; // user for both
+};
+
+/**
+ * Summary of a simulated program for reporting.
+ */
+struct sim_stats {
+    struct checkpoint final;
+    float final_llen, final_rlen;
+    float final_x, final_y;
+    // Bounding box of the pen-down poses, only valid if there are any
+    float min_x, min_y, max_x, max_y;
+    double pen_down_length;
+    // Straight line distance from the end of each stroke to the next
+    double pen_up_length;
+};
+
+/*********** PATH GENERATION **************/
+/**
+ * Programs made the same way as lines.py, which these have to match byte for
+ * byte: lines are walked GEN_CART_STEP mm at a time in x or y and the motors
+ * stepped GEN_LEN_STEP mm at a time to follow. gen_line_lattice steps them
+ * exactly instead, which is what compile_polylines uses.
+ */
+#define GEN_LEN_STEP 0.1
+#define GEN_CART_STEP 1.0
+#define GEN_CIRCLE_SEGMENTS 50
+
+/*********** COMPILING **************/
+/**
+ * Drawings given as polylines, either "x y" lines with a blank line between
+ * polylines or an SVG path (M, L, H, V and Z, absolute or relative), in mm.
+ * Polylines can be drawn in any order and either way round, and the order is
+ * a stroke_ref per polyline. Paths of up to COMPILE_2OPT_MAX polylines get
+ * at most COMPILE_2OPT_PASSES passes of 2-opt after the nearest neighbour
+ * ordering, bigger ones are O(n^2) just to order so keep the first.
+ */
+#define COMPILE_2OPT_MAX 2000
+#define COMPILE_2OPT_PASSES 64
+struct polylines {
+    GArray *xy;     // double, x and y of every point in turn
+    GArray *starts; // gsize, first point of each polyline
+};
+struct stroke_ref {
+    guint line;
+    gboolean reversed;
+};
+
+/*********** OPTIMISING **************/
+/**
+ * Peephole passes that make a program draw in fewer steps:
+ *
+ *   OPT_PEN    drops pen commands that don't change the pen
+ *   OPT_NOOPS  drops steps that then do nothing
+ *   OPT_TRAVEL replaces everything between the pen going up and coming
+ *              down with the fewest steps to the same place, diagonals first
+ *   OPT_MERGE  replaces two steps by one when together they move each motor
+ *              at most a step, so a step and its undo go and a step on one
+ *              motor joins one on the other to make a diagonal
+ *
+ * OPT_EXACT keeps every pen-down pose and the order they're in, only
+ * repeats of a pose go, so the drawing is the same. OPT_MERGE changes the
+ * pen-down path: it can skip poses, but only ever ones a step from the last
+ * pose kept, so the line moves by at most a step. It's only for when that
+ * will do, same_drawing with skip 1 rather than 0 checks it.
+ */
+#define OPT_PEN (1 << 0)
+#define OPT_NOOPS (1 << 1)
+#define OPT_TRAVEL (1 << 2)
+#define OPT_MERGE (1 << 3)
+#define OPT_EXACT (OPT_PEN | OPT_NOOPS | OPT_TRAVEL)
+#define OPT_ALL (OPT_EXACT | OPT_MERGE)
+
+/*********** STREAMING **************/
+/**
+ * Simulates a program as it's read rather than loading it first, for ones
+ * too big to hold or still being generated. Only STREAM_READ bytes of input
+ * and STREAM_POSES poses are held at once. Each batch of poses is handed to
+ * poses() as soon as it's worked out, with at least one batch per read.
+ */
+#define STREAM_READ (1 << 20)
+#define STREAM_POSES 4096
+struct sim_stream {
+    struct draw_data *data; // header fields, its steps are used as scratch
+    struct checkpoint state;
+    struct sim_stats stats; // complete once sim_stream returns
+    gsize bad_line;
+    gsize lines; // non-empty lines of steps so far
+    gboolean in_stroke;
+    gboolean snapping;
+    struct pose_range snap; // open while snapping
+    float last_x, last_y;
+    // The current batch, poses [base, base + n)
+    gsize base, n;
+    float llen[STREAM_POSES], rlen[STREAM_POSES];
+    float x[STREAM_POSES], y[STREAM_POSES];
+    guint8 snapped[STREAM_POSES];
+    guint8 start[STREAM_POSES]; // first pose of a stroke
+    // Either may be NULL
+    void (*poses)(const struct sim_stream *s, gpointer user);
+    void (*snapped_range)(const struct pose_range *range, gpointer user);
+    gpointer user;
+};
+
+char to_num(char ch);
+char to_char(char ch);
+unsigned int pack(char ins[3]);
+void unpack(char ins[3], unsigned int val);
+
+void step_buf_reserve(struct step_buf *buf, gsize n);
+void step_buf_flush(struct step_buf *buf);
+void step_buf_append(struct step_buf *buf, guint8 step);
+void step_buf_clear(struct step_buf *buf);
+void step_buf_free(struct step_buf *buf);
+void step_buf_copy(struct step_buf *to, const struct step_buf *from);
+const guint8 *step_run(const guint8 *p, const guint8 *end, guint8 *op, guint64 *count);
+
+gsize read_steps(const char *text, gsize len, struct step_buf *steps, gsize *bad_line);
+int read_data(char *fname, struct draw_data *data);
+int write_binary(const char *fname, struct draw_data *data);
+int write_text(const char *fname, struct draw_data *data);
+void write_steps(FILE *f, const struct step_buf *steps);
+
+/**
+ * Forward kinematics for a batch of poses, as to_coords_batch, for one robot
+ * type. Chosen once per recompute so each type gets its own loop.
+ */
+typedef gsize (*coords_kernel)(float *x, float *y, guint8 *snapped,
+                               const float *llen, const float *rlen, gsize n,
+                               float spool_dist);
+
+const char *robot_type_name(enum robot_type type);
+gboolean robot_type_from_name(const char *name, enum robot_type *type);
+void to_coords(float *x, float *y, float spool_dist, float llen, float rlen, enum robot_type type);
+coords_kernel coords_kernel_for(enum robot_type type);
+gsize to_coords_batch(float *x, float *y, guint8 *snapped,
+                      const float *llen, const float *rlen, gsize n,
+                      float spool_dist, enum robot_type type);
+void to_lengths(double *llen, double *rlen, double spool_dist, double x, double y);
+gsize gen_line(struct step_buf *steps, double x1, double y1, double x2, double y2,
+               double spool_dist);
+gsize gen_circle(struct step_buf *steps, double x, double y, double r,
+                 double spool_dist, double *llen, double *rlen);
+gsize gen_square(struct step_buf *steps, double spool_dist, double *llen, double *rlen);
+gsize gen_line_lattice(struct step_buf *steps, const struct draw_data *data,
+                       gint64 *lcount, gint64 *rcount,
+                       double x1, double y1, double x2, double y2);
+int read_polylines(const char *text, gsize len, struct polylines *lines);
+void free_polylines(struct polylines *lines);
+double polyline_travel(const struct polylines *lines, const struct stroke_ref *order);
+void order_polylines(const struct polylines *lines, struct stroke_ref *order);
+gsize compile_polylines(struct draw_data *data, const struct polylines *lines,
+                        const struct stroke_ref *order);
+double polyline_deviation(const struct draw_data *data, const struct polylines *lines,
+                          const struct stroke_ref *order);
+gsize optimise_steps(struct step_buf *out, const struct step_buf *in, guint flags);
+gboolean same_drawing(const struct draw_data *a, const struct draw_data *b, int skip);
+void run_chunks(GThreadFunc func, gpointer chunks, gsize size, guint n);
+guint kin_threads(const struct draw_data *data, gsize work, gsize per_thread);
+gboolean recalc_lengths(struct draw_data *data);
+void find_strokes(struct draw_data *data);
+gsize stroke_end(const struct draw_data *data, guint i);
+guint stroke_at(const struct draw_data *data, gsize pose);
+gboolean recalc_poses(struct draw_data *data);
+void build_lod(struct draw_data *data);
+void free_lod(struct draw_data *data);
+const struct lod_level *lod_for_scale(const struct draw_data *data, float scale);
+gsize lod_find(const struct lod_level *level, gsize pose);
+gboolean recalc_draw_data(struct draw_data *data);
+struct kin_key draw_data_key(const struct draw_data *data);
+gboolean draw_data_current(const struct draw_data *data);
+void draw_data_swap_results(struct draw_data *a, struct draw_data *b);
+struct checkpoint replay_to(const struct draw_data *data, gsize k, gboolean part);
+struct checkpoint state_at(const struct draw_data *data, gsize k);
+void sim_stats(const struct draw_data *data, struct sim_stats *stats);
+void draw_data_defaults(struct draw_data *data);
+int sim_stream(int fd, const char *name, struct sim_stream *s);
+void free_draw_data(struct draw_data *data);
+
+void make_test_steps(struct draw_data *data, gsize n);
+void sim_add_tests(void);
+
+#endif
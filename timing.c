@@ -0,0 +1,365 @@
+#include <math.h>
+
+#include <glib.h>
+
+#include "sim.h"
+#include "timing.h"
+
+// Pending blocks to gather before planning any
+#define TIMING_BATCH 4096
+
+/**
+ * Made up but plausible for 0.1mm steps: 100mm/s, up to speed in 10mm.
+ */
+void motion_limits_defaults(struct motion_limits *limits)
+{
+    *limits = (struct motion_limits){.max_rate = {1000, 1000},
+                                     .accel = {10000, 10000},
+                                     .jerk = {200, 200},
+                                     .pen_down_settle = 0.15,
+                                     .pen_up_settle = 0.1};
+}
+
+/**
+ * Seconds from the start of a planned block until s of its steps are done.
+ * The ramps are written as 2s / (v + v0) rather than (v - v0) / a so they
+ * don't lose everything to cancellation when the rate hardly changes.
+ */
+double block_time(const struct time_block *b, double s)
+{
+    const double a = b->accel, v0 = b->entry, v1 = b->exit, vp = b->peak;
+    // Steps spent speeding up, at the peak and slowing down
+    const double up = (vp * vp - v0 * v0) / (2 * a);
+    const double down = (vp * vp - v1 * v1) / (2 * a);
+    const double cruise = MAX(b->n - up - down, 0);
+    if(s <= 0) return 0;
+    if(s <= up) return 2 * s / (sqrt(v0 * v0 + 2 * a * s) + v0);
+    double t = 2 * up / (vp + v0);
+    if(s <= up + cruise) return t + (s - up) / vp;
+    t += cruise / vp + 2 * down / (vp + v1);
+    const double left = b->n - s;
+    if(left <= 0) return t;
+    return t - 2 * left / (sqrt(v1 * v1 + 2 * a * left) + v1);
+}
+
+/**
+ * Blocks are planned with the usual two passes, backwards for the fastest
+ * each can enter and still slow down for what follows and forwards for
+ * what it can reach from the one before. Nothing more than lookahead steps
+ * on can slow a block down, it'd have the room to get from max rate to a
+ * standstill, so only that much is held back and the rest is planned a
+ * batch at a time. That's a few thousand blocks however long the program.
+ */
+struct planner {
+    const struct motion_limits *limits;
+    double stop; // what the machine starts at after standing still
+    gsize lookahead;
+    GArray *pending; // struct time_block, complete but not planned
+    gsize pending_steps;
+    guint plan_at;
+    // The start of the next block to plan
+    double time, entry;
+    gboolean pen_down;
+    struct timing *timing; // totals so far
+    GArray *marks; // NULL for none
+    gsize next_mark;
+    // Steps [first, first + n) have their times put in t, if it's set
+    double *t;
+    gsize first, n;
+    gboolean done;
+};
+
+static void planner_init(struct planner *p, const struct motion_limits *limits,
+                         struct timing *timing)
+{
+    const double rate = MAX(limits->max_rate[0], limits->max_rate[1]);
+    const double accel = MIN(limits->accel[0], limits->accel[1]);
+    *p = (struct planner){.limits = limits,
+                          .stop = MIN(limits->jerk[0], limits->jerk[1]),
+                          .lookahead = (gsize)ceil(rate * rate / (2 * accel)) + 1,
+                          .pending = g_array_new(FALSE, FALSE, sizeof(struct time_block)),
+                          .plan_at = TIMING_BATCH,
+                          .timing = timing};
+}
+
+/**
+ * Settles on the block's rates given where the last one left off and the
+ * fastest the next can enter, then adds up its time.
+ */
+static void plan_block(struct planner *p, struct time_block *b, double next)
+{
+    const double v0 = MIN(p->entry, b->limit);
+    const double ramp = 2 * b->accel * b->n;
+    b->entry = v0;
+    b->exit = MIN(next, sqrt(v0 * v0 + ramp));
+    b->peak = MIN(b->rate, sqrt((ramp + v0 * v0 + b->exit * b->exit) / 2));
+
+    if(p->marks && b->step >= p->next_mark) {
+        struct time_mark mark = {b->step, b->offset, p->time, p->entry, p->pen_down};
+        g_array_append_val(p->marks, mark);
+        p->next_mark = b->step + TIMING_MARK;
+    }
+
+    struct timing *timing = p->timing;
+    b->settle = 0;
+    if(b->pen_down != p->pen_down) {
+        b->settle = b->pen_down ? p->limits->pen_down_settle : p->limits->pen_up_settle;
+        timing->pen += b->settle;
+        timing->pen_changes++;
+    }
+    b->start = p->time + b->settle;
+    const double t = block_time(b, b->n);
+    if(b->pen_down) timing->drawing += t;
+    else timing->travel += t;
+    timing->nblocks++;
+    p->time = b->start + t;
+    p->entry = b->exit;
+    p->pen_down = b->pen_down;
+
+    if(p->t) {
+        gsize from = MAX(b->step, p->first), to = MIN(b->step + b->n, p->first + p->n);
+        for(gsize i = from; i < to; i++)
+            p->t[i - p->first] = b->start + block_time(b, i - b->step + 1);
+        p->done = b->step + b->n >= p->first + p->n;
+    }
+}
+
+/**
+ * Plans the pending blocks with at least lookahead steps after them, or all
+ * of them at the end of the program.
+ */
+static void plan_pending(struct planner *p, gboolean final)
+{
+    struct time_block *b = (struct time_block *)p->pending->data;
+    const guint n = p->pending->len;
+    // The last pending block could be followed by anything until the end
+    double next = final ? p->stop : INFINITY;
+    for(guint i = n; i-- > 0;) {
+        double limit = MIN(b[i].limit, b[i].rate);
+        if(i) limit = MIN(limit, b[i - 1].rate);
+        b[i].limit = MIN(limit, sqrt(next * next + 2 * b[i].accel * b[i].n));
+        next = b[i].limit;
+    }
+
+    gsize after = p->pending_steps;
+    guint i;
+    for(i = 0; i < n && !p->done; i++) {
+        if(!final && after - b[i].n < p->lookahead) break;
+        after -= b[i].n;
+        plan_block(p, &b[i], i + 1 < n ? b[i + 1].limit : p->stop);
+    }
+    g_array_remove_range(p->pending, 0, i);
+    p->pending_steps = after;
+    p->plan_at = MAX(TIMING_BATCH, 2 * p->pending->len);
+}
+
+static void add_block(struct planner *p, struct time_block *b)
+{
+    const struct motion_limits *limits = p->limits;
+    // Neither motor moves, the machine just goes through the steps
+    if(b->rate == INFINITY) {
+        b->rate = MIN(limits->max_rate[0], limits->max_rate[1]);
+        b->accel = MIN(limits->accel[0], limits->accel[1]);
+    }
+    g_array_append_vals(p->pending, b, 1);
+    p->pending_steps += b->n;
+    if(p->pending->len >= p->plan_at) plan_pending(p, FALSE);
+}
+
+/**
+ * Splits the steps from mark on into blocks and plans them, a run at a time,
+ * until the end of the program or p->done.
+ */
+static void plan_steps(struct planner *p, const struct draw_data *data,
+                       const struct time_mark *mark)
+{
+    const struct motion_limits *limits = p->limits;
+    const guint8 *start = data->steps.data, *end = start + data->steps.len;
+    const guint8 *q = start + mark->offset;
+    struct time_block b;
+    gboolean open = FALSE, pen_down = mark->pen_down;
+    int dir[2] = {0, 0}; // of the motors in the open block
+    gsize step = mark->step;
+
+    p->time = mark->time;
+    p->entry = mark->entry;
+    p->pen_down = mark->pen_down;
+    while(q < end && !p->done) {
+        const guint8 *run = q;
+        guint8 op;
+        guint64 count;
+        q = step_run(q, end, &op, &count);
+        const int d[2] = {step_delta[(op & LEF_MASK) >> LEF_SHIFT],
+                          step_delta[(op & RIG_MASK) >> RIG_SHIFT]};
+        gboolean pen = pen_down;
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: pen = TRUE; break;
+            case NEG_NUM: pen = FALSE; break;
+        }
+
+        double limit = pen != pen_down ? p->stop : INFINITY;
+        gboolean split = pen != pen_down;
+        for(int m = 0; m < 2; m++) {
+            if(d[m] && dir[m] && d[m] != dir[m]) {
+                limit = MIN(limit, limits->jerk[m] / 2);
+                split = TRUE;
+            }
+        }
+        if(!open || split) {
+            if(open) add_block(p, &b);
+            b = (struct time_block){.step = step, .offset = run - start, .limit = limit,
+                                    .rate = INFINITY, .accel = INFINITY, .pen_down = pen};
+            dir[0] = dir[1] = 0;
+            open = TRUE;
+        }
+        for(int m = 0; m < 2; m++) {
+            if(!d[m]) continue;
+            dir[m] = d[m];
+            b.rate = MIN(b.rate, limits->max_rate[m]);
+            b.accel = MIN(b.accel, limits->accel[m]);
+        }
+        b.n += count;
+        step += count;
+        pen_down = pen;
+    }
+    if(open && !p->done) add_block(p, &b);
+    if(!p->done) plan_pending(p, q == end);
+}
+
+/**
+ * Plans the whole program for how long it takes and where the time goes,
+ * dropping marks for timing_steps. Only depends on the steps, and is a pass
+ * over the runs that keeps a few thousand blocks at a time.
+ */
+void recalc_timing(const struct draw_data *data, const struct motion_limits *limits,
+                   struct timing *timing)
+{
+    GArray *marks = timing->marks ? timing->marks :
+                                    g_array_new(FALSE, FALSE, sizeof(struct time_mark));
+    g_array_set_size(marks, 0);
+    *timing = (struct timing){.marks = marks};
+
+    struct planner p;
+    planner_init(&p, limits, timing);
+    p.marks = marks;
+    const struct time_mark begin = {.entry = p.stop};
+    plan_steps(&p, data, &begin);
+    timing->total = p.time;
+    g_array_free(p.pending, TRUE);
+}
+
+/**
+ * Fills t with the time each of steps [first, first + n) is done, in seconds
+ * from the start, by replaying from the last mark before first. Only valid
+ * once recalc_timing has run on the current steps with the same limits.
+ * Returns how many it filled, fewer than n if the program ends first.
+ */
+gsize timing_steps(const struct draw_data *data, const struct motion_limits *limits,
+                   const struct timing *timing, gsize first, gsize n, double *t)
+{
+    if(first >= data->steps.nsteps) return 0;
+    n = MIN(n, data->steps.nsteps - first);
+    if(!n) return 0;
+
+    const struct time_mark *marks = (const struct time_mark *)timing->marks->data;
+    guint lo = 0, hi = timing->marks->len;
+    while(hi - lo > 1) {
+        guint mid = lo + (hi - lo) / 2;
+        if(marks[mid].step <= first) lo = mid;
+        else hi = mid;
+    }
+
+    struct timing totals = {0};
+    struct planner p;
+    planner_init(&p, limits, &totals);
+    p.t = t;
+    p.first = first;
+    p.n = n;
+    plan_steps(&p, data, &marks[lo]);
+    g_array_free(p.pending, TRUE);
+    return n;
+}
+
+void free_timing(struct timing *timing)
+{
+    if(timing->marks) g_array_free(timing->marks, TRUE);
+    timing->marks = NULL;
+}
+
+void timing_test()
+{
+    const struct motion_limits limits = {.max_rate = {1000, 1000}, .accel = {10000, 10000},
+                                         .jerk = {200, 200},
+                                         .pen_down_settle = 0.25, .pen_up_settle = 0.125};
+    struct draw_data data = {.nthreads = 1};
+    struct timing timing = {0};
+    GString *text = g_string_new(NULL);
+
+    // 48 steps from rest up to the max rate, 904 there and 48 back down
+    for(int i = 0; i < 1000; i++) g_string_append(text, "+..\n");
+    step_buf_clear(&data.steps);
+    read_steps(text->str, text->len, &data.steps, NULL);
+    recalc_timing(&data, &limits, &timing);
+    g_assert(fabs(timing.total - 1.064) < 1e-9);
+    g_assert(timing.travel == timing.total);
+    g_assert(timing.drawing == 0 && timing.pen == 0 && timing.nblocks == 1);
+
+    // Reversing only slows to half the jerk, which takes 49.5 steps either side
+    for(int i = 0; i < 1000; i++) g_string_append(text, "-..\n");
+    step_buf_clear(&data.steps);
+    read_steps(text->str, text->len, &data.steps, NULL);
+    recalc_timing(&data, &limits, &timing);
+    g_assert(timing.nblocks == 2);
+    g_assert(fabs(timing.total - 2 * 1.0725) < 1e-9);
+
+    // Pen changes stop and wait, repeating the pen doesn't
+    g_string_assign(text, "..+\n");
+    for(int i = 0; i < 1000; i++) g_string_append(text, "+.+\n");
+    g_string_append(text, "..-\n");
+    step_buf_clear(&data.steps);
+    read_steps(text->str, text->len, &data.steps, NULL);
+    recalc_timing(&data, &limits, &timing);
+    g_assert(timing.nblocks == 2 && timing.pen_changes == 2);
+    g_assert(fabs(timing.drawing - 1.065) < 1e-9);
+    g_assert(timing.pen == 0.375);
+    g_assert(timing.travel > 0);
+    g_assert(fabs(timing.drawing + timing.travel + timing.pen - timing.total) < 1e-9);
+
+    // Every step takes time, and replaying from a mark changes nothing
+    const gsize n = 3 * TIMING_MARK + 123;
+    make_test_steps(&data, n);
+    recalc_timing(&data, &limits, &timing);
+    g_assert(timing.marks->len >= 3);
+    double *all = g_new(double, n), part[1000];
+    g_assert(timing_steps(&data, &limits, &timing, 0, n, all) == n);
+    for(gsize i = 1; i < n; i++) g_assert(all[i] > all[i - 1]);
+    g_assert(all[n - 1] == timing.total);
+    const gsize first = 2 * TIMING_MARK + 7;
+    g_assert(timing_steps(&data, &limits, &timing, first, 1000, part) == 1000);
+    for(gsize i = 0; i < 1000; i++) g_assert(part[i] == all[first + i]);
+    g_assert(timing_steps(&data, &limits, &timing, n - 5, 1000, part) == 5);
+    g_assert(part[4] == timing.total);
+    g_assert(timing_steps(&data, &limits, &timing, n, 1, part) == 0);
+
+    g_free(all);
+    g_string_free(text, TRUE);
+    free_timing(&timing);
+    free_draw_data(&data);
+}
+
+void timing_perf_test()
+{
+    if(!g_test_perf()) return;
+    struct draw_data data = {0};
+    struct motion_limits limits;
+    struct timing timing = {0};
+    motion_limits_defaults(&limits);
+    make_test_steps(&data, 100 * 1000 * 1000);
+    g_test_timer_start();
+    recalc_timing(&data, &limits, &timing);
+    double t = g_test_timer_elapsed();
+    g_test_minimized_result(t, "timing: %.3fs, %lu blocks, %.1fs of plotting",
+                            t, (unsigned long)timing.nblocks, timing.total);
+    free_timing(&timing);
+    free_draw_data(&data);
+}
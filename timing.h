@@ -0,0 +1,71 @@
+#ifndef TIMING_H
+#define TIMING_H
+/**
+ * The physical timing model, planned from the steps alone so the CLI and
+ * the benchmark can use it without simulating the poses.
+ */
+#include <glib.h>
+
+#include "sim.h"
+
+/**
+ * How long a program takes on the real machine. Every step moves both
+ * motors at once, so the machine goes through the steps at one rate, in
+ * steps per second. The program is split into blocks wherever a motor
+ * reverses or the pen changes, and within a block the rate ramps at the
+ * acceleration of the motors that move in it and tops out at their max rate.
+ * A reversing motor can only be going as fast as half its jerk (the biggest
+ * change in rate it can take at once) and a pen change stops the machine,
+ * starting again at the lowest jerk once the pen has settled. The program
+ * starts and ends at that rate too. Rates are steps/s, acceleration
+ * steps/s^2 and [0] is the left motor, [1] the right.
+ */
+struct motion_limits {
+    float max_rate[2];
+    float accel[2];
+    float jerk[2];
+    float pen_down_settle, pen_up_settle; // seconds
+};
+/**
+ * Steps [step, step + n) ramp from entry up to at most peak and back down
+ * to exit, starting at start seconds.
+ */
+struct time_block {
+    gsize step, n;
+    gsize offset; // byte offset in steps of the first run
+    double start;
+    double limit; // most the entry could be, while planning
+    double rate, accel;
+    double entry, peak, exit;
+    double settle; // pen settling before start
+    gboolean pen_down;
+};
+/**
+ * Where the planner was at the start of a block, one about every
+ * TIMING_MARK steps, so timing_steps can replay from the nearest.
+ */
+#define TIMING_MARK (1 << 16)
+struct time_mark {
+    gsize step, offset;
+    double time; // before any pen settling
+    double entry;
+    gboolean pen_down; // before the block
+};
+struct timing {
+    double total, drawing, travel, pen; // seconds
+    gsize nblocks, pen_changes;
+    GArray *marks; // struct time_mark
+};
+
+void motion_limits_defaults(struct motion_limits *limits);
+double block_time(const struct time_block *b, double s);
+void recalc_timing(const struct draw_data *data, const struct motion_limits *limits,
+                   struct timing *timing);
+gsize timing_steps(const struct draw_data *data, const struct motion_limits *limits,
+                   const struct timing *timing, gsize first, gsize n, double *t);
+void free_timing(struct timing *timing);
+
+void timing_test();
+void timing_perf_test();
+
+#endif
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sim.h"
+#include "trace.h"
+
+struct trace_event {
+    gint64 start, dur; // us, dur is -1 for a counter
+    gssize value;      // a counter's new value
+    guint id;          // enum trace_span or trace_counter
+    guint tid;
+};
+
+static struct {
+    gint on;
+    GMutex lock;
+    gint64 epoch; // when it was first turned on
+    struct trace_stats spans[TRACE_SPANS];
+    gssize counters[TRACE_COUNTERS];
+    GArray *events; // struct trace_event
+    gsize dropped;  // events there wasn't room for
+    gint next_tid;
+} trace;
+static GPrivate trace_tid;
+
+static const char *const trace_span_names[] = {
+    [span_parse] = "parse", [span_recalc] = "recalc_draw_data",
+    [span_lengths] = "recalc_lengths", [span_poses] = "recalc_poses",
+    [span_lod] = "build_lod", [span_to_coords] = "to_coords",
+    [span_render] = "draw_strokes", [span_expose] = "expose",
+};
+
+static const char *const trace_counter_names[] = {
+    [counter_step_bytes] = "step bytes", [counter_pose_bytes] = "pose bytes",
+};
+
+const char *trace_span_name(enum trace_span span)
+{
+    return span < TRACE_SPANS ? trace_span_names[span] : "unknown";
+}
+
+const char *trace_counter_name(enum trace_counter counter)
+{
+    return counter < TRACE_COUNTERS ? trace_counter_names[counter] : "unknown";
+}
+
+void trace_enable(gboolean on)
+{
+    g_mutex_lock(&trace.lock);
+    if(on && !trace.events) {
+        trace.events = g_array_new(FALSE, FALSE, sizeof(struct trace_event));
+        trace.epoch = g_get_monotonic_time();
+    }
+    g_atomic_int_set(&trace.on, on);
+    g_mutex_unlock(&trace.lock);
+}
+
+gboolean trace_enabled(void)
+{
+    return g_atomic_int_get(&trace.on);
+}
+
+/**
+ * Small numbers for threads, in the order they first record something.
+ */
+static guint trace_thread(void)
+{
+    guint tid = GPOINTER_TO_UINT(g_private_get(&trace_tid));
+    if(!tid) {
+        tid = g_atomic_int_add(&trace.next_tid, 1) + 1;
+        g_private_set(&trace_tid, GUINT_TO_POINTER(tid));
+    }
+    return tid;
+}
+
+// With lock held
+static void trace_event(gint64 start, gint64 dur, gssize value, guint id)
+{
+    // trace_reset can come between a span's begin and end on another thread
+    if(!trace.on || !trace.events) return;
+    if(trace.events->len >= TRACE_EVENTS) {
+        trace.dropped++;
+        return;
+    }
+    struct trace_event e = {start - trace.epoch, dur, value, id, trace_thread()};
+    g_array_append_val(trace.events, e);
+}
+
+/**
+ * The start of a span, to hand to trace_end. 0 if tracing is off.
+ */
+gint64 trace_begin(void)
+{
+    return G_UNLIKELY(g_atomic_int_get(&trace.on)) ? g_get_monotonic_time() : 0;
+}
+
+void trace_end(enum trace_span span, gint64 start)
+{
+    if(G_LIKELY(!start)) return;
+    const gint64 dur = g_get_monotonic_time() - start;
+    g_mutex_lock(&trace.lock);
+    if(!trace.on) {
+        g_mutex_unlock(&trace.lock);
+        return;
+    }
+    struct trace_stats *st = &trace.spans[span];
+    st->n++;
+    st->total += dur;
+    st->last = dur;
+    st->max = MAX(st->max, dur);
+    trace_event(start, dur, 0, span);
+    g_mutex_unlock(&trace.lock);
+}
+
+void trace_count(enum trace_counter counter, gssize delta)
+{
+    if(!delta) return;
+    gssize value = g_atomic_pointer_add(&trace.counters[counter], delta) + delta;
+    if(G_LIKELY(!g_atomic_int_get(&trace.on))) return;
+    g_mutex_lock(&trace.lock);
+    trace_event(g_get_monotonic_time(), -1, value, counter);
+    g_mutex_unlock(&trace.lock);
+}
+
+gssize trace_counter(enum trace_counter counter)
+{
+    return (gssize)g_atomic_pointer_get(&trace.counters[counter]);
+}
+
+void trace_stats(enum trace_span span, struct trace_stats *stats)
+{
+    g_mutex_lock(&trace.lock);
+    *stats = trace.spans[span];
+    g_mutex_unlock(&trace.lock);
+}
+
+gsize trace_events(void)
+{
+    g_mutex_lock(&trace.lock);
+    gsize n = trace.events ? trace.events->len : 0;
+    g_mutex_unlock(&trace.lock);
+    return n;
+}
+
+/**
+ * Saves the events so far as Chrome trace JSON, spans as complete events
+ * and counters as counter events, all in one process.
+ */
+int trace_write(const char *fname)
+{
+    FILE *f = fopen(fname, "w");
+    if(!f) {
+        printf("Failed to open file %s\n", fname);
+        return -1;
+    }
+    g_mutex_lock(&trace.lock);
+    fprintf(f, "{\"traceEvents\": [");
+    for(guint i = 0; trace.events && i < trace.events->len; i++) {
+        const struct trace_event *e = &g_array_index(trace.events, struct trace_event, i);
+        fputs(i ? ",\n" : "\n", f);
+        if(e->dur < 0)
+            fprintf(f, "{\"name\": \"%s\", \"ph\": \"C\", \"ts\": %" G_GINT64_FORMAT
+                       ", \"pid\": 1, \"tid\": %u, \"args\": {\"bytes\": %" G_GSSIZE_FORMAT "}}",
+                    trace_counter_name(e->id), e->start, e->tid, e->value);
+        else
+            fprintf(f, "{\"name\": \"%s\", \"cat\": \"sim\", \"ph\": \"X\", \"ts\": %"
+                       G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT ", \"pid\": 1, \"tid\": %u}",
+                    trace_span_name(e->id), e->start, e->dur, e->tid);
+    }
+    fprintf(f, "\n],\n\"displayTimeUnit\": \"ms\",\n"
+               "\"otherData\": {\"dropped\": %lu}}\n", (unsigned long)trace.dropped);
+    g_mutex_unlock(&trace.lock);
+    if(ferror(f) | fclose(f)) {
+        printf("Failed to write file %s\n", fname);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Forgets the timings and events, but not the counters which are still
+ * true, and turns tracing off.
+ */
+void trace_reset(void)
+{
+    g_mutex_lock(&trace.lock);
+    g_atomic_int_set(&trace.on, 0);
+    memset(trace.spans, 0, sizeof(trace.spans));
+    if(trace.events) g_array_free(trace.events, TRUE);
+    trace.events = NULL;
+    trace.dropped = 0;
+    g_mutex_unlock(&trace.lock);
+}
+
+void trace_test()
+{
+    gchar *name = g_build_filename(g_get_tmp_dir(), "robot_sim_trace_test.json", NULL);
+    struct trace_stats st;
+
+    // Off, spans aren't kept
+    trace_reset();
+    trace_end(span_parse, trace_begin());
+    trace_stats(span_parse, &st);
+    g_assert(st.n == 0 && trace_events() == 0);
+
+    // Counters always are
+    struct step_buf buf = {0};
+    const gssize steps = trace_counter(counter_step_bytes);
+    step_buf_reserve(&buf, 10000);
+    g_assert(trace_counter(counter_step_bytes) == steps + buf.alloc);
+    step_buf_free(&buf);
+    g_assert(trace_counter(counter_step_bytes) == steps);
+
+    // On, a recompute times each stage and the batches on every thread
+    trace_enable(TRUE);
+    struct draw_data data = {.step_dist = 0.1, .start_llen = 240, .start_rlen = 260,
+                             .spool_dist = 400, .nthreads = 2};
+    make_test_steps(&data, 1000);
+    const gssize poses = trace_counter(counter_pose_bytes);
+    recalc_draw_data(&data);
+    g_assert(trace_counter(counter_pose_bytes) ==
+             poses + (gssize)(4 * data.nposes * sizeof(float)));
+    for(enum trace_span span = span_recalc; span <= span_lod; span++) {
+        trace_stats(span, &st);
+        g_assert(st.n == 1 && st.total == st.last && st.max == st.last);
+    }
+    trace_stats(span_to_coords, &st);
+    g_assert(st.n >= 1);
+    free_draw_data(&data);
+    g_assert(trace_counter(counter_pose_bytes) == poses);
+
+    g_assert(0 == trace_write(name));
+    gchar *json;
+    g_assert(g_file_get_contents(name, &json, NULL, NULL));
+    g_assert(g_str_has_prefix(json, "{\"traceEvents\": ["));
+    g_assert(strstr(json, "{\"name\": \"recalc_draw_data\", \"cat\": \"sim\", \"ph\": \"X\""));
+    g_assert(strstr(json, "{\"name\": \"pose bytes\", \"ph\": \"C\""));
+    g_assert(strstr(json, "\"dropped\": 0"));
+    g_free(json);
+
+    trace_reset();
+    g_assert(!trace_enabled() && trace_events() == 0);
+    // A span that was running when tracing was reset isn't kept
+    trace_enable(TRUE);
+    gint64 t = trace_begin();
+    trace_reset();
+    trace_end(span_parse, t);
+    trace_stats(span_parse, &st);
+    g_assert(st.n == 0 && trace_events() == 0);
+    g_remove(name);
+    g_free(name);
+}
@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+/**
+ * Timers around the expensive parts and counters of the bytes they hold.
+ * Timing is off until trace_enable, and then each span keeps how often it
+ * ran and for how long by the monotonic clock, in us. Every run, and every
+ * change to a counter, is also kept as an event for trace_write to save as
+ * Chrome trace JSON (chrome://tracing or Perfetto), until there are
+ * TRACE_EVENTS of them. Off, a span costs a load and a branch.
+ * The counters are of bytes allocated right now so they're kept all the
+ * time, they only change when something is allocated or freed.
+ */
+#include <glib.h>
+
+#define TRACE_EVENTS (1 << 20)
+enum trace_span {
+    span_parse,     // read_data
+    span_recalc,    // recalc_draw_data, which is the next three
+    span_lengths,   // recalc_lengths
+    span_poses,     // recalc_poses
+    span_lod,       // build_lod
+    span_to_coords, // each thread's batch of poses
+    span_render,    // draw_strokes
+    span_expose,    // a whole redraw of the GUI
+};
+#define TRACE_SPANS (span_expose + 1)
+enum trace_counter {
+    counter_step_bytes, // step_buf storage
+    counter_pose_bytes, // len_data and pos_data
+};
+#define TRACE_COUNTERS (counter_pose_bytes + 1)
+struct trace_stats {
+    guint64 n;
+    gint64 total, last, max; // us
+};
+
+void trace_enable(gboolean on);
+gboolean trace_enabled(void);
+gint64 trace_begin(void);
+void trace_end(enum trace_span span, gint64 start);
+void trace_count(enum trace_counter counter, gssize delta);
+gssize trace_counter(enum trace_counter counter);
+void trace_stats(enum trace_span span, struct trace_stats *stats);
+gsize trace_events(void);
+const char *trace_span_name(enum trace_span span);
+const char *trace_counter_name(enum trace_counter counter);
+int trace_write(const char *fname);
+void trace_reset(void);
+
+void trace_test();
+
+#endif
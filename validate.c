@@ -0,0 +1,397 @@
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <glib.h>
+
+#include "sim.h"
+#include "validate.h"
+
+#define VALIDATE_BATCH 1024
+#define VALIDATE_CHUNK (256 * 1024) // steps
+#define VIOLATION_KINDS (cable_angle + 1)
+
+static const char *const violation_kind_names[] = {
+    [snapped_string] = "snapped string", [negative_length] = "negative length",
+    [off_paper] = "off paper", [cable_angle] = "cable angle",
+};
+
+const char *violation_kind_name(enum violation_kind kind)
+{
+    return kind <= cable_angle ? violation_kind_names[kind] : "unknown";
+}
+
+/**
+ * The paper expose_event draws, and angles that still leave the strings
+ * some hold on the pen.
+ */
+void workspace_defaults(struct workspace *ws)
+{
+    *ws = (struct workspace){.paper_width = PAPER_WIDTH, .paper_height = PAPER_HEIGHT,
+                             .min_angle = 5, .min_spread = 10};
+}
+
+/**
+ * The workspace as the checks use it, so they need no trig.
+ */
+struct check_limits {
+    gboolean wires;
+    float x0, x1, y0, y1;
+    float sd2;
+    float sin_angle;   // a string is too flat if y < len * sin_angle
+    float cos_spread2; // too close if l^2 + r^2 - sd^2 > l * r * cos_spread2
+};
+
+struct check_batch {
+    float llen[VALIDATE_BATCH], rlen[VALIDATE_BATCH];
+    float x[VALIDATE_BATCH], y[VALIDATE_BATCH];
+    guint8 pen[VALIDATE_BATCH], snapped[VALIDATE_BATCH];
+};
+
+struct check_chunk {
+    const struct draw_data *data;
+    const struct check_limits *limits;
+    struct checkpoint in; // at the start of a run
+    gsize end;            // byte offset the chunk stops at
+    // Stretches not finished yet, a bit per violation_kind in open
+    guint8 open;
+    struct violation opened[VIOLATION_KINDS];
+    GArray *found[VIOLATION_KINDS]; // struct violation, in step order
+};
+
+/**
+ * A snapped string or negative length makes the rest meaningless, and only
+ * the paper matters to the other robots.
+ */
+static guint8 step_flags(const struct check_limits *c, int snapped, int neg, int off, int angle)
+{
+    if(!c->wires) return off << off_paper;
+    guint8 f = snapped << snapped_string | neg << negative_length;
+    return f ? f : off << off_paper | angle << cable_angle;
+}
+
+/**
+ * Opens and closes the chunk's stretches for step i of the batch, which is
+ * step base + i of the program, having violations flags.
+ */
+static void note_step(struct check_chunk *c, const struct check_batch *b, gsize base,
+                      gsize i, guint8 flags)
+{
+    const guint8 change = flags ^ c->open;
+    if(!change) return;
+    for(int kind = 0; kind < VIOLATION_KINDS; kind++) {
+        if(!((change >> kind) & 1)) continue;
+        struct violation *v = &c->opened[kind];
+        if((flags >> kind) & 1) {
+            *v = (struct violation){.kind = kind, .start = base + i,
+                                    .x = b->x[i], .y = b->y[i],
+                                    .llen = b->llen[i], .rlen = b->rlen[i]};
+        }
+        else {
+            v->end = base + i;
+            g_array_append_val(c->found[kind], *v);
+        }
+    }
+    c->open = flags;
+}
+
+#ifdef __SSE2__
+// Bit j set if byte j of the 4 at p is non-zero
+static int byte_mask(const guint8 *p)
+{
+    guint32 word;
+    memcpy(&word, p, sizeof(word));
+    __m128i v = _mm_cvtsi32_si128(word);
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_setzero_si128())) & 0xf;
+}
+#endif
+
+/**
+ * Checks the first n steps of b, base being the first step's index.
+ */
+static void check_batch(struct check_chunk *c, struct check_batch *b, gsize n, gsize base,
+                        coords_kernel kernel)
+{
+    const struct check_limits *k = c->limits;
+    gsize i = 0;
+
+    kernel(b->x, b->y, b->snapped, b->llen, b->rlen, n, c->data->spool_dist);
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 x0 = _mm_set1_ps(k->x0), x1 = _mm_set1_ps(k->x1);
+    const __m128 y0 = _mm_set1_ps(k->y0), y1 = _mm_set1_ps(k->y1);
+    const __m128 sd2 = _mm_set1_ps(k->sd2);
+    const __m128 sa = _mm_set1_ps(k->sin_angle), cs2 = _mm_set1_ps(k->cos_spread2);
+    const int wires_only = k->wires ? 0xf : 0;
+    for(; i + 4 <= n; i += 4) {
+        __m128 l = _mm_loadu_ps(&b->llen[i]), r = _mm_loadu_ps(&b->rlen[i]);
+        __m128 x = _mm_loadu_ps(&b->x[i]), y = _mm_loadu_ps(&b->y[i]);
+        int neg = _mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(l, zero), _mm_cmplt_ps(r, zero)));
+        int off = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmplt_ps(x, x0), _mm_cmpgt_ps(x, x1)),
+                                            _mm_or_ps(_mm_cmplt_ps(y, y0), _mm_cmpgt_ps(y, y1))));
+        __m128 spread = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(l, l), _mm_mul_ps(r, r)), sd2);
+        int angle = _mm_movemask_ps(
+            _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(y, _mm_mul_ps(l, sa)), _mm_cmplt_ps(y, _mm_mul_ps(r, sa))),
+                      _mm_cmpgt_ps(spread, _mm_mul_ps(_mm_mul_ps(l, r), cs2))));
+        int snapped = byte_mask(&b->snapped[i]);
+        off &= byte_mask(&b->pen[i]);
+        // Nearly always nothing wrong and nothing open
+        if(!(c->open | off | ((snapped | neg | angle) & wires_only))) continue;
+        for(int j = 0; j < 4; j++)
+            note_step(c, b, base, i + j, step_flags(k, (snapped >> j) & 1, (neg >> j) & 1,
+                                                    (off >> j) & 1, (angle >> j) & 1));
+    }
+#endif
+    // Same sums in the same order as above so both paths agree exactly
+    for(; i < n; i++) {
+        const float l = b->llen[i], r = b->rlen[i], x = b->x[i], y = b->y[i];
+        int neg = l < 0 || r < 0;
+        int off = x < k->x0 || x > k->x1 || y < k->y0 || y > k->y1;
+        int angle = y < l * k->sin_angle || y < r * k->sin_angle ||
+                    l * l + r * r - k->sd2 > l * r * k->cos_spread2;
+        note_step(c, b, base, i, step_flags(k, b->snapped[i], neg, off & b->pen[i], angle));
+    }
+}
+
+/**
+ * Replays a chunk's runs a step at a time, lengths worked out as
+ * integrate_chunk does, and checks them VALIDATE_BATCH at a time.
+ */
+gpointer validate_chunk(gpointer chunkp)
+{
+    struct check_chunk *c = chunkp;
+    const struct draw_data *data = c->data;
+    const coords_kernel kernel = coords_kernel_for(data->type);
+    const double start_llen = data->start_llen;
+    const double start_rlen = data->start_rlen;
+    const double step_dist = data->step_dist;
+    struct checkpoint state = c->in;
+    struct check_batch *b = g_new(struct check_batch, 1);
+    gsize n = 0;
+
+    const guint8 *p = data->steps.data + state.offset;
+    const guint8 *end = data->steps.data + c->end;
+    while(p < end) {
+        guint8 op;
+        guint64 count;
+        p = step_run(p, end, &op, &count);
+        const int dl = step_delta[(op & LEF_MASK) >> LEF_SHIFT];
+        const int dr = step_delta[(op & RIG_MASK) >> RIG_SHIFT];
+        switch((op & PEN_MASK) >> PEN_SHIFT) {
+            case POS_NUM: state.pen_down = TRUE; break;
+            case NEG_NUM: state.pen_down = FALSE; break;
+        }
+        for(guint64 j = 0; j < count; j++) {
+            state.lcount += dl;
+            state.rcount += dr;
+            b->llen[n] = start_llen + state.lcount * step_dist;
+            b->rlen[n] = start_rlen + state.rcount * step_dist;
+            b->pen[n] = state.pen_down;
+            if(++n < VALIDATE_BATCH) continue;
+            check_batch(c, b, n, state.step + j + 1 - n, kernel);
+            n = 0;
+        }
+        state.step += count;
+    }
+    check_batch(c, b, n, state.step - n, kernel);
+
+    // Anything still open runs to the end of the chunk
+    for(int kind = 0; kind < VIOLATION_KINDS; kind++) {
+        if(!((c->open >> kind) & 1)) continue;
+        c->opened[kind].end = state.step;
+        g_array_append_val(c->found[kind], c->opened[kind]);
+    }
+    g_free(b);
+    return NULL;
+}
+
+/**
+ * Checks every step of the program against ws and the paper offset, filling
+ * violations with struct violation in step order, by kind where they start
+ * together. Splits the steps between threads at run boundaries, each
+ * checking four steps at a time where there's SSE2, and nothing is printed.
+ * Returns how many there are. Only valid once recalc_lengths has run on the
+ * current steps.
+ */
+guint validate_steps(const struct draw_data *data, const struct workspace *ws,
+                     GArray *violations)
+{
+    const gsize nsteps = data->steps.nsteps;
+    const float rad = 3.14159265358979323846f / 180;
+    const struct check_limits limits = {
+        .wires = data->type == wires,
+        .x0 = data->paper_offset_x, .x1 = data->paper_offset_x + ws->paper_width,
+        .y0 = data->paper_offset_y, .y1 = data->paper_offset_y + ws->paper_height,
+        .sd2 = data->spool_dist * data->spool_dist,
+        .sin_angle = sinf(ws->min_angle * rad),
+        .cos_spread2 = 2 * cosf(ws->min_spread * rad),
+    };
+    guint n = kin_threads(data, nsteps, VALIDATE_CHUNK);
+    struct check_chunk *chunks = g_new0(struct check_chunk, n);
+    for(guint i = 0; i < n; i++) {
+        chunks[i].data = data;
+        chunks[i].limits = &limits;
+        chunks[i].in = replay_to(data, nsteps * i / n, FALSE);
+        for(int kind = 0; kind < VIOLATION_KINDS; kind++)
+            chunks[i].found[kind] = g_array_new(FALSE, FALSE, sizeof(struct violation));
+        if(i) chunks[i - 1].end = chunks[i].in.offset;
+    }
+    chunks[n - 1].end = data->steps.len;
+    run_chunks(validate_chunk, chunks, sizeof(*chunks), n);
+
+    // Join up stretches split between chunks, into the first chunk's
+    GArray **all = chunks[0].found;
+    for(guint i = 1; i < n; i++) {
+        for(int kind = 0; kind < VIOLATION_KINDS; kind++) {
+            GArray *to = all[kind], *from = chunks[i].found[kind];
+            guint skip = 0;
+            if(to->len && from->len) {
+                struct violation *last = &g_array_index(to, struct violation, to->len - 1);
+                const struct violation *first = &g_array_index(from, struct violation, 0);
+                if(last->end == first->start) {
+                    last->end = first->end;
+                    skip = 1;
+                }
+            }
+            g_array_append_vals(to, from->data + skip * sizeof(struct violation),
+                                from->len - skip);
+            g_array_free(from, TRUE);
+        }
+    }
+
+    // Then merge the kinds by start
+    guint at[VIOLATION_KINDS] = {0};
+    g_array_set_size(violations, 0);
+    for(;;) {
+        const struct violation *next = NULL;
+        int next_kind = 0;
+        for(int kind = 0; kind < VIOLATION_KINDS; kind++) {
+            if(at[kind] == all[kind]->len) continue;
+            const struct violation *v = &g_array_index(all[kind], struct violation, at[kind]);
+            if(next && v->start >= next->start) continue;
+            next = v;
+            next_kind = kind;
+        }
+        if(!next) break;
+        g_array_append_vals(violations, next, 1);
+        at[next_kind]++;
+    }
+    for(int kind = 0; kind < VIOLATION_KINDS; kind++)
+        g_array_free(all[kind], TRUE);
+    g_free(chunks);
+    return violations->len;
+}
+
+static gboolean has_violation(GArray *violations, guint i, enum violation_kind kind,
+                              gsize start, gsize end)
+{
+    if(i >= violations->len) return FALSE;
+    const struct violation *v = &g_array_index(violations, struct violation, i);
+    return v->kind == kind && v->start == start && v->end == end;
+}
+
+void validate_test()
+{
+    struct draw_data data;
+    struct workspace ws;
+    GArray *found = g_array_new(FALSE, FALSE, sizeof(struct violation));
+    draw_data_defaults(&data);
+    workspace_defaults(&ws);
+    data.nthreads = 1;
+    data.start_llen = data.start_rlen = 300;
+
+    // Pen down and straight up until the strings snap, then pen up and back
+    // down past where they did
+    step_buf_append(&data.steps, pack("..+"));
+    for(int i = 0; i < 110; i++) step_buf_append(&data.steps, pack("--."));
+    step_buf_append(&data.steps, pack("++-"));
+    for(int i = 0; i < 119; i++) step_buf_append(&data.steps, pack("++."));
+    step_buf_flush(&data.steps);
+    recalc_lengths(&data);
+    g_assert(4 == validate_steps(&data, &ws, found));
+    g_assert(has_violation(found, 0, off_paper, 100, 101));
+    g_assert(has_violation(found, 1, cable_angle, 100, 101));
+    g_assert(has_violation(found, 2, snapped_string, 101, 120));
+    g_assert(has_violation(found, 3, cable_angle, 120, 121));
+    const struct violation *v = &g_array_index(found, struct violation, 0);
+    g_assert(v->x == 200 && v->y == 0 && v->llen == 200 && v->rlen == 200);
+
+    // One string too long for the other to reach, then wound in too far
+    step_buf_clear(&data.steps);
+    data.start_llen = 3;
+    data.start_rlen = 500;
+    for(int i = 0; i < 5; i++) step_buf_append(&data.steps, pack("-.."));
+    step_buf_flush(&data.steps);
+    data.steps_version++;
+    recalc_lengths(&data);
+    g_assert(2 == validate_steps(&data, &ws, found));
+    g_assert(has_violation(found, 0, cable_angle, 0, 3));
+    g_assert(has_violation(found, 1, negative_length, 3, 5));
+
+    // The gantry only has the paper to worry about
+    data.type = planar;
+    g_assert(0 == validate_steps(&data, &ws, found));
+    data.type = wires;
+
+    // Wandering over the edge of the paper, and far enough out for the
+    // strings to close up, which has to agree with the poses and not depend
+    // on the threads
+    data.step_dist = 0.1;
+    data.start_llen = 240;
+    data.start_rlen = 260;
+    data.paper_offset_x = 190;
+    make_test_steps(&data, 4 * VALIDATE_CHUNK + 123);
+    recalc_draw_data(&data);
+    guint n = validate_steps(&data, &ws, found);
+    g_assert(n > 1);
+    gsize off = 0;
+    for(guint i = 0; i < n; i++) {
+        v = &g_array_index(found, struct violation, i);
+        g_assert(v->kind == off_paper || v->kind == cable_angle);
+        g_assert(v->start < v->end && (!i || v->start >= v[-1].start));
+        if(v->kind == off_paper) off += v->end - v->start;
+    }
+    const float *xs = data.pos_data, *ys = data.pos_data + data.nposes;
+    gsize poses_off = 0;
+    for(gsize i = 0; i < data.nposes; i++)
+        poses_off += xs[i] < 190 || xs[i] > 190 + ws.paper_width ||
+                     ys[i] < 20 || ys[i] > 20 + ws.paper_height;
+    g_assert(off == poses_off);
+
+    GArray *threaded = g_array_new(FALSE, FALSE, sizeof(struct violation));
+    data.nthreads = 4;
+    g_assert(n == validate_steps(&data, &ws, threaded));
+    g_assert(0 == memcmp(found->data, threaded->data, n * sizeof(struct violation)));
+
+    g_array_free(threaded, TRUE);
+    g_array_free(found, TRUE);
+    free_draw_data(&data);
+}
+
+/**
+ * Validation of a 100M step program with 1, 2, 4 and 8 threads.
+ * Only runs with -m perf.
+ */
+void validate_perf_test()
+{
+    if(!g_test_perf()) return;
+    struct draw_data data = {.step_dist = 0.1, .start_llen = 240, .start_rlen = 260,
+                             .spool_dist = 400, .paper_offset_y = 20};
+    struct workspace ws;
+    GArray *found = g_array_new(FALSE, FALSE, sizeof(struct violation));
+    workspace_defaults(&ws);
+    make_test_steps(&data, 100 * 1000 * 1000);
+    recalc_lengths(&data);
+    for(guint n = 1; n <= 8; n *= 2) {
+        data.nthreads = n;
+        g_test_timer_start();
+        validate_steps(&data, &ws, found);
+        double t = g_test_timer_elapsed();
+        g_test_minimized_result(t, "validation, %u threads: %.3fs, %u violations",
+                                n, t, found->len);
+    }
+    g_array_free(found, TRUE);
+    free_draw_data(&data);
+}
@@ -0,0 +1,47 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+/**
+ * The safety and workspace checks a program has to pass before it's sent,
+ * run over the steps without needing the poses worked out.
+ */
+#include <glib.h>
+
+#include "sim.h"
+
+/**
+ * What a program mustn't do to the machine or the paper, checked at every
+ * step, pen up or down, before it's sent:
+ *
+ *   snapped_string  the strings are too short to reach each other
+ *   negative_length a string wound in past its end
+ *   off_paper       the pen down outside the paper, PAPER_WIDTH by
+ *                   PAPER_HEIGHT (US legal on its side) at the paper offset
+ *   cable_angle     a string less than min_angle below horizontal, where its
+ *                   tension runs away, or the strings less than min_spread
+ *                   apart at the pen, where they can't hold it still
+ *
+ * Only off_paper applies to robots other than wires. Each violation is one
+ * stretch of consecutive steps with the same problem, steps counting from 0.
+ */
+enum violation_kind { snapped_string, negative_length, off_paper, cable_angle };
+struct workspace {
+    float paper_width, paper_height; // mm
+    float min_angle, min_spread;     // degrees
+};
+struct violation {
+    enum violation_kind kind;
+    gsize start, end; // steps [start, end)
+    // After the first of the steps, x and y are meaningless if it snapped
+    float x, y;
+    float llen, rlen;
+};
+
+const char *violation_kind_name(enum violation_kind kind);
+void workspace_defaults(struct workspace *ws);
+guint validate_steps(const struct draw_data *data, const struct workspace *ws,
+                     GArray *violations);
+
+void validate_test();
+void validate_perf_test();
+
+#endif
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#include "sim.h"
+#include "worker.h"
+
+/**
+ * read_data plus the chatter about what was read.
+ */
+static int load_file(char *fname, struct draw_data *data)
+{
+    if(read_data(fname, data) < 0) return -1;
+
+    printf("(%f, %f), %f, %f, (%f, %f)\n",
+        data->paper_offset_y,
+        data->paper_offset_x,
+        data->step_dist,
+        data->spool_dist,
+        data->start_llen,
+        data->start_rlen);
+    if(data->bad_line)
+        printf("Non-fatal error reading file, last error found on line %" G_GSIZE_FORMAT "\n", data->bad_line);
+    printf("Read %lu steps (%lu bytes) in %.3fs\n",
+        (unsigned long)data->steps.nsteps,
+        (unsigned long)data->steps.len,
+        data->load_seconds);
+#ifdef G_OS_UNIX
+    struct rusage usage;
+    if(0 == getrusage(RUSAGE_SELF, &usage))
+        printf("Peak RSS %ld kB\n", usage.ru_maxrss);
+#endif
+    return 0;
+}
+
+static void worker_lens_done(struct draw_data *back, double fraction, gpointer wp)
+{
+    struct worker *w = wp;
+
+    g_mutex_lock(&w->lock);
+    w->stage = "Integrating";
+    w->fraction = fraction;
+    w->progress(w);
+    g_mutex_unlock(&w->lock);
+}
+
+static void worker_poses_done(struct draw_data *back, gsize done, gpointer wp)
+{
+    struct worker *w = wp;
+
+    g_mutex_lock(&w->lock);
+    w->poses_ready = done;
+    w->partial = TRUE;
+    w->stage = "Computing poses";
+    w->fraction = done / (double)back->nposes;
+    w->progress(w);
+    g_mutex_unlock(&w->lock);
+}
+
+static gpointer worker_thread(gpointer wp)
+{
+    struct worker *w = wp;
+    struct draw_data *back = &w->back;
+
+    g_mutex_lock(&w->lock);
+    while(TRUE) {
+        // Nothing new until the last results have been taken
+        while(!w->quit && (!w->pending || w->done))
+            g_cond_wait(&w->wake, &w->lock);
+        if(w->quit) break;
+        struct kin_key key = w->key;
+        char *fname = w->fname;
+        w->fname = NULL;
+        w->pending = FALSE;
+        w->busy = TRUE;
+        w->loading = fname != NULL;
+        w->partial = FALSE;
+        w->stage = fname ? "Loading" : "Integrating";
+        w->fraction = 0;
+        g_atomic_int_set(&back->cancel, 0);
+        w->progress(w);
+        g_mutex_unlock(&w->lock);
+
+        back->step_dist = key.step_dist;
+        back->start_llen = key.start_llen;
+        back->start_rlen = key.start_rlen;
+        back->spool_dist = key.spool_dist;
+        back->type = key.type;
+        gboolean ok = TRUE;
+        if(fname) {
+            // Keep step versions unique between front and back
+            back->steps_version = MAX(back->steps_version, key.steps_version);
+            ok = 0 == load_file(fname, back);
+            g_free(fname);
+            g_mutex_lock(&w->lock);
+            w->stage = ok ? "Integrating" : "Failed to load";
+            w->progress(w);
+            g_mutex_unlock(&w->lock);
+        }
+        else if(back->steps_version != key.steps_version) {
+            step_buf_copy(&back->steps, &w->front->steps);
+            back->steps_version = key.steps_version;
+            back->bad_line = w->front->bad_line;
+            back->load_seconds = w->front->load_seconds;
+            back->load_bytes = w->front->load_bytes;
+        }
+        if(ok) recalc_draw_data(back);
+
+        g_mutex_lock(&w->lock);
+        w->busy = FALSE;
+        w->partial = FALSE;
+        if(ok && back->poses_valid) {
+            w->stage = "";
+            w->fraction = 1;
+            w->done = TRUE;
+            w->finished(w);
+        }
+        w->progress(w);
+    }
+    g_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Asks for front's results to be brought up to date with its settings,
+ * loading fname first if it isn't NULL.
+ */
+void worker_submit(struct worker *w, const char *fname)
+{
+    gboolean current = !fname && draw_data_current(w->front);
+
+    g_mutex_lock(&w->lock);
+    if(fname) {
+        g_free(w->fname);
+        w->fname = g_strdup(fname);
+    }
+    // A file still to be loaded needs doing whatever the settings
+    w->pending = w->fname || !current;
+    w->key = draw_data_key(w->front);
+    if(w->busy && !w->loading)
+        g_atomic_int_set(&w->back.cancel, 1);
+    g_cond_signal(&w->wake);
+    g_mutex_unlock(&w->lock);
+}
+
+/**
+ * On the main thread once finished has been called, swaps what the worker came
+ * up with into front. Returns TRUE if it loaded a file, whose settings front
+ * then has too.
+ */
+gboolean worker_take_results(struct worker *w)
+{
+    struct draw_data *front = w->front;
+
+    g_mutex_lock(&w->lock);
+    gboolean loaded = w->loading;
+    draw_data_swap_results(front, &w->back);
+    if(loaded) {
+        front->paper_offset_y = w->back.paper_offset_y;
+        front->paper_offset_x = w->back.paper_offset_x;
+        front->step_dist = w->back.step_dist;
+        front->spool_dist = w->back.spool_dist;
+        front->start_llen = w->back.start_llen;
+        front->start_rlen = w->back.start_rlen;
+        front->type = w->back.type;
+    }
+    // A job queued in the meantime was keyed on front as it was, and would
+    // now run on the old steps the swap left in back and swap them back in.
+    // Only a file still to load has to stay, anything else is resubmitted.
+    w->key = draw_data_key(front);
+    if(!w->fname) w->pending = FALSE;
+    w->done = FALSE;
+    w->results++;
+    g_cond_signal(&w->wake);
+    g_mutex_unlock(&w->lock);
+
+    // The settings may have moved on while it was working
+    if(!draw_data_current(front)) worker_submit(w, NULL);
+    return loaded;
+}
+
+void worker_start(struct worker *w, struct draw_data *front,
+                  void (*progress)(struct worker *w), void (*finished)(struct worker *w),
+                  gpointer user)
+{
+    *w = (struct worker){.front = front, .progress = progress, .finished = finished, .user = user};
+    draw_data_defaults(&w->back);
+    w->back.progress = worker_poses_done;
+    w->back.lens_progress = worker_lens_done;
+    w->back.progress_data = w;
+    g_mutex_init(&w->lock);
+    g_cond_init(&w->wake);
+    w->thread = g_thread_new("worker", worker_thread, w);
+}
+
+void worker_stop(struct worker *w)
+{
+    g_mutex_lock(&w->lock);
+    w->quit = TRUE;
+    g_atomic_int_set(&w->back.cancel, 1);
+    g_cond_signal(&w->wake);
+    g_mutex_unlock(&w->lock);
+    g_thread_join(w->thread);
+
+    g_free(w->fname);
+    free_draw_data(&w->back);
+    g_mutex_clear(&w->lock);
+    g_cond_clear(&w->wake);
+}
+
+// user is a GCond to wait on with the worker's lock
+static void worker_test_signal(struct worker *w)
+{
+    g_cond_signal(w->user);
+}
+
+/**
+ * Takes results as the GUI would until the worker has nothing left to do.
+ */
+static void worker_test_settle(struct worker *w)
+{
+    g_mutex_lock(&w->lock);
+    while(w->pending || w->busy || w->done) {
+        if(w->done) {
+            g_mutex_unlock(&w->lock);
+            worker_take_results(w);
+            g_mutex_lock(&w->lock);
+        }
+        else g_cond_wait(w->user, &w->lock);
+    }
+    g_mutex_unlock(&w->lock);
+}
+
+/**
+ * A setting changed while a file loads doesn't bring back the file before.
+ */
+void worker_test()
+{
+    gchar *old_name = g_build_filename(g_get_tmp_dir(), "robot_sim_worker_old.txt", NULL);
+    gchar *new_name = g_build_filename(g_get_tmp_dir(), "robot_sim_worker_new.txt", NULL);
+    GString *text = g_string_new("Step Distance: 0.1\n");
+    for(int i = 0; i < 1000; i++) g_string_append(text, "+-+\n");
+    g_assert(g_file_set_contents(old_name, text->str, text->len, NULL));
+    g_string_assign(text, "Step Distance: 0.2\nStart Length Left: 300\n");
+    for(int i = 0; i < 3000; i++) g_string_append(text, "-++\n");
+    g_assert(g_file_set_contents(new_name, text->str, text->len, NULL));
+    g_string_free(text, TRUE);
+
+    struct draw_data front;
+    draw_data_defaults(&front);
+    GCond cond;
+    g_cond_init(&cond);
+    struct worker w;
+    worker_start(&w, &front, worker_test_signal, worker_test_signal, &cond);
+
+    worker_submit(&w, old_name);
+    worker_test_settle(&w);
+    g_assert(front.steps.nsteps == 1000 && front.step_dist == 0.1f);
+
+    // The new file has loaded but not been taken when the setting changes
+    worker_submit(&w, new_name);
+    g_mutex_lock(&w.lock);
+    while(!w.done) g_cond_wait(&cond, &w.lock);
+    g_mutex_unlock(&w.lock);
+    front.step_dist = 0.3;
+    worker_submit(&w, NULL);
+    g_assert(worker_take_results(&w));
+    worker_test_settle(&w);
+
+    // The file's settings win, and its steps are what's shown
+    g_assert(front.steps.nsteps == 3000 && front.nposes == 3000);
+    g_assert(front.step_dist == 0.2f && front.start_llen == 300);
+    g_assert(draw_data_current(&front));
+    g_assert(fabsf(front.len_data[0] - (300 - 0.2f)) < 1e-3);
+
+    worker_stop(&w);
+    g_cond_clear(&cond);
+    free_draw_data(&front);
+    g_remove(old_name);
+    g_remove(new_name);
+    g_free(old_name);
+    g_free(new_name);
+}
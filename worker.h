@@ -0,0 +1,56 @@
+#ifndef WORKER_H
+#define WORKER_H
+/**
+ * Loading and kinematics on a thread of their own, so the GUI stays
+ * responsive. Only depends on GLib, the GUI hooks it up to its widgets
+ * through the callbacks.
+ */
+#include <glib.h>
+
+#include "sim.h"
+
+/**
+ * The worker fills in back while front is what's shown, and the main thread
+ * takes the results over with worker_take_results when it's done. In the
+ * meantime the poses it has finished can be drawn from back, with lock held.
+ * Asking for a different computation cancels the one in progress, unless
+ * it's loading a file which has to be seen through.
+ */
+struct worker {
+    GThread *thread;
+    GMutex lock;
+    GCond wake;
+    // Guarded by lock
+    gboolean quit;
+    gboolean pending; // there's a job waiting
+    struct kin_key key; // its settings, taken from front
+    char *fname; // and a file for it to load first, if not NULL
+    gboolean busy, loading;
+    gboolean done; // waiting for the main thread to take the results
+    gboolean partial; // back's first poses_ready poses can be drawn
+    gsize poses_ready;
+    const char *stage;
+    double fraction;
+    // Only the main thread touches front, except that the worker reads its
+    // steps while busy, which only change when it's done
+    struct draw_data *front;
+    struct draw_data back;
+    guint results; // bumped whenever front gets new results
+    // Called on the worker thread with lock held, to hand over to the main
+    // thread: progress when the stage, fraction or partial poses change and
+    // finished when there are results for worker_take_results
+    void (*progress)(struct worker *w);
+    void (*finished)(struct worker *w);
+    gpointer user;
+};
+
+void worker_start(struct worker *w, struct draw_data *front,
+                  void (*progress)(struct worker *w), void (*finished)(struct worker *w),
+                  gpointer user);
+void worker_stop(struct worker *w);
+void worker_submit(struct worker *w, const char *fname);
+gboolean worker_take_results(struct worker *w);
+
+void worker_test();
+
+#endif